@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "./agent.hpp"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cli/key_management.hpp"
+#include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
+
+namespace
+{
+constexpr std::size_t length_size = sizeof(std::uint32_t);
+
+void read_exact(int socket_fd, std::span<unsigned char> buffer)
+{
+  while (!buffer.empty()) {
+    const ssize_t bytes_read = read(socket_fd, buffer.data(), buffer.size());
+    if (bytes_read == 0) {
+      throw std::runtime_error("Agent connection closed");
+    }
+    if (bytes_read == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::format(
+          "Could not read from agent; Errno {} [{}]", errno, strerror(errno)));
+    }
+    buffer = buffer.subspan(static_cast<std::size_t>(bytes_read));
+  }
+}
+
+void write_all(int socket_fd, std::span<const unsigned char> data)
+{
+  while (!data.empty()) {
+    // Not raising SIGPIPE if the other end went away
+    const ssize_t written =
+        send(socket_fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::format(
+          "Could not write to agent; Errno {} [{}]", errno, strerror(errno)));
+    }
+    data = data.subspan(static_cast<std::size_t>(written));
+  }
+}
+
+auto connect_socket(const std::filesystem::path& socket_path) -> int
+{
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.native().size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Agent socket path is too long");
+  }
+  std::ranges::copy(socket_path.native(), std::begin(address.sun_path));
+  const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd == -1) {
+    throw std::runtime_error("Could not create socket");
+  }
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  if (connect(socket_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+      == -1)
+  {
+    close(socket_fd);
+    throw std::runtime_error("Could not connect to agent");
+  }
+  return socket_fd;
+}
+
+auto ask_agent(const std::filesystem::path& socket_path,
+               agent_request request,
+               std::span<const unsigned char> payload)
+    -> safe_vector<unsigned char>
+{
+  const smart_fd socket_fd {connect_socket(socket_path)};
+  // Anyone could have placed a socket at the path
+  if (!peer_is_same_user(socket_fd.fd)) {
+    throw std::runtime_error("Agent runs as a different user");
+  }
+  safe_vector<unsigned char> message {static_cast<unsigned char>(request)};
+  message.insert(message.end(), payload.begin(), payload.end());
+  send_agent_message(socket_fd.fd, message);
+  auto response = receive_agent_message(socket_fd.fd);
+  if (response.empty() || response.front() != agent_status_ok) {
+    throw std::invalid_argument("Agent could not answer the request");
+  }
+  response.erase(response.begin());
+  return response;
+}
+}  // namespace
+
+auto default_agent_socket_path() -> std::filesystem::path
+{
+  // NOLINTBEGIN(concurrency-mt-unsafe)
+  if (auto* const agent_socket = std::getenv("DIARIA_AGENT_SOCK")) {
+    return agent_socket;
+  }
+  if (auto* const runtime_dir = std::getenv("XDG_RUNTIME_DIR")) {
+    return std::filesystem::path(runtime_dir) / "diaria" / "agent.sock";
+  }
+  // NOLINTEND(concurrency-mt-unsafe)
+  return std::filesystem::path("/tmp") / std::format("diaria-{}", getuid())
+      / "agent.sock";
+}
+
+void send_agent_message(int socket_fd, std::span<const unsigned char> message)
+{
+  if (message.size() > agent_max_message_size) {
+    throw std::invalid_argument("Agent message is too large");
+  }
+  std::array<unsigned char, length_size> length {};
+  for (std::size_t byte = 0; byte < length.size(); ++byte) {
+    length.at(byte) = static_cast<unsigned char>(message.size() >> (8U * byte));
+  }
+  write_all(socket_fd, length);
+  write_all(socket_fd, message);
+}
+
+auto receive_agent_message(int socket_fd) -> safe_vector<unsigned char>
+{
+  std::array<unsigned char, length_size> length {};
+  read_exact(socket_fd, length);
+  std::size_t message_size = 0;
+  for (std::size_t byte = 0; byte < length.size(); ++byte) {
+    message_size |= std::size_t {length.at(byte)} << (8U * byte);
+  }
+  if (message_size > agent_max_message_size) {
+    throw std::invalid_argument("Agent message is too large");
+  }
+  safe_vector<unsigned char> message(message_size);
+  read_exact(socket_fd, message);
+  return message;
+}
+
+auto peer_is_same_user(int socket_fd) -> bool
+{
+  ucred credentials {};
+  socklen_t credentials_size = sizeof(credentials);
+  if (getsockopt(socket_fd,
+                 SOL_SOCKET,
+                 SO_PEERCRED,
+                 &credentials,
+                 &credentials_size)
+      == -1)
+  {
+    return false;
+  }
+  return credentials.uid == geteuid();
+}
+
+auto agent_is_listening(const std::filesystem::path& socket_path) -> bool
+{
+  try {
+    const smart_fd socket_fd {connect_socket(socket_path)};
+    return true;
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+agent_box_opener::agent_box_opener(std::filesystem::path in_socket_path)
+    : socket_path(std::move(in_socket_path))
+{
+}
+
+auto agent_box_opener::open(std::span<const unsigned char> sealed) const
+    -> safe_vector<unsigned char>
+{
+  return ask_agent(socket_path, agent_request::open, sealed);
+}
+
+auto connect_agent(const key_repo_paths_t& paths)
+    -> std::unique_ptr<box_opener>
+{
+  auto socket_path = default_agent_socket_path();
+  if (!std::filesystem::exists(socket_path)) {
+    return nullptr;
+  }
+  try {
+    const auto public_key = read_file(paths.get_pubkey_path());
+    // The agent might have been started for another key repository
+    if (!std::ranges::equal(
+            ask_agent(socket_path, agent_request::identify, {}), public_key))
+    {
+      return nullptr;
+    }
+  } catch (const std::exception&) {
+    // Agent not running anymore, fall back to unlocking the key
+    return nullptr;
+  }
+  return std::make_unique<agent_box_opener>(std::move(socket_path));
+}
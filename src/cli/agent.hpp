@@ -0,0 +1,79 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <span>
+
+#include "cli/key_management.hpp"
+#include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
+
+/**
+Socket of the key agent, $DIARIA_AGENT_SOCK if set, otherwise in the runtime
+directory of the user
+*/
+auto default_agent_socket_path() -> std::filesystem::path;
+
+/**
+Requests the key agent answers.
+
+Every message is its length as 4 bytes little endian, followed by the content.
+A request starts with its kind and a response with one of the status bytes.
+*/
+enum class agent_request : unsigned char
+{
+  /**
+  Respond with the public key belonging to the private key held by the agent
+  */
+  identify = 'I',
+  /**
+  Open the box following the request kind
+  */
+  open = 'O',
+};
+
+constexpr unsigned char agent_status_ok = 0;
+constexpr unsigned char agent_status_failed = 1;
+
+/**
+Version 0 entries are opened as a whole, so this bounds their size when
+reading them through the agent
+*/
+constexpr std::size_t agent_max_message_size = 64UL * 1024 * 1024;
+
+void send_agent_message(int socket_fd, std::span<const unsigned char> message);
+
+auto receive_agent_message(int socket_fd) -> safe_vector<unsigned char>;
+
+/**
+Whether the other end of the socket runs as the same user as this process
+*/
+auto peer_is_same_user(int socket_fd) -> bool;
+
+/**
+Whether an agent accepts connections on the socket
+*/
+auto agent_is_listening(const std::filesystem::path& socket_path) -> bool;
+
+/**
+Opens boxes by asking the key agent, the private key never leaves the agent.
+Every request uses a connection of its own, so it can be used by several
+threads at once.
+*/
+class agent_box_opener final : public box_opener
+{
+  std::filesystem::path socket_path;
+
+public:
+  explicit agent_box_opener(std::filesystem::path in_socket_path);
+
+  [[nodiscard]] auto open(std::span<const unsigned char> sealed) const
+      -> safe_vector<unsigned char> override;
+};
+
+/**
+Opener using the running key agent, if there is one holding the private key of
+the key repository
+*/
+auto connect_agent(const key_repo_paths_t& paths)
+    -> std::unique_ptr<box_opener>;
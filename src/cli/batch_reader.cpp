@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+#include "./batch_reader.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
+
+#ifdef DIARIA_WITH_IO_URING
+#  include <liburing.h>
+#endif
+
+namespace
+{
+void read_files_sequentially(std::span<const std::filesystem::path> paths,
+                             std::span<batch_read_file> files)
+{
+  for (std::size_t index = 0; index < paths.size(); ++index) {
+    const smart_fd input_fd {open_sequential(paths[index])};
+    if (input_fd.fd == -1) {
+      files[index].error = errno;
+      continue;
+    }
+    try {
+      files[index].contents = read_fd(input_fd.fd);
+    } catch (const std::exception&) {
+      files[index].error = EIO;
+    }
+  }
+}
+
+#ifdef DIARIA_WITH_IO_URING
+/**
+Reads the files through a ring. Every file is opened, sized with fstat once
+open, and read with as few requests as the kernel allows.
+*/
+class uring_batch
+{
+  enum class stage : std::uint8_t
+  {
+    open,
+    read,
+  };
+
+  io_uring ring {};
+  std::span<const std::filesystem::path> paths;
+  std::span<batch_read_file> files;
+  std::vector<int> fds;
+  std::vector<std::size_t> filled;
+  std::size_t next_open = 0;
+  std::size_t in_flight = 0;
+
+  static auto encode(std::size_t index, stage current) -> std::uint64_t
+  {
+    return (static_cast<std::uint64_t>(index) << 1U)
+        | static_cast<std::uint64_t>(current);
+  }
+
+  void queue_open(std::size_t index)
+  {
+    io_uring_sqe* const sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_openat(
+        sqe, AT_FDCWD, paths[index].c_str(), O_RDONLY | O_CLOEXEC, 0);
+    io_uring_sqe_set_data64(sqe, encode(index, stage::open));
+    ++in_flight;
+  }
+
+  void queue_read(std::size_t index)
+  {
+    auto& contents = files[index].contents;
+    // Larger files are read in several requests
+    constexpr std::size_t max_read_size = 1UL << 30U;
+    const auto read_size =
+        std::min(contents.size() - filled[index], max_read_size);
+    io_uring_sqe* const sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_read(sqe,
+                       fds[index],
+                       contents.data() + filled[index],
+                       static_cast<unsigned>(read_size),
+                       filled[index]);
+    io_uring_sqe_set_data64(sqe, encode(index, stage::read));
+    ++in_flight;
+  }
+
+  /**
+  Close the file a completion opened, for completions which are not handled
+  */
+  static void discard(const io_uring_cqe* cqe)
+  {
+    const auto data = io_uring_cqe_get_data64(cqe);
+    if (static_cast<stage>(data & 1U) == stage::open && cqe->res >= 0) {
+      close(cqe->res);
+    }
+  }
+
+  void fail(std::size_t index, int error)
+  {
+    files[index].error = error;
+    files[index].contents.clear();
+    if (fds[index] != -1) {
+      close(fds[index]);
+      fds[index] = -1;
+    }
+  }
+
+  void opened(std::size_t index, int result)
+  {
+    if (result < 0) {
+      fail(index, -result);
+      return;
+    }
+    fds[index] = result;
+    const auto size = fd_size_hint(fds[index]);
+    if (!size) {
+      fail(index, EINVAL);
+      return;
+    }
+    // One spare byte notices a file growing since it was sized
+    files[index].contents.resize(static_cast<std::size_t>(*size) + 1);
+    queue_read(index);
+  }
+
+  void was_read(std::size_t index, int result)
+  {
+    if (result < 0) {
+      fail(index, -result);
+      return;
+    }
+    filled[index] += static_cast<std::size_t>(result);
+    auto& contents = files[index].contents;
+    if (result > 0 && filled[index] < contents.size()) {
+      queue_read(index);
+      return;
+    }
+    if (result > 0) {
+      // Grown beyond the spare byte, the rest is read directly. Reads of the
+      // ring do not move the file offset.
+      try {
+        lseek(fds[index], static_cast<off_t>(filled[index]), SEEK_SET);
+        const auto rest = read_fd(fds[index]);
+        contents.insert(contents.end(), rest.begin(), rest.end());
+        filled[index] = contents.size();
+      } catch (const std::exception&) {
+        fail(index, EIO);
+        return;
+      }
+    }
+    contents.resize(filled[index]);
+    close(fds[index]);
+    fds[index] = -1;
+  }
+
+public:
+  uring_batch(std::span<const std::filesystem::path> in_paths,
+              std::span<batch_read_file> in_files)
+      : paths(in_paths)
+      , files(in_files)
+      , fds(in_paths.size(), -1)
+      , filled(in_paths.size(), 0)
+  {
+  }
+  uring_batch(const uring_batch&) = delete;
+  uring_batch(uring_batch&&) = delete;
+  auto operator=(const uring_batch&) -> uring_batch& = delete;
+  auto operator=(uring_batch&&) -> uring_batch& = delete;
+  ~uring_batch()
+  {
+    for (const int file_fd : fds) {
+      if (file_fd != -1) {
+        close(file_fd);
+      }
+    }
+  }
+
+  /**
+  Whether the ring read all files, which have to be read otherwise if not
+  */
+  auto run(std::size_t depth) -> bool
+  {
+    if (io_uring_queue_init(static_cast<unsigned>(depth), &ring, 0) < 0) {
+      return false;
+    }
+    // Every file has at most one request in flight, so the number of files
+    // being worked on bounds the queue
+    bool failed = false;
+    while (!failed && (next_open < paths.size() || in_flight > 0)) {
+      while (next_open < paths.size() && in_flight < depth) {
+        queue_open(next_open++);
+      }
+      const int submitted = io_uring_submit_and_wait(&ring, 1);
+      if (submitted == -EINTR) {
+        continue;
+      }
+      failed = submitted < 0;
+      io_uring_cqe* cqe = nullptr;
+      unsigned head = 0;
+      unsigned seen = 0;
+      io_uring_for_each_cqe(&ring, head, cqe)
+      {
+        const auto data = io_uring_cqe_get_data64(cqe);
+        const auto index = static_cast<std::size_t>(data >> 1U);
+        --in_flight;
+        if (failed) {
+          discard(cqe);
+          fail(index, EIO);
+        } else if (static_cast<stage>(data & 1U) == stage::open) {
+          opened(index, cqe->res);
+        } else {
+          was_read(index, cqe->res);
+        }
+        ++seen;
+      }
+      io_uring_cq_advance(&ring, seen);
+    }
+    // Requests still in flight write into the buffers, so they have to
+    // complete before the buffers are released
+    while (in_flight > 0) {
+      io_uring_cqe* cqe = nullptr;
+      const int waited = io_uring_wait_cqe(&ring, &cqe);
+      if (waited == -EINTR) {
+        continue;
+      }
+      if (waited < 0) {
+        // Nothing sensible left to do with memory the kernel may still write
+        std::terminate();
+      }
+      discard(cqe);
+      io_uring_cqe_seen(&ring, cqe);
+      --in_flight;
+    }
+    io_uring_queue_exit(&ring);
+    return !failed;
+  }
+};
+#endif
+}  // namespace
+
+auto read_files(std::span<const std::filesystem::path> paths,
+                std::size_t depth) -> std::vector<batch_read_file>
+{
+  std::vector<batch_read_file> files(paths.size());
+#ifdef DIARIA_WITH_IO_URING
+  if (uring_batch batch {paths, files}; batch.run(depth)) {
+    return files;
+  }
+  files.assign(paths.size(), batch_read_file {});
+#else
+  static_cast<void>(depth);
+#endif
+  read_files_sequentially(paths, files);
+  return files;
+}
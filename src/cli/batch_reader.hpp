@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "cli/entry_pack.hpp"
+#include "util/parallel.hpp"
+
+/**
+Content of a file read by `read_files`, or the errno of opening or reading it
+*/
+struct batch_read_file
+{
+  std::vector<unsigned char> contents;
+  int error {};
+};
+
+/**
+Number of requests `read_files` keeps in flight
+*/
+constexpr std::size_t batch_read_depth = 32;
+
+/**
+Read all the files, in the order of `paths`.
+
+Built with io_uring, the files are opened and read with up to `depth` requests
+in flight, so the latency of reading one file is hidden behind the others.
+Without it, or if the kernel refuses to set up a ring, the files are read one
+after another.
+*/
+auto read_files(std::span<const std::filesystem::path> paths,
+                std::size_t depth = batch_read_depth)
+    -> std::vector<batch_read_file>;
+
+/**
+Number of files read at once by `parallel_for_each_file`, which bounds the
+memory taken by files waiting to be processed
+*/
+constexpr std::size_t batch_read_window = 64;
+
+/**
+Read the files in batches using `read_files`, handing them to
+`ordered_parallel_for_each`. Entries stored in packs are handed out as slices
+of the mapped pack instead.
+
+`work` is called as `work(worker, index, contents)`, with `index` being the
+position of the file in `paths`. `consume` is called with its results on the
+calling thread like for `ordered_parallel_for_each`.
+*/
+template<typename Work, typename Consume>
+void parallel_for_each_file(std::span<const std::filesystem::path> paths,
+                            std::size_t jobs,
+                            Work&& work,
+                            Consume&& consume)
+{
+  entry_pack_cache packs {};
+  for (std::size_t start = 0; start < paths.size();
+       start += batch_read_window)
+  {
+    const auto window = paths.subspan(
+        start, std::min(batch_read_window, paths.size() - start));
+    std::vector<std::span<const unsigned char>> contents(window.size());
+    std::vector<int> errors(window.size());
+    std::vector<std::filesystem::path> loose_paths {};
+    std::vector<std::size_t> loose_indices {};
+    for (std::size_t index = 0; index < window.size(); ++index) {
+      if (const auto packed = packs.contents(window[index])) {
+        contents[index] = *packed;
+      } else {
+        loose_paths.push_back(window[index]);
+        loose_indices.push_back(index);
+      }
+    }
+    const auto files = read_files(loose_paths);
+    for (std::size_t loose = 0; loose < files.size(); ++loose) {
+      contents[loose_indices[loose]] = files[loose].contents;
+      errors[loose_indices[loose]] = files[loose].error;
+    }
+    bool proceed = true;
+    ordered_parallel_for_each(
+        std::views::iota(std::size_t {0}, window.size()),
+        jobs,
+        [&work, &contents, &errors, start](std::size_t worker,
+                                           std::size_t index)
+        {
+          if (errors[index] != 0) {
+            throw std::runtime_error("Could not read entry file");
+          }
+          return work(worker, start + index, contents[index]);
+        },
+        [&consume, &proceed](auto&& result)
+        {
+          proceed = consume(result);
+          return proceed;
+        });
+    if (!proceed) {
+      return;
+    }
+  }
+}
@@ -1,9 +1,14 @@
+#include <map>
 #include <memory>
+#include <string>
 
 #include "./cli_commands.hpp"
 
 #include "cli/command_types.hpp"
 #include "cli/commands/add_entry.hpp"
+#include "crypto/compress.hpp"
+#include "crypto/secure_memory.hpp"
+#include "crypto/stream.hpp"
 #include "project_info.hpp"
 #include "xdg_paths.hpp"
 
@@ -68,6 +73,72 @@ base::base()
                     return true;
                   })
       ->description("File to read for the password to unlock the private key.");
+  const std::map<std::string, compression_codec> codec_names {
+      {"xz", compression_codec::xz},
+      {"zstd", compression_codec::zstd},
+      {"lz4", compression_codec::lz4},
+      {"none", compression_codec::none},
+  };
+  app->add_option("--compression_codec",
+                  compression.codec,
+                  "Codec used to compress new entries")
+      ->transform(CLI::CheckedTransformer(codec_names, CLI::ignore_case))
+      ->default_str("xz");
+  app->add_option("--compression_preset",
+                  compression.preset,
+                  "xz preset level used for new entries")
+      ->check(CLI::Range(0, 9))
+      ->capture_default_str();
+  app->add_flag("--adaptive_compression,!--no_adaptive_compression",
+                compression.adaptive,
+                "Fit the compression dictionary and match finder to the "
+                "size of the entry")
+      ->capture_default_str();
+  app->add_option("--extreme_compression_above",
+                  compression.extreme_threshold,
+                  "Use the extreme variant of the preset for entries of at "
+                  "least this many bytes, 0 to disable")
+      ->capture_default_str();
+  app->add_option("--threaded_compression_above",
+                  compression.threaded_threshold,
+                  "Compress xz entries of at least this many bytes in blocks "
+                  "using several threads, and decompress them the same way, 0 "
+                  "to disable")
+      ->capture_default_str();
+  app->add_option("--compression_threads",
+                  compression.threads,
+                  "Threads for compressing large entries, 0 for one per core")
+      ->capture_default_str();
+  app->add_option("--compression_block_size",
+                  compression.block_size,
+                  "Bytes of a large entry compressed by a single thread, 0 to "
+                  "divide it evenly between the threads")
+      ->capture_default_str();
+  const std::map<std::string, stream_cipher> cipher_names {
+      {"xchacha20", stream_cipher::xchacha20poly1305},
+      {"aes256gcm", stream_cipher::aes256gcm},
+      {"auto", preferred_stream_cipher()},
+  };
+  app->add_option("--cipher",
+                  cipher,
+                  "Cipher used to encrypt new entries. Entries using aes256gcm "
+                  "can only be read on CPUs with AES instructions, auto picks "
+                  "it if this CPU has them")
+      ->transform(CLI::CheckedTransformer(cipher_names, CLI::ignore_case))
+      ->default_str("xchacha20");
+  app->add_option_function<std::string>(
+         "--secure_memory",
+         [](const std::string& name)
+         { select_secure_memory_backend(parse_secure_memory_kind(name)); },
+         "Where large buffers holding secrets are allocated, memfd_secret "
+         "needs a kernel with secretmem enabled")
+      ->check(CLI::IsMember({"sodium", "mlock", "memfd_secret"}))
+      ->default_str("sodium");
+  app->add_option("-j,--jobs",
+                  jobs,
+                  "Number of threads for processing many entries, 0 for one "
+                  "per core")
+      ->capture_default_str();
   app->set_config("-c,--config", configpath.generic_string());
   return app;
 }
@@ -103,10 +174,18 @@ auto add::create_command(base& base_command) -> CLI::App_p
   subcom_add->add_flag("--no-sandbox",
                        no_sandbox,
                        "Disable mount namespace sandboxing of editor");
+  subcom_add->add_flag("--verify",
+                       verify,
+                       "Read the entry back after writing it, to check it "
+                       "was stored correctly");
   const std::function<void()> add_callback = [&keyrepo = base_command.keyrepo,
+                                              &compression =
+                                                  base_command.compression,
+                                              &cipher = base_command.cipher,
                                               &repopath = base_command.repopath,
                                               &cmdline = cmdline,
                                               no_sandbox = no_sandbox,
+                                              &verify = verify,
                                               &input_path = input_path,
                                               &output_path = output_path]()
   {
@@ -128,11 +207,14 @@ auto add::create_command(base& base_command) -> CLI::App_p
     } else {
       auto bla = repo_entry_writer {};
       bla.repo_path = repopath;
+      bla.keyrepo = keyrepo;
       output = std::make_unique<repo_entry_writer>(bla);
     }
-    add_entry(std::make_unique<file_entry_encryptor_initializer>(keyrepo),
+    add_entry(std::make_unique<file_entry_encryptor_initializer>(
+                  keyrepo, compression, cipher),
               std::move(input),
-              std::move(output));
+              std::move(output),
+              verify);
   };
   subcom_add->final_callback(add_callback);
   return subcom_add;
@@ -1,9 +1,12 @@
 #pragma once
+#include <cstddef>
 #include <memory>
 
 #include "CLI11/CLI11.hpp"
 #include "cli/command_types.hpp"
 #include "cli/key_management.hpp"
+#include "crypto/compress.hpp"
+#include "crypto/stream.hpp"
 namespace cli_commands
 {
 struct base
@@ -12,6 +15,12 @@ struct base
   repo_path_t repopath;
   std::filesystem::path configpath;
   std::unique_ptr<password_provider> password;
+  compression_options compression;
+  stream_cipher cipher {stream_cipher::xchacha20poly1305};
+  /**
+  Threads for bulk operations, 0 for one per core
+  */
+  std::size_t jobs {};
 
   base();
 
@@ -23,6 +32,7 @@ struct add
   std::optional<input_file_t> input_path;
   std::optional<output_file_t> output_path;
   bool no_sandbox {};
+  bool verify {};
   std::string cmdline {"vim %"};
 
   [[nodiscard]] auto create_command(base& base_command) -> CLI::App_p;
@@ -1,12 +1,17 @@
+#include <filesystem>
 #include <fstream>
-#include <ios>
+#include <memory>
 #include <string>
+#include <utility>
 
 #include "./command_types.hpp"
 
+#include "cli/agent.hpp"
 #include "cli/key_management.hpp"
+#include "crypto/compress.hpp"
 #include "crypto/secret_key.hpp"
-#include "util/char.hpp"
+#include "crypto/stream.hpp"
+#include "util/file_io.hpp"
 
 namespace
 {
@@ -14,10 +19,7 @@ template<typename T>
 auto load_file(const std::filesystem::path& file_path) -> T
 {
   T key {};
-  std::ifstream key_file((file_path).c_str(), std::ios::in | std::ios::binary);
-  key_file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-  key_file.read(make_signed_char(key.data()),
-                static_cast<std::streamsize>(key.size()));
+  read_file_start(file_path, key);
   return key;
 }
 
@@ -27,7 +29,18 @@ auto file_entry_encryptor_initializer::init() -> entry_encryptor
 {
   auto symkey = load_file<symkey_t>(paths.get_symkey_path());
   auto public_key = load_file<public_key_t>(paths.get_pubkey_path());
-  return {.symkey = std::move(symkey), .public_key = public_key};
+  compression_context context {compression};
+  if (std::filesystem::exists(paths.get_dictionary_path())) {
+    auto dictionary =
+        load_dictionary(paths.get_dictionary_path(), symkey_span_t {symkey});
+    const auto dictionary_id = dictionary.id;
+    context.add_dictionary(std::move(dictionary));
+    context.use_dictionary(dictionary_id);
+  }
+  return {.symkey = std::move(symkey),
+          .public_key = public_key,
+          .context = std::move(context),
+          .cipher = cipher};
 }
 
 auto stored_password_provider::provide() -> safe_string
@@ -50,12 +63,35 @@ auto file_password_provider::provide() -> safe_string
   return password;
 }
 
-auto file_entry_decryptor_initializer::init() -> entry_decryptor
+auto unlock_private_key(const key_repo_paths_t& paths, password_provider& pp)
+    -> private_key_t
 {
-  auto symkey = load_file<symkey_t>(paths.get_symkey_path());
   auto private_key_raw = load_file<stored_secret_key::serialized_key_t>(
       paths.get_private_key_path());
   const stored_secret_key pkey(private_key_raw);
-  auto private_key = pkey.extract_key(pp->provide());
-  return {.symkey = std::move(symkey), .private_key = std::move(private_key)};
+  return pkey.extract_key(pp.provide());
+}
+
+auto file_entry_decryptor_initializer::init() -> entry_decryptor
+{
+  auto symkey = load_file<symkey_t>(paths.get_symkey_path());
+  // The agent has already unlocked the private key, which saves the password
+  // prompt and the key derivation
+  std::unique_ptr<box_opener> opener = connect_agent(paths);
+  if (!opener) {
+    opener =
+        std::make_unique<private_key_opener>(unlock_private_key(paths, *pp));
+  }
+  compression_context context {compression};
+  if (std::filesystem::exists(paths.get_dictionary_archive_path())) {
+    for (const auto& dictionary_file : std::filesystem::directory_iterator(
+             paths.get_dictionary_archive_path()))
+    {
+      context.add_dictionary(
+          load_dictionary(dictionary_file.path(), symkey_span_t {symkey}));
+    }
+  }
+  return {.symkey = std::move(symkey),
+          .opener = std::move(opener),
+          .context = std::move(context)};
 }
\ No newline at end of file
@@ -3,7 +3,17 @@
 #include <memory>
 #include <utility>
 
+#include <sys/stat.h>
+
 #include "cli/key_management.hpp"
+#include "crypto/compress.hpp"
+#include "crypto/stream.hpp"
+
+/**
+Mode of the files entries are written to, before the umask is applied
+*/
+constexpr mode_t entry_file_mode =
+    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 
 struct input_file_t
 {
@@ -35,8 +45,15 @@ struct entry_encryptor_initializer
 struct file_entry_encryptor_initializer : entry_encryptor_initializer
 {
   key_repo_paths_t paths;
-  explicit file_entry_encryptor_initializer(key_repo_paths_t in_paths)
+  compression_options compression;
+  stream_cipher cipher;
+  explicit file_entry_encryptor_initializer(
+      key_repo_paths_t in_paths,
+      compression_options in_compression = {},
+      stream_cipher in_cipher = stream_cipher::xchacha20poly1305)
       : paths(std::move(in_paths))
+      , compression(in_compression)
+      , cipher(in_cipher)
   {
   }
   auto init() -> entry_encryptor override;
@@ -71,14 +88,28 @@ struct file_password_provider : password_provider
   auto provide() -> safe_string override;
 };
 
+/**
+Read the private key and unlock it with the password
+*/
+auto unlock_private_key(const key_repo_paths_t& paths, password_provider& pp)
+    -> private_key_t;
+
+/**
+Uses the key agent if one is running for the keys, otherwise unlocks the
+private key with the password. Entries are decompressed with the threading
+options of `compression`.
+*/
 struct file_entry_decryptor_initializer : entry_decryptor_initializer
 {
   std::unique_ptr<password_provider> pp;
   key_repo_paths_t paths;
+  compression_options compression;
   file_entry_decryptor_initializer(std::unique_ptr<password_provider>&& in_pp,
-                                   key_repo_paths_t in_paths)
+                                   key_repo_paths_t in_paths,
+                                   compression_options in_compression = {})
       : pp(std::move(in_pp))
       , paths(std::move(in_paths))
+      , compression(in_compression)
   {
   }
   auto init() -> entry_decryptor override;
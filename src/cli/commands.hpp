@@ -1,6 +1,8 @@
 #pragma once
 
 #include "commands/add_entry.hpp"  // IWYU pragma: export
+#include "commands/agent.hpp"  // IWYU pragma: export
+#include "commands/dictionary.hpp"  // IWYU pragma: export
 #include "commands/init.hpp"  // IWYU pragma: export
 #include "commands/read_entry.hpp"  // IWYU pragma: export
 #include "commands/repo.hpp"  // IWYU pragma: export
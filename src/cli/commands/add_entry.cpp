@@ -3,10 +3,8 @@
 #include <chrono>
 #include <filesystem>
 #include <format>
-#include <fstream>
-#include <ios>
-#include <iostream>
-#include <iterator>
+#include <functional>
+#include <future>
 #include <memory>
 #include <print>
 #include <span>
@@ -16,6 +14,7 @@
 #include "./add_entry.hpp"
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -25,7 +24,12 @@
 #include "cli/command_types.hpp"
 #include "cli/editor.hpp"
 #include "cli/key_management.hpp"
-#include "util/char.hpp"
+#include "cli/repo_index.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/secret_key.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
 
 namespace
 {
@@ -37,72 +41,89 @@ auto get_iso_timestamp_utc() -> std::string
 }
 }  // namespace
 
-auto file_input_reader::get_plaintext() -> safe_vector<unsigned char>
+auto file_input_reader::get_plaintext(
+    const std::function<void()>& while_waiting) -> safe_vector<unsigned char>
 {
-  std::ifstream stream(input_file.p, std::ios::in | std::ios::binary);
-  if (stream.fail()) {
+  // The file might be a pipe still being written to
+  while_waiting();
+  const smart_fd input_fd {open_sequential(input_file.p)};
+  if (input_fd.fd == -1) {
     throw std::runtime_error("Could not open input file");
   }
-  safe_vector<unsigned char> contents((std::istreambuf_iterator<char>(stream)),
-                                      std::istreambuf_iterator<char>());
-
-  if (stream.fail()) {
-    throw std::runtime_error("Could not read input file");
-  }
-  return contents;
+  return read_fd<safe_vector<unsigned char>>(input_fd.fd);
 }
 
-auto editor_input_reader::get_plaintext() -> safe_vector<unsigned char>
+auto editor_input_reader::get_plaintext(
+    const std::function<void()>& while_waiting) -> safe_vector<unsigned char>
 {
-  return interactive_content_entry(cmdline, std::filesystem::path {"/tmp"});
+  return interactive_content_entry(
+      cmdline, std::filesystem::path {"/tmp"}, while_waiting);
 }
 
-auto sandbox_editor_input_reader::get_plaintext() -> safe_vector<unsigned char>
+auto sandbox_editor_input_reader::get_plaintext(
+    const std::function<void()>& while_waiting) -> safe_vector<unsigned char>
 {
-  return private_namespace_read(cmdline);
+  return private_namespace_read(cmdline, while_waiting);
 }
 
 namespace
 {
-void write_to_file(const std::filesystem::path& filename,
-                   std::span<const unsigned char> data)
+/**
+A crash while writing leaves no torn entry behind, either the complete entry
+or nothing at all
+*/
+void write_entry_file(const std::filesystem::path& filename,
+                      std::span<const unsigned char> data)
 {
   std::filesystem::create_directories(filename.parent_path());
+  write_file_durably(filename, data, entry_file_mode);
+}
+}  // namespace
 
-  std::ofstream entry_file(filename.c_str(),
-                           std::ios::out | std::ios::binary | std::ios::trunc);
-  if (entry_file.fail()) {
-    throw std::runtime_error(
-        std::format("Could not open output file \"{}\"", filename.c_str()));
-  }
-  entry_file.write(make_signed_char(data.data()),
-                   static_cast<std::streamsize>(data.size()));
-
-  if (entry_file.fail()) {
-    throw std::runtime_error("Could not write to output file");
+auto file_entry_writer::verify_entry(
+    std::span<const unsigned char> ciphertext) const -> void
+{
+  if (!std::ranges::equal(read_file(written_path), ciphertext)) {
+    throw std::runtime_error(std::format(
+        "Entry written to \"{}\" does not read back as written",
+        written_path.c_str()));
   }
 }
-}  // namespace
 
 auto repo_entry_writer::write_entry(std::span<const unsigned char> ciphertext)
     -> void
 {
-  write_to_file(
-      repo_path.repo / std::format("{}.diaria", get_iso_timestamp_utc()),
-      ciphertext);
+  const auto symkey = load_symkey(keyrepo);
+  repo_index_update index {repo_path, symkey_span_t {symkey}};
+  const auto entry_path = entry_path_for(
+      repo_path, std::format("{}.diaria", get_iso_timestamp_utc()));
+  write_entry_file(entry_path, ciphertext);
+  written_path = entry_path;
+  index.add(entry_path);
+  index.store();
 }
 
 auto outfile_entry_writer::write_entry(
     std::span<const unsigned char> ciphertext) -> void
 {
-  write_to_file(outfile.p, ciphertext);
+  write_entry_file(outfile.p, ciphertext);
+  written_path = outfile.p;
 }
 
 void add_entry(std::unique_ptr<entry_encryptor_initializer> keys,
                std::unique_ptr<input_reader> input,
-               std::unique_ptr<entry_writer> output)
+               std::unique_ptr<entry_writer> output,
+               bool verify)
 {
-  const auto plaintext = input->get_plaintext();
+  // Loading the keys and the dictionary overlaps with the user writing, so
+  // the entry is saved right after the editor closes
+  std::future<entry_encryptor> encryptor;
+  const auto plaintext = input->get_plaintext(
+      [&keys, &encryptor]()
+      {
+        encryptor = std::async(std::launch::async,
+                               [&keys]() { return keys->init(); });
+      });
 
   const auto is_space = [](unsigned char entry_char)
   { return std::isspace(entry_char); };
@@ -114,25 +135,27 @@ void add_entry(std::unique_ptr<entry_encryptor_initializer> keys,
   const auto handle = [&](std::string_view reason)
   {
     const auto dump_file = std::filesystem::path {"/tmp"} / "diaria_dump";
-    write_to_file(dump_file, plaintext);
+    write_file(dump_file, plaintext, entry_file_mode);
     std::println(
         stderr, "{}. Plaintext dumped at {}.", reason, dump_file.c_str());
   };
 
   std::vector<unsigned char> encrypted;
   try {
-    encrypted = keys->init().encrypt(plaintext);
+    auto loaded = encryptor.valid() ? encryptor.get() : keys->init();
+    encrypted = loaded.encrypt(plaintext);
   } catch (...) {
     handle("Error during encryption");
     throw;
   }
 
-  output->write_entry(encrypted);
-
   try {
-    encrypted = keys->init().encrypt(plaintext);
+    output->write_entry(encrypted);
+    if (verify) {
+      output->verify_entry(encrypted);
+    }
   } catch (...) {
     handle("Error while saving cipher text");
     throw;
   }
-}
\ No newline at end of file
+}
@@ -1,6 +1,9 @@
 #pragma once
+#include <filesystem>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <span>
 #include <string_view>
 #include <utility>
 
@@ -9,7 +12,13 @@
 
 struct input_reader
 {
-  virtual auto get_plaintext() -> safe_vector<unsigned char> = 0;
+  /**
+  Read the plaintext of the entry. `while_waiting` is called once, as soon as
+  reading only waits for the user, so other work can happen meanwhile. No
+  other threads may run before it is called.
+  */
+  virtual auto get_plaintext(const std::function<void()>& while_waiting)
+      -> safe_vector<unsigned char> = 0;
   virtual ~input_reader() = default;
 };
 
@@ -21,7 +30,8 @@ struct file_input_reader final : input_reader
   }
   input_file_t input_file;
 
-  auto get_plaintext() -> safe_vector<unsigned char> override;
+  auto get_plaintext(const std::function<void()>& while_waiting)
+      -> safe_vector<unsigned char> override;
 };
 
 struct cmdline_input_reader : input_reader
@@ -40,7 +50,8 @@ struct editor_input_reader final : cmdline_input_reader
   {
   }
 
-  auto get_plaintext() -> safe_vector<unsigned char> override;
+  auto get_plaintext(const std::function<void()>& while_waiting)
+      -> safe_vector<unsigned char> override;
 };
 
 struct sandbox_editor_input_reader final : cmdline_input_reader
@@ -50,23 +61,41 @@ struct sandbox_editor_input_reader final : cmdline_input_reader
   {
   }
 
-  auto get_plaintext() -> safe_vector<unsigned char> override;
+  auto get_plaintext(const std::function<void()>& while_waiting)
+      -> safe_vector<unsigned char> override;
 };
 
 struct entry_writer
 {
   virtual auto write_entry(std::span<const unsigned char> ciphertext)
       -> void = 0;
+  /**
+  Check that the written entry reads back as `ciphertext`
+  */
+  virtual auto verify_entry(std::span<const unsigned char> ciphertext) const
+      -> void = 0;
   virtual ~entry_writer() = default;
 };
 
 struct file_entry_writer : entry_writer
 {
+  auto verify_entry(std::span<const unsigned char> ciphertext) const
+      -> void override;
+
+protected:
+  /**
+  Where the last entry has been written to
+  */
+  std::filesystem::path written_path;
 };
 
 struct repo_entry_writer final : file_entry_writer
 {
   repo_path_t repo_path;
+  /**
+  Keys of the repository, to keep its index current
+  */
+  key_repo_paths_t keyrepo;
 
   auto write_entry(std::span<const unsigned char> ciphertext) -> void override;
 };
@@ -86,6 +115,11 @@ struct entry_recovery
   virtual ~entry_recovery() = default;
 };
 
+/**
+Read, encrypt and write an entry. The keys are loaded while the user is still
+editing. With `verify`, the written entry is read back and compared.
+*/
 void add_entry(std::unique_ptr<entry_encryptor_initializer> keys,
                std::unique_ptr<input_reader> input,
-               std::unique_ptr<entry_writer> output);
+               std::unique_ptr<entry_writer> output,
+               bool verify = false);
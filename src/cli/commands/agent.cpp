@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <print>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "./agent.hpp"
+
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cli/agent.hpp"
+#include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
+#include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
+#include "util/smart_fd.hpp"
+
+namespace
+{
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int /*signal*/)
+{
+  stop_requested = 1;
+}
+
+/**
+Without SA_RESTART, so a signal interrupts the wait for the next client
+*/
+void install_stop_handlers()
+{
+  struct sigaction action {};
+  action.sa_handler = request_stop;
+  sigemptyset(&action.sa_mask);
+  for (const int signal : {SIGINT, SIGTERM, SIGHUP}) {
+    sigaction(signal, &action, nullptr);
+  }
+}
+
+/**
+Other users must not be able to replace the socket
+*/
+void prepare_socket_directory(const std::filesystem::path& directory)
+{
+  if (mkdir(directory.c_str(), S_IRWXU) == -1 && errno != EEXIST) {
+    throw std::runtime_error(
+        std::format("Could not create agent directory; Errno {} [{}]",
+                    errno,
+                    strerror(errno)));
+  }
+  struct stat directory_stat {};
+  if (lstat(directory.c_str(), &directory_stat) == -1
+      || !S_ISDIR(directory_stat.st_mode)
+      || directory_stat.st_uid != geteuid()
+      || (directory_stat.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+  {
+    throw std::runtime_error(std::format(
+        "Agent directory \"{}\" has to be a directory accessible only by you",
+        directory.c_str()));
+  }
+}
+
+auto listen_on(const std::filesystem::path& socket_path) -> int
+{
+  if (agent_is_listening(socket_path)) {
+    throw std::runtime_error(std::format("An agent is already listening on {}",
+                                         socket_path.c_str()));
+  }
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.native().size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Agent socket path is too long");
+  }
+  std::ranges::copy(socket_path.native(), std::begin(address.sun_path));
+  const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd == -1) {
+    throw std::runtime_error("Could not create socket");
+  }
+  // Left behind by an agent which did not exit cleanly
+  unlink(socket_path.c_str());
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  if (bind(socket_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+          == -1
+      || chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) == -1
+      || listen(socket_fd, SOMAXCONN) == -1)
+  {
+    close(socket_fd);
+    throw std::runtime_error(
+        std::format("Could not listen on {}; Errno {} [{}]",
+                    socket_path.c_str(),
+                    errno,
+                    strerror(errno)));
+  }
+  return socket_fd;
+}
+
+void serve_client(int client_fd, const private_key_opener& opener)
+{
+  if (!peer_is_same_user(client_fd)) {
+    return;
+  }
+  // A stuck client must not block the others
+  const timeval client_timeout {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(client_fd,
+             SOL_SOCKET,
+             SO_RCVTIMEO,
+             &client_timeout,
+             sizeof(client_timeout));
+  setsockopt(client_fd,
+             SOL_SOCKET,
+             SO_SNDTIMEO,
+             &client_timeout,
+             sizeof(client_timeout));
+
+  const auto request = receive_agent_message(client_fd);
+  safe_vector<unsigned char> response {agent_status_ok};
+  try {
+    if (request.empty()) {
+      throw std::invalid_argument("Empty agent request");
+    }
+    switch (static_cast<agent_request>(request.front())) {
+      case agent_request::identify:
+        response.insert(response.end(),
+                        opener.get_public_key().begin(),
+                        opener.get_public_key().end());
+        break;
+      case agent_request::open: {
+        const auto opened = opener.open(std::span(request).subspan(1));
+        response.insert(response.end(), opened.begin(), opened.end());
+        break;
+      }
+      default:
+        throw std::invalid_argument("Unknown agent request");
+    }
+  } catch (const std::invalid_argument&) {
+    response = {agent_status_failed};
+  }
+  send_agent_message(client_fd, response);
+}
+}  // namespace
+
+void run_agent(std::unique_ptr<password_provider> password,
+               const key_repo_paths_t& keyrepo,
+               const std::filesystem::path& socket_path,
+               std::chrono::seconds timeout)
+{
+  // Keeps the unlocked key out of core dumps and away from other processes of
+  // the user attaching with ptrace
+  prctl(PR_SET_DUMPABLE, 0);
+  const private_key_opener opener {unlock_private_key(keyrepo, *password)};
+
+  prepare_socket_directory(socket_path.parent_path());
+  const smart_fd listen_fd {listen_on(socket_path)};
+  install_stop_handlers();
+  std::print("DIARIA_AGENT_SOCK={}; export DIARIA_AGENT_SOCK;\n",
+             socket_path.c_str());
+  std::fflush(stdout);
+
+  const int timeout_ms = timeout == std::chrono::seconds::zero()
+      ? -1
+      : static_cast<int>(std::min<std::chrono::milliseconds::rep>(
+            std::chrono::milliseconds(timeout).count(),
+            std::numeric_limits<int>::max()));
+  while (stop_requested == 0) {
+    pollfd listen_poll {.fd = listen_fd.fd, .events = POLLIN, .revents = 0};
+    const int ready = poll(&listen_poll, 1, timeout_ms);
+    if (ready == 0) {
+      break;
+    }
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    const smart_fd client_fd {
+        accept4(listen_fd.fd, nullptr, nullptr, SOCK_CLOEXEC)};
+    if (client_fd.fd == -1) {
+      continue;
+    }
+    try {
+      serve_client(client_fd.fd, opener);
+    } catch (const std::exception& error) {
+      std::print(stderr, "Could not answer agent request: {}\n", error.what());
+    }
+  }
+  unlink(socket_path.c_str());
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <memory>
+
+#include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
+
+/**
+Unlock the private key and keep it in memory, opening the stream keys of
+entries for other diaria processes of the same user. Exits once no request
+arrived for `timeout`, or never if it is zero.
+*/
+void run_agent(std::unique_ptr<password_provider> password,
+               const key_repo_paths_t& keyrepo,
+               const std::filesystem::path& socket_path,
+               std::chrono::seconds timeout);
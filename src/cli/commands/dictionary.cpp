@@ -0,0 +1,76 @@
+#include <cstddef>
+#include <memory>
+#include <print>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "./dictionary.hpp"
+
+#include <sodium/randombytes.h>
+
+#include "cli/command_types.hpp"
+#include "cli/entry_pack.hpp"
+#include "cli/key_management.hpp"
+#include "cli/repo_index.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/compress.hpp"
+#include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
+
+namespace
+{
+/**
+Only the most recent entries are sampled, up to this multiple of the
+dictionary size
+*/
+constexpr std::size_t sample_size_factor = 100;
+}  // namespace
+
+void train_repo_dictionary(std::unique_ptr<entry_decryptor_initializer> keys,
+                           const key_repo_paths_t& keyrepo,
+                           const repo_path_t& repo,
+                           std::size_t dictionary_size)
+{
+  auto decryptor = keys->init();
+
+  std::vector<safe_vector<unsigned char>> samples {};
+  std::size_t sampled_size = 0;
+  const auto entries = list_entries(repo, keyrepo);
+  entry_pack_cache packs {};
+  for (std::size_t entry = entries.size(); entry-- > 0;) {
+    if (sampled_size >= dictionary_size * sample_size_factor) {
+      break;
+    }
+    safe_vector<unsigned char> plaintext {};
+    container_sink sink {plaintext};
+    if (const auto packed = packs.contents(entries.path(entry))) {
+      decryptor.decrypt(*packed, sink, decryptor.context);
+    } else {
+      const smart_fd entry_fd {open_sequential(entries.path(entry))};
+      if (entry_fd.fd == -1) {
+        throw std::runtime_error("Could not open entry file");
+      }
+      decryptor.decrypt(entry_fd.fd, sink);
+    }
+    sampled_size += plaintext.size();
+    samples.push_back(std::move(plaintext));
+  }
+  if (samples.empty()) {
+    throw std::runtime_error("No entries to train a dictionary from");
+  }
+
+  compression_dictionary dictionary {
+      .id = {}, .content = train_dictionary(samples, dictionary_size)};
+  if (dictionary.content.empty()) {
+    throw std::runtime_error(
+        "No lines recur in enough entries to train a dictionary from");
+  }
+  randombytes_buf(dictionary.id.data(), dictionary.id.size());
+  store_dictionary(keyrepo, symkey_span_t {decryptor.symkey}, dictionary);
+  std::println("Trained a dictionary of {} bytes from {} entries",
+               dictionary.content.size(),
+               samples.size());
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+
+#include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
+
+void train_repo_dictionary(std::unique_ptr<entry_decryptor_initializer> keys,
+                           const key_repo_paths_t& keyrepo,
+                           const repo_path_t& repo,
+                           std::size_t dictionary_size);
@@ -1,49 +1,108 @@
+#include <array>
 #include <filesystem>
 #include <format>
-#include <fstream>
-#include <ios>
-#include <iostream>
-#include <iterator>
 #include <memory>
 #include <optional>
-#include <print>
+#include <ranges>
 #include <span>
 #include <stdexcept>
-#include <string>
+#include <utility>
 #include <vector>
 
 #include "./read_entry.hpp"
 
 #include <fcntl.h>
-#include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <wordexp.h>
 
 #include "cli/command_types.hpp"
+#include "cli/entry_pack.hpp"
 #include "cli/key_management.hpp"
-#include "util/char.hpp"
+#include "cli/repo_index.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/stream.hpp"
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
+#include "util/time.hpp"
 
-void read_entry(std::unique_ptr<entry_decryptor_initializer> keys,
-                const std::filesystem::path& entry,
-                const std::optional<std::filesystem::path>& output)
+namespace
 {
-  std::ifstream stream(entry, std::ios::in | std::ios::binary);
-  if (stream.fail()) {
+void decrypt_entry_file(entry_decryptor& decryptor,
+                        entry_pack_cache& packs,
+                        const std::filesystem::path& entry,
+                        byte_sink& output)
+{
+  if (const auto packed = packs.contents(entry)) {
+    decryptor.decrypt(*packed, output, decryptor.context);
+    return;
+  }
+  const smart_fd entry_fd {open_sequential(entry)};
+  if (entry_fd.fd == -1) {
     throw std::runtime_error("Could not open entry file");
   }
-  std::vector<unsigned char> contents((std::istreambuf_iterator<char>(stream)),
-                                      std::istreambuf_iterator<char>());
+  decryptor.decrypt(entry_fd.fd, output);
+}
 
-  const auto decrypted = keys->init().decrypt(contents);
+/**
+Decrypt the entries one after another into `output`, or to stdout separated by
+newlines
+*/
+void decrypt_entries(std::unique_ptr<entry_decryptor_initializer> keys,
+                     std::span<const std::filesystem::path> entries,
+                     const std::optional<std::filesystem::path>& output)
+{
+  auto decryptor = keys->init();
+  entry_pack_cache packs {};
   if (!output) {
-    std::println("{}", std::string(decrypted.begin(), decrypted.end()));
+    fd_sink stdout_sink {STDOUT_FILENO};
+    constexpr std::array<unsigned char, 1> separator {'\n'};
+    for (const auto& entry : entries) {
+      decrypt_entry_file(decryptor, packs, entry, stdout_sink);
+      stdout_sink.write(separator);
+    }
+    stdout_sink.finish();
     return;
   }
-  std::ofstream output_stream(output.value(), std::ios::out);
-  if (output_stream.fail()) {
-    throw std::runtime_error("Could not open entry file");
+  const smart_fd output_fd {open(output->c_str(),
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                 S_IRUSR | S_IWUSR)};
+  if (output_fd.fd == -1) {
+    throw std::runtime_error(
+        std::format("Could not open output file \"{}\"", output->c_str()));
+  }
+  fd_sink output_sink {output_fd.fd};
+  try {
+    for (const auto& entry : entries) {
+      decrypt_entry_file(decryptor, packs, entry, output_sink);
+    }
+  } catch (...) {
+    // Do not leave partially decrypted plaintext behind
+    unlink(output->c_str());
+    throw;
+  }
+}
+}  // namespace
+
+void read_entry(std::unique_ptr<entry_decryptor_initializer> keys,
+                const std::filesystem::path& entry,
+                const std::optional<std::filesystem::path>& output)
+{
+  decrypt_entries(std::move(keys), std::span(&entry, 1), output);
+}
+
+void read_entries(std::unique_ptr<entry_decryptor_initializer> keys,
+                  const key_repo_paths_t& keyrepo,
+                  const repo_path_t& repo,
+                  const time_range& range,
+                  const std::optional<std::filesystem::path>& output)
+{
+  const auto entries =
+      entries_within(list_entries(repo, keyrepo, {range}), {range})
+      | std::views::transform([](const diaria_entry_path& entry)
+                              { return entry.entry_path; })
+      | std::ranges::to<std::vector>();
+  if (entries.empty()) {
+    throw std::runtime_error("No entries within the time range");
   }
-  output_stream.write(make_signed_char(decrypted.data()),
-                      static_cast<std::streamsize>(decrypted.size()));
-}
\ No newline at end of file
+  decrypt_entries(std::move(keys), entries, output);
+}
@@ -3,7 +3,18 @@
 #include <optional>
 
 #include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
+#include "util/time.hpp"
 
 void read_entry(std::unique_ptr<entry_decryptor_initializer> keys,
                 const std::filesystem::path& entry,
                 const std::optional<std::filesystem::path>& output);
+
+/**
+Read every entry of the repository within the range, oldest first
+*/
+void read_entries(std::unique_ptr<entry_decryptor_initializer> keys,
+                  const key_repo_paths_t& keyrepo,
+                  const repo_path_t& repo,
+                  const time_range& range,
+                  const std::optional<std::filesystem::path>& output);
@@ -1,107 +1,571 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <format>
-#include <fstream>
-#include <ios>
-#include <iterator>
+#include <map>
 #include <memory>
+#include <optional>
 #include <print>
 #include <ranges>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "./repo.hpp"
 
+#include <fcntl.h>
 #include <sodium.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "cli/batch_reader.hpp"
 #include "cli/command_types.hpp"
+#include "cli/entry_pack.hpp"
+#include "cli/key_management.hpp"
+#include "cli/repo_index.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/safe_buffer.hpp"
+#include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
 #include "util/char.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+#include "util/parallel.hpp"
+#include "util/smart_fd.hpp"
 
 namespace views = std::ranges::views;
 
+namespace
+{
+/**
+Number of loaded or recompressed entries flushed to disk together
+*/
+constexpr std::size_t load_commit_size = 256;
+
+auto open_entry_input(const std::filesystem::path& path) -> int
+{
+  const int input_fd = open_sequential(path);
+  if (input_fd == -1) {
+    throw std::runtime_error("Could not open entry file");
+  }
+  return input_fd;
+}
+
+auto open_entry_output(const std::filesystem::path& path, mode_t mode) -> int
+{
+  const int output_fd =
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (output_fd == -1) {
+    throw std::runtime_error(
+        std::format("Could not open output file: {}", path.c_str()));
+  }
+  return output_fd;
+}
+}  // namespace
+
 void dump_repo(std::unique_ptr<entry_decryptor_initializer> keys,
+               const key_repo_paths_t& keyrepo,
                const repo_path_t& repo,
-               const std::filesystem::path& target)
+               const std::filesystem::path& target,
+               const std::optional<time_range>& range,
+               std::size_t jobs)
 {
   const auto decryptor = keys->init();
   std::filesystem::create_directories(target);
 
-  for (const auto& entry :
-       std::filesystem::directory_iterator(repo.repo)
-           | views::filter([](const auto& entry)
-                           { return entry.is_regular_file(); })
-           | views::filter(
-               [](const auto& entry)
-               {
-                 return entry.path().filename().string().ends_with(".diaria");
-               }))
-  {
-    std::ifstream stream(entry.path(), std::ios::in | std::ios::binary);
-    if (stream.fail()) {
-      throw std::runtime_error("Could not open entry file");
+  std::vector<std::filesystem::path> entries;
+  if (range) {
+    entries = entries_within(list_entries(repo, keyrepo, {*range}), {*range})
+        | views::transform([](const diaria_entry_path& entry)
+                           { return entry.entry_path; })
+        | std::ranges::to<std::vector>();
+  } else {
+    // Entries left both loose and packed by an interrupted repack are listed
+    // once, as two workers writing the same output file would garble it
+    const auto catalog = list_entries(repo, keyrepo);
+    std::unordered_set<std::string> dumped_names {};
+    for (std::size_t entry = 0; entry < catalog.size(); ++entry) {
+      entries.push_back(catalog.path(entry));
+      dumped_names.insert(entries.back().filename().string());
     }
-    std::vector<unsigned char> contents(
-        (std::istreambuf_iterator<char>(stream)),
-        std::istreambuf_iterator<char>());
-
-    const auto decrypted = decryptor.decrypt(contents);
-    const auto output_file_name =
-        entry.path().filename().replace_extension("txt");
-    std::ofstream entry_file(
-        (target / output_file_name).c_str(),
-        std::ios::out | std::ios::binary | std::ios::trunc);
-    if (entry_file.fail()) {
-      throw std::runtime_error(std::format("Could not open output file: {}",
-                                           output_file_name.c_str()));
+    // Also dumps entries which are not named by their timestamp
+    for (auto& untimed : list_untimed_entries(repo)) {
+      if (dumped_names.insert(untimed.filename().string()).second) {
+        entries.push_back(std::move(untimed));
+      }
     }
-    entry_file.write(make_signed_char(decrypted.data()),
-                     static_cast<std::streamsize>(decrypted.size()));
   }
+
+  auto contexts =
+      make_worker_contexts(decryptor.context, std::min(jobs, entries.size()));
+  parallel_for_each_file(
+      entries,
+      jobs,
+      [&decryptor, &contexts, &target, &entries](
+          std::size_t worker,
+          std::size_t index,
+          std::span<const unsigned char> entry_bytes)
+      {
+        const auto& entry_path = entries[index];
+        const auto output_path =
+            target / entry_path.filename().replace_extension("txt");
+        const smart_fd output_fd {
+            open_entry_output(output_path, S_IRUSR | S_IWUSR)};
+
+        fd_sink output {output_fd.fd};
+        try {
+          decryptor.decrypt(entry_bytes, output, contexts[worker]);
+        } catch (...) {
+          unlink(output_path.c_str());
+          throw;
+        }
+        return output_path;
+      },
+      [](const std::filesystem::path&) { return true; });
 }
 void load_repo(std::unique_ptr<entry_encryptor_initializer> keys,
                const repo_path_t& repo,
-               const std::filesystem::path& source)
+               const std::filesystem::path& source,
+               std::size_t jobs)
 {
   const auto encryptor = keys->init();
   std::filesystem::create_directories(repo.repo);
 
-  for (const auto& entry : std::filesystem::directory_iterator(source)
-           | views::filter([](const auto& entry)
-                           { return entry.is_regular_file(); }))
+  const auto sources =
+      std::filesystem::directory_iterator(source)
+      | views::filter([](const auto& entry) { return entry.is_regular_file(); })
+      | views::transform([](const auto& entry) { return entry.path(); })
+      | std::ranges::to<std::vector>();
+
+  repo_index_update index {repo, symkey_span_t {encryptor.symkey}};
+  // Entries are flushed to disk in groups, which is much cheaper than
+  // flushing each one, and indexed once they appeared
+  durable_file_batch batch {};
+  std::vector<std::filesystem::path> batch_paths {};
+  const auto commit_batch = [&batch, &batch_paths, &index]()
+  {
+    batch.commit();
+    for (const auto& path : batch_paths) {
+      index.add(path);
+    }
+    batch_paths.clear();
+  };
+
+  // Workers read and encrypt, the calling thread writes the entries in order.
+  // Only a bounded number of encrypted entries are held in memory at once.
+  auto contexts =
+      make_worker_contexts(encryptor.context, std::min(jobs, sources.size()));
+  ordered_parallel_for_each(
+      sources,
+      jobs,
+      [&encryptor, &contexts](std::size_t worker,
+                              const std::filesystem::path& source_path)
+      {
+        const smart_fd input_fd {open_entry_input(source_path)};
+        const auto plaintext =
+            read_fd<safe_vector<unsigned char>>(input_fd.fd);
+        return std::make_pair(source_path,
+                              encryptor.encrypt(plaintext, contexts[worker]));
+      },
+      [&repo, &batch, &batch_paths, &commit_batch](
+          const auto& encrypted_entry)
+      {
+        const auto& [source_path, encrypted] = encrypted_entry;
+        const auto output_path = entry_path_for(
+            repo,
+            source_path.filename().replace_extension("diaria").native());
+        std::filesystem::create_directories(output_path.parent_path());
+        batch.add(output_path, encrypted, entry_file_mode);
+        batch_paths.push_back(output_path);
+        if (batch.size() >= load_commit_size) {
+          commit_batch();
+        }
+        return true;
+      });
+  commit_batch();
+  index.store();
+}
+
+void migrate_repo(const repo_path_t& repo,
+                  const key_repo_paths_t& keyrepo,
+                  std::size_t limit)
+{
+  if (!std::filesystem::exists(repo.repo)) {
+    throw std::runtime_error("Repository does not exist");
+  }
+  const auto symkey = load_symkey(keyrepo);
+  repo_index_update index {repo, symkey_span_t {symkey}};
+  // Entries added from now on go into the shards, so every entry left in the
+  // repository directory is one still to be moved
+  mark_sharded(repo);
+
+  const auto entries = list_unsharded_entries(repo);
+  const auto count =
+      limit == 0 ? entries.size() : std::min(limit, entries.size());
+  std::vector<std::filesystem::path> touched_directories {repo.repo};
+  const auto touch = [&touched_directories](std::filesystem::path directory)
+  {
+    if (std::ranges::find(touched_directories, directory)
+        == touched_directories.end())
+    {
+      touched_directories.push_back(std::move(directory));
+    }
+  };
+  for (std::size_t entry = 0; entry < count; ++entry) {
+    const auto from = entries.path(entry);
+    const auto to = entry_path_for(repo, entries.name(entry));
+    std::filesystem::create_directories(to.parent_path());
+    std::filesystem::rename(from, to);
+    index.move(from, to);
+    touch(to.parent_path().parent_path());
+    touch(to.parent_path());
+  }
+  for (const auto& directory : touched_directories) {
+    flush_directory(directory);
+  }
+  index.store();
+  std::println(
+      "Moved {} entries, {} left to move", count, entries.size() - count);
+}
+
+namespace
+{
+/**
+Where the entries are packed. An interrupted repack packs the same entries
+again, replacing the pack it left behind, while other packs of the same name
+are kept.
+*/
+auto pack_path_for(const repo_path_t& repo,
+                   std::span<const std::filesystem::path> entries)
+    -> std::filesystem::path
+{
+  const auto pack_directory = repo.repo / pack_directory_name;
+  const auto name = pack_name_for(entries.front().filename().native(),
+                                  entries.back().filename().native());
+  auto filenames = entries
+      | views::transform([](const std::filesystem::path& entry)
+                         { return entry.filename().string(); })
+      | std::ranges::to<std::vector>();
+  std::ranges::sort(filenames);
+  const auto holds_only_entries = [&filenames](const auto& pack_path)
+  {
+    return std::ranges::all_of(
+        entry_pack {pack_path}.entries(),
+        [&filenames](const packed_entry& entry)
+        { return std::ranges::binary_search(filenames, entry.name); });
+  };
+  auto pack_path = pack_directory / name;
+  for (std::size_t suffix = 2; std::filesystem::exists(pack_path)
+       && !holds_only_entries(pack_path);
+       ++suffix)
+  {
+    pack_path = pack_directory
+        / std::format("{}-{}{}",
+                      std::filesystem::path {name}.stem().string(),
+                      suffix,
+                      pack_extension);
+  }
+  return pack_path;
+}
+}  // namespace
+
+void repack_repo(const repo_path_t& repo,
+                 const key_repo_paths_t& keyrepo,
+                 std::chrono::seconds min_age,
+                 std::uint64_t pack_size)
+{
+  if (!std::filesystem::exists(repo.repo)) {
+    throw std::runtime_error("Repository does not exist");
+  }
+  const auto symkey = load_symkey(keyrepo);
+  repo_index_update index {repo, symkey_span_t {symkey}};
+  const auto entries = list_entries(repo);
+  const auto cutoff = std::chrono::utc_clock::now() - min_age;
+  std::vector<std::size_t> cold_entries {};
+  for (std::size_t entry = 0;
+       entry < entries.size() && entries.entry_time(entry) < cutoff;
+       ++entry)
+  {
+    if (!split_packed_path(entries.path(entry))) {
+      cold_entries.push_back(entry);
+    }
+  }
+
+  std::vector<std::filesystem::path> touched_directories {repo.repo};
+  std::size_t pack_count = 0;
+  for (std::size_t next = 0; next < cold_entries.size();) {
+    // Every pack takes at least one entry, even one larger than `pack_size`
+    std::uint64_t packed_size = 0;
+    std::vector<std::filesystem::path> packed {};
+    for (; next < cold_entries.size(); ++next) {
+      const auto entry_size = entries.file_size(cold_entries[next]);
+      if (!packed.empty() && packed_size + entry_size > pack_size) {
+        break;
+      }
+      packed_size += entry_size;
+      packed.push_back(entries.path(cold_entries[next]));
+    }
+    const auto pack_path = pack_path_for(repo, packed);
+    write_pack(pack_path, packed);
+    ++pack_count;
+    // Only removed once the pack is on disk, until then readers find them in
+    // both places
+    for (const auto& entry_path : packed) {
+      std::filesystem::remove(entry_path);
+      index.move(entry_path, pack_path / entry_path.filename());
+      if (std::ranges::find(touched_directories, entry_path.parent_path())
+          == touched_directories.end())
+      {
+        touched_directories.push_back(entry_path.parent_path());
+      }
+    }
+  }
+  for (const auto& directory : touched_directories) {
+    flush_directory(directory);
+  }
+  index.store();
+  std::println(
+      "Packed {} entries into {} packs", cold_entries.size(), pack_count);
+}
+
+namespace
+{
+/**
+Filename of the newest entry up to which all older entries were recompressed
+*/
+auto get_recompress_progress_path(const repo_path_t& repo)
+    -> std::filesystem::path
+{
+  return get_index_directory(repo) / "recompressed";
+}
+
+auto read_recompress_progress(const repo_path_t& repo)
+    -> std::optional<time_point>
+{
+  const auto progress_path = get_recompress_progress_path(repo);
+  if (!std::filesystem::exists(progress_path)) {
+    return std::nullopt;
+  }
+  const auto progress = read_file(progress_path);
+  return parse_timestamp(
+      std::string_view {make_signed_char(progress.data()), progress.size()});
+}
+
+/**
+Entries recompressed and written together, either files of their own or
+entries of the same pack, which is rewritten once for all of them
+*/
+struct recompress_unit
+{
+  std::optional<std::filesystem::path> pack;
+  /**
+  Positions within the list of entries to recompress
+  */
+  std::vector<std::size_t> entries;
+};
+
+auto group_recompress_units(std::span<const std::filesystem::path> paths)
+    -> std::vector<recompress_unit>
+{
+  std::vector<recompress_unit> units {};
+  std::map<std::filesystem::path, std::size_t> pack_units {};
+  for (std::size_t entry = 0; entry < paths.size(); ++entry) {
+    if (const auto packed = split_packed_path(paths[entry])) {
+      const auto [unit, inserted] =
+          pack_units.try_emplace(packed->first, units.size());
+      if (inserted) {
+        units.push_back({.pack = packed->first, .entries = {}});
+      }
+      units[unit->second].entries.push_back(entry);
+      continue;
+    }
+    if (units.empty() || units.back().pack
+        || units.back().entries.size() >= load_commit_size)
+    {
+      units.push_back({.pack = std::nullopt, .entries = {}});
+    }
+    units.back().entries.push_back(entry);
+  }
+  return units;
+}
+
+/**
+Replace entries of the pack, keeping the others as they are
+*/
+void rewrite_pack(
+    const std::filesystem::path& pack_path,
+    const std::map<std::string, std::vector<unsigned char>>& replacements)
+{
+  const entry_pack pack {pack_path};
+  std::vector<pack_input> inputs {};
+  for (const auto& entry : pack.entries()) {
+    const auto replacement = replacements.find(entry.name);
+    inputs.push_back({.name = entry.name,
+                      .contents = replacement == replacements.end()
+                          ? pack.contents(entry)
+                          : std::span<const unsigned char> {
+                                replacement->second}});
+  }
+  write_pack(pack_path, inputs);
+}
+}  // namespace
+
+void recompress_repo(std::unique_ptr<entry_decryptor_initializer> keys,
+                     std::unique_ptr<entry_encryptor_initializer> strong_keys,
+                     const key_repo_paths_t& keyrepo,
+                     const repo_path_t& repo,
+                     std::chrono::seconds min_age,
+                     std::size_t jobs)
+{
+  if (!std::filesystem::exists(repo.repo)) {
+    throw std::runtime_error("Repository does not exist");
+  }
+  const auto decryptor = keys->init();
+  const auto encryptor = strong_keys->init();
+  repo_index_update index {repo, symkey_span_t {encryptor.symkey}};
+
+  const auto entries = list_entries(repo, keyrepo);
+  const auto progress = read_recompress_progress(repo);
+  const auto cutoff = std::chrono::utc_clock::now() - min_age;
+  std::vector<std::filesystem::path> cold_entries {};
+  for (std::size_t entry = 0;
+       entry < entries.size() && entries.entry_time(entry) < cutoff;
+       ++entry)
   {
-    std::ifstream stream(entry.path(), std::ios::in | std::ios::binary);
-    if (stream.fail()) {
-      throw std::runtime_error("Could not open entry file");
+    if (!progress || entries.entry_time(entry) > *progress) {
+      cold_entries.push_back(entries.path(entry));
     }
-    std::vector<unsigned char> contents(
-        (std::istreambuf_iterator<char>(stream)),
-        std::istreambuf_iterator<char>());
-
-    const auto decrypted = encryptor.encrypt(contents);
-    const auto output_file_name =
-        entry.path().filename().replace_extension("diaria");
-    std::ofstream entry_file(
-        (repo.repo / output_file_name).c_str(),
-        std::ios::out | std::ios::binary | std::ios::trunc);
-    if (entry_file.fail()) {
-      throw std::runtime_error(std::format("Could not open output file: {}",
-                                           output_file_name.c_str()));
+  }
+
+  auto decrypt_contexts = make_worker_contexts(
+      decryptor.context, std::min(jobs, cold_entries.size()));
+  auto encrypt_contexts = make_worker_contexts(
+      encryptor.context, std::min(jobs, cold_entries.size()));
+  std::vector<bool> done(cold_entries.size());
+  std::size_t done_prefix = 0;
+  std::size_t replaced_count = 0;
+  std::uint64_t saved_bytes = 0;
+  for (const auto& unit : group_recompress_units(cold_entries)) {
+    const auto paths = unit.entries
+        | views::transform([&cold_entries](std::size_t entry)
+                           { return cold_entries[entry]; })
+        | std::ranges::to<std::vector>();
+    std::map<std::string, std::vector<unsigned char>> replacements {};
+    parallel_for_each_file(
+        paths,
+        jobs,
+        [&decryptor, &encryptor, &decrypt_contexts, &encrypt_contexts, &paths](
+            std::size_t worker,
+            std::size_t index,
+            std::span<const unsigned char> entry_bytes)
+        {
+          safe_vector<unsigned char> plaintext {};
+          container_sink plaintext_sink {plaintext};
+          decryptor.decrypt(
+              entry_bytes, plaintext_sink, decrypt_contexts[worker]);
+          auto recompressed =
+              encryptor.encrypt(plaintext, encrypt_contexts[worker]);
+          // The original is replaced, so the new entry has to be readable
+          safe_vector<unsigned char> check {};
+          container_sink check_sink {check};
+          decryptor.decrypt(recompressed, check_sink, decrypt_contexts[worker]);
+          if (!std::ranges::equal(check, plaintext)) {
+            throw std::runtime_error(
+                std::format("Recompressed \"{}\" does not read back",
+                            paths[index].c_str()));
+          }
+          return std::make_tuple(
+              index, entry_bytes.size(), std::move(recompressed));
+        },
+        [&paths, &replacements, &saved_bytes](auto& result)
+        {
+          auto& [index, original_size, recompressed] = result;
+          if (recompressed.size() < original_size) {
+            saved_bytes += original_size - recompressed.size();
+            replacements.emplace(paths[index].filename().string(),
+                                 std::move(recompressed));
+          }
+          return true;
+        });
+
+    if (unit.pack) {
+      if (!replacements.empty()) {
+        rewrite_pack(*unit.pack, replacements);
+      }
+    } else {
+      durable_file_batch batch {};
+      for (const auto& path : paths) {
+        const auto replacement = replacements.find(path.filename().string());
+        if (replacement != replacements.end()) {
+          batch.add(path, replacement->second, entry_file_mode);
+        }
+      }
+      batch.commit();
+    }
+    for (const auto& path : paths) {
+      if (replacements.contains(path.filename().string())) {
+        index.add(path);
+      }
+    }
+    replaced_count += replacements.size();
+
+    // Entries are grouped by pack, so they are not finished in order. The
+    // progress only covers the entries up to the first unfinished one.
+    for (const auto entry : unit.entries) {
+      done[entry] = true;
+    }
+    const auto previous_prefix = done_prefix;
+    while (done_prefix < done.size() && done[done_prefix]) {
+      ++done_prefix;
+    }
+    if (done_prefix != previous_prefix) {
+      const auto last_done =
+          cold_entries[done_prefix - 1].filename().string();
+      std::filesystem::create_directories(get_index_directory(repo));
+      write_file_durably(
+          get_recompress_progress_path(repo),
+          std::span {make_unsigned_char(last_done.data()), last_done.size()});
     }
-    entry_file.write(make_signed_char(decrypted.data()),
-                     static_cast<std::streamsize>(decrypted.size()));
   }
+  index.store();
+  std::println("Recompressed {} of {} entries, saving {} bytes",
+               replaced_count,
+               cold_entries.size(),
+               saved_bytes);
 }
 
 namespace
 {
 void sync_repo_git(const repo_path_t& repo)
 {
+  // Pulled entries would go unnoticed if another command stored the index
+  // meanwhile
+  const repo_index_lock lock {repo};
+  // Quoted, so git matches entries within the shards as well. git refuses to
+  // add anything if a path matches nothing, so only existing kinds are named.
+  std::string paths {"'*.diaria'"};
+  if (std::filesystem::exists(repo.repo / pack_directory_name)) {
+    paths += " '*.pack'";
+  }
+  // Other clones have to store their new entries in shards as well
+  if (is_sharded(repo)) {
+    paths += std::format(" {}", shard_marker);
+  }
+
   auto workingdir = std::filesystem::current_path();
   std::filesystem::current_path(repo.repo);
   // NOLINTBEGIN(cert-env33-c)
   // TODO: Use libgit2 maybe, or drop git synchronization for something more fit
   // to the task
-  std::system("git add *.diaria");
+  std::system(std::format("git add -- {}", paths).c_str());
   std::system("git commit -m \"Added entry\"");
   std::system("git push");
   std::system("git pull");
@@ -1,14 +1,63 @@
 #pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <optional>
 
 #include "../command_types.hpp"
+#include "cli/key_management.hpp"
+#include "util/time.hpp"
 
+/**
+Decrypt the entries into `target`, all of them or only the ones within `range`
+*/
 void dump_repo(std::unique_ptr<entry_decryptor_initializer> keys,
+               const key_repo_paths_t& keyrepo,
                const repo_path_t& repo,
-               const std::filesystem::path& target);
+               const std::filesystem::path& target,
+               const std::optional<time_range>& range,
+               std::size_t jobs);
 
 void load_repo(std::unique_ptr<entry_encryptor_initializer> keys,
                const repo_path_t& repo,
-               const std::filesystem::path& source);
+               const std::filesystem::path& source,
+               std::size_t jobs);
+
+/**
+Move up to `limit` entries, or all of them if 0, into the shards of the
+repository, oldest first. New entries are stored in the shards from then on.
+*/
+void migrate_repo(const repo_path_t& repo,
+                  const key_repo_paths_t& keyrepo,
+                  std::size_t limit);
+
+/**
+Default size of the packs written by `repack_repo`
+*/
+constexpr std::uint64_t default_pack_size = 64UL * 1024 * 1024;
+
+/**
+Move the entries older than `min_age` out of their own files into packs of
+about `pack_size` bytes. Entries written later stay in their own files.
+*/
+void repack_repo(const repo_path_t& repo,
+                 const key_repo_paths_t& keyrepo,
+                 std::chrono::seconds min_age,
+                 std::uint64_t pack_size);
+
+/**
+Compress the entries older than `min_age` again using `strong_keys`, meant to
+be set up with a slower preset or a dictionary. Entries are replaced once they
+read back correctly and only if they got smaller. Progress is recorded, so an
+interrupted run continues where it stopped.
+*/
+void recompress_repo(std::unique_ptr<entry_decryptor_initializer> keys,
+                     std::unique_ptr<entry_encryptor_initializer> strong_keys,
+                     const key_repo_paths_t& keyrepo,
+                     const repo_path_t& repo,
+                     std::chrono::seconds min_age,
+                     std::size_t jobs);
 
 void sync_repo(const repo_path_t& repo);
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <print>
 #include <ranges>
 #include <span>
+#include <vector>
 
 #include "./stats.hpp"
 
@@ -13,6 +14,8 @@
 #include <bits/ranges_algo.h>
 #include <sys/types.h>
 
+#include "cli/key_management.hpp"
+#include "cli/repo_index.hpp"
 #include "cli/repo_management.hpp"
 #include "util/rgb.hpp"
 #include "util/time.hpp"
@@ -32,8 +35,8 @@ auto handle_year(const std::ranges::forward_range auto& entries,
 {
   auto day_entry_chunks = entries
       | std::views::chunk_by(
-                              [](const diaria_entry_path& last_entry,
-                                 const diaria_entry_path& this_entry)
+                              [](const entry_summary& last_entry,
+                                 const entry_summary& this_entry)
                               {
                                 return to_ymd(last_entry.entry_time)
                                     == to_ymd(this_entry.entry_time);
@@ -68,7 +71,7 @@ auto handle_year(const std::ranges::forward_range auto& entries,
             auto current_day_entry_sizes = *current_day_entry_chunk
                 | std::views::transform(
                     [](const auto& entry)
-                    { return (std::filesystem::file_size(entry.entry_path)); });
+                    { return entry.size; });
             const auto size_sum = std::ranges::fold_left(
                 current_day_entry_sizes, 0, std::plus {});
 
@@ -176,17 +179,38 @@ auto print_year_header(std::chrono::year year) -> std::string
 }
 }  // namespace
 
-void repo_stats(const repo_path_t& repo)
+void repo_stats(const repo_path_t& repo,
+                const key_repo_paths_t& keyrepo,
+                std::optional<std::chrono::year> only_year)
 {
-  const auto entries = list_entries(repo);
+  std::vector<time_range> ranges {};
+  if (only_year) {
+    const auto year_start = [](std::chrono::year year)
+    {
+      return std::chrono::utc_clock::from_sys(
+          std::chrono::sys_days {year / std::chrono::January / 1});
+    };
+    // Ends right before the next year, in a sharded repository only the
+    // shards of the year are read
+    ranges.push_back(
+        {.first = year_start(*only_year),
+         .last = year_start(*only_year + std::chrono::years {1})
+             - std::chrono::utc_clock::duration {1}});
+  }
+  auto entries = list_entries(repo, keyrepo, ranges).summaries();
+  if (only_year) {
+    std::erase_if(entries,
+                  [&only_year](const entry_summary& entry)
+                  { return to_ymd(entry.entry_time).year() != *only_year; });
+  }
   if (entries.empty()) {
     std::println("No entries");
     return;
   }
   auto entries_by_year = entries
       | std::views::chunk_by(
-                             [](const diaria_entry_path& last_entry,
-                                const diaria_entry_path& current_entry)
+                             [](const entry_summary& last_entry,
+                                const entry_summary& current_entry)
                              {
                                return to_ymd(last_entry.entry_time).year()
                                    == to_ymd(current_entry.entry_time).year();
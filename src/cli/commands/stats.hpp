@@ -1,4 +1,13 @@
 #pragma once
+#include <chrono>
+#include <optional>
+
 #include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
 
-void repo_stats(const repo_path_t& repo);
\ No newline at end of file
+/**
+Print a calendar of the entries of each year, or only of `only_year` if given
+*/
+void repo_stats(const repo_path_t& repo,
+                const key_repo_paths_t& keyrepo,
+                std::optional<std::chrono::year> only_year = std::nullopt);
\ No newline at end of file
@@ -1,8 +1,25 @@
 #pragma once
+#include <chrono>
+#include <cstddef>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
 
+/**
+How long ago the entries shown by default were written, see `parse_duration`
+*/
+inline const std::vector<std::string> default_summarize_intervals = {
+    "1d", "1w", "1m", "1y", "2y", "4y", "8y", "16y"};
+
+/**
+Show the entries written around each of the intervals ago
+*/
 void summarize_repo(std::unique_ptr<entry_decryptor_initializer> keys,
+                    const key_repo_paths_t& keyrepo,
                     const repo_path_t& repo,
-                    bool paging);
\ No newline at end of file
+                    const std::vector<std::chrono::seconds>& intervals,
+                    bool paging,
+                    std::size_t jobs);
\ No newline at end of file
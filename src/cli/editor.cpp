@@ -1,13 +1,14 @@
+#include <array>
 #include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <filesystem>
 #include <format>
-#include <fstream>
-#include <iterator>
+#include <functional>
 #include <memory>
 #include <print>
 #include <ranges>
@@ -21,7 +22,10 @@
 #include <fcntl.h>
 #include <linux/capability.h>
 #include <sched.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -29,6 +33,7 @@
 #include <wordexp.h>
 
 #include "crypto/safe_buffer.hpp"
+#include "util/file_io.hpp"
 #include "util/smart_fd.hpp"
 
 namespace
@@ -76,11 +81,14 @@ void exec_cmdline(std::string_view cmdline)
   const auto exec_result = execvp(argv[0], argv.data());
   throw std::runtime_error(std::format("Error during exec: {}", exec_result));
 }
-}  // namespace
 
-auto interactive_content_entry(std::string_view cmdline,
-                               const std::filesystem::path& temp_file_dir)
-    -> safe_vector<unsigned char>
+/**
+Run the editor until it exits, returning the path of the file it wrote
+*/
+auto run_editor(std::string_view cmdline,
+                const std::filesystem::path& temp_file_dir,
+                const std::function<void()>& while_editing)
+    -> std::filesystem::path
 {
   auto temp_file_path = temp_file_dir / "diaria_XXXXXX";
   const auto child_pid = fork();
@@ -89,6 +97,9 @@ auto interactive_content_entry(std::string_view cmdline,
         replace_first(cmdline, "%", temp_file_path.c_str());
     exec_cmdline(owned_cmdline);
   }
+  if (while_editing) {
+    while_editing();
+  }
 
   int child_status {};
   waitpid(child_pid, &child_status, 0);
@@ -100,11 +111,21 @@ auto interactive_content_entry(std::string_view cmdline,
                  temp_file_path.c_str());
     throw std::runtime_error("Executing editor");
   }
+  return temp_file_path;
+}
+}  // namespace
 
-  std::ifstream stream(temp_file_path, std::ios::in | std::ios::binary);
-  safe_vector<unsigned char> contents((std::istreambuf_iterator<char>(stream)),
-                                      std::istreambuf_iterator<char>());
-  if (stream.fail()) {
+auto interactive_content_entry(std::string_view cmdline,
+                               const std::filesystem::path& temp_file_dir,
+                               const std::function<void()>& while_editing)
+    -> safe_vector<unsigned char>
+{
+  const auto temp_file_path =
+      run_editor(cmdline, temp_file_dir, while_editing);
+  safe_vector<unsigned char> contents {};
+  try {
+    contents = read_file<safe_vector<unsigned char>>(temp_file_path);
+  } catch (const std::exception&) {
     std::println(
         stderr,
         "Error reading diary file. Unencrypted entry is still stored at {}",
@@ -148,37 +169,107 @@ void set_uid_map(uid_t uid, gid_t gid)
   write_to_file(proc_path / "uid_map", std::format("0 {} 1\n", uid));
 }
 
-void write_all(int pipe_fd, std::span<unsigned char> content)
+/**
+Seals which keep the content of a memfd from changing once received
+*/
+constexpr unsigned int entry_memfd_seals =
+    F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+/**
+Copy the file into a sealed memfd inside the kernel and send it over the
+socket, so the plaintext is not copied through this process and the pipe
+*/
+void send_as_sealed_memfd(int socket_fd, const std::filesystem::path& path)
 {
-  auto left_to_write = std::span(content);
-  while (!left_to_write.empty()) {
-    const ssize_t written =
-        write(pipe_fd, left_to_write.data(), left_to_write.size());
-    if (written == -1) {
-      throw std::runtime_error("Writing to pipe");
+  const smart_fd file_fd {open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (file_fd.fd == -1) {
+    throw std::runtime_error("Could not open temporary diary entry");
+  }
+  const smart_fd entry_fd {
+      memfd_create("diaria_entry", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+  if (entry_fd.fd == -1) {
+    throw std::runtime_error(std::format(
+        "Could not create memfd; Errno {} [{}]", errno, strerror(errno)));
+  }
+  while (true) {
+    constexpr std::size_t max_transfer = 1UL << 30U;
+    const ssize_t sent =
+        sendfile(entry_fd.fd, file_fd.fd, nullptr, max_transfer);
+    if (sent == 0) {
+      break;
+    }
+    if (sent == -1 && errno != EINTR) {
+      throw std::runtime_error(
+          std::format("Could not copy temporary diary entry; Errno {} [{}]",
+                      errno,
+                      strerror(errno)));
     }
-    left_to_write = left_to_write.subspan(static_cast<std::uint64_t>(written));
+  }
+  if (fcntl(entry_fd.fd, F_ADD_SEALS, entry_memfd_seals) == -1) {
+    throw std::runtime_error("Could not seal memfd");
+  }
+
+  std::array<char, CMSG_SPACE(sizeof(int))> control {};
+  unsigned char payload = 0;
+  iovec payload_vector {.iov_base = &payload, .iov_len = sizeof(payload)};
+  msghdr message {};
+  message.msg_iov = &payload_vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+  cmsghdr* const header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(header), &entry_fd.fd, sizeof(int));
+  if (sendmsg(socket_fd, &message, MSG_NOSIGNAL) == -1) {
+    throw std::runtime_error("Could not send diary entry");
   }
 }
 
-auto read_until_closed(int pipe_fd) -> safe_vector<unsigned char>
+/**
+Receive the memfd sent by `send_as_sealed_memfd` and copy its content into
+secure memory, the only copy made of the plaintext on its way out
+*/
+auto receive_sealed_memfd(int socket_fd) -> safe_vector<unsigned char>
 {
-  constexpr int buffer_size = 4096;
-  safe_array<unsigned char, buffer_size> buffer {};
-  safe_vector<unsigned char> result {};
-  ssize_t bytes_read {};
-
-  while ((bytes_read = read(pipe_fd, buffer.data(), buffer.size())) > 0) {
-    const auto bufferspan =
-        std::span(buffer.begin(), static_cast<std::size_t>(bytes_read));
-    // std::println("{} bytes read", bytes_read);
-    result.insert(result.end(), bufferspan.begin(), bufferspan.end());
+  std::array<char, CMSG_SPACE(sizeof(int))> control {};
+  unsigned char payload = 0;
+  iovec payload_vector {.iov_base = &payload, .iov_len = sizeof(payload)};
+  msghdr message {};
+  message.msg_iov = &payload_vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = control.size();
+  ssize_t received = 0;
+  do {
+    received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+  } while (received == -1 && errno == EINTR);
+  cmsghdr* const header = CMSG_FIRSTHDR(&message);
+  if (received <= 0 || header == nullptr || header->cmsg_level != SOL_SOCKET
+      || header->cmsg_type != SCM_RIGHTS)
+  {
+    throw std::runtime_error("Editor sandbox did not hand back the entry");
   }
-
-  if (bytes_read == -1) {
-    throw std::runtime_error("Reading from pipe");
+  int received_fd = -1;
+  std::memcpy(&received_fd, CMSG_DATA(header), sizeof(int));
+  const smart_fd entry_fd {received_fd};
+
+  // Without the seals, the size could change while being mapped
+  const int seals = fcntl(entry_fd.fd, F_GET_SEALS);
+  if (seals == -1
+      || (static_cast<unsigned int>(seals) & entry_memfd_seals)
+          != entry_memfd_seals)
+  {
+    throw std::runtime_error("Entry handed back by the sandbox is not sealed");
   }
-  return result;
+  const auto size = fd_size_hint(entry_fd.fd);
+  if (!size) {
+    throw std::runtime_error("Entry handed back by the sandbox is no file");
+  }
+  const mapped_file mapping {entry_fd.fd, static_cast<std::size_t>(*size)};
+  const auto bytes = mapping.bytes();
+  return {bytes.begin(), bytes.end()};
 }
 
 auto editor_in_private_namespace(void* arg_raw) -> int
@@ -203,27 +294,30 @@ auto editor_in_private_namespace(void* arg_raw) -> int
         "Could not mount tmpfs; Errno {} [{}]", errno, strerror(errno)));
   }
 
-  auto content = interactive_content_entry(arg->cmdline, mount_dir);
+  const auto temp_file_path = run_editor(arg->cmdline, mount_dir, {});
+  send_as_sealed_memfd(arg->tx_fd, temp_file_path);
+  close(arg->tx_fd);
+  unlink(temp_file_path.c_str());
 
   // Unmount the tmpfs
   if (umount(mount_dir.c_str()) == -1) {
     throw std::runtime_error("Could not unmount tmpfs");
   }
-
-  write_all(arg->tx_fd, content);
-  close(arg->tx_fd);
   return 0;
 }
 }  // namespace
 
-auto private_namespace_read(std::string_view cmdline)
+auto private_namespace_read(std::string_view cmdline,
+                            const std::function<void()>& while_editing)
     -> safe_vector<unsigned char>
 {
-  std::array<int, 2> pipefd {};  // File descriptors for the pipe
-
-  if (pipe2(pipefd.data(), O_CLOEXEC) == -1) {
-    throw std::runtime_error("Could not create unnamed pipe");
+  std::array<int, 2> socket_fds {};
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socket_fds.data())
+      == -1)
+  {
+    throw std::runtime_error("Could not create socket pair");
   }
+  const smart_fd receiving_socket {socket_fds[0]};
 
   constexpr uint64_t stack_size {1024L * 1024};
   auto stack = std::make_unique<std::array<char, stack_size>>();
@@ -232,7 +326,7 @@ auto private_namespace_read(std::string_view cmdline)
   editor_args args {.cmdline = cmdline,
                     .parent_uid = getuid(),
                     .parent_gid = getgid(),
-                    .tx_fd = pipefd[1]};
+                    .tx_fd = socket_fds[1]};
   pid_t const pid = clone(editor_in_private_namespace,
                           stack_top,
                           CLONE_NEWNS | CLONE_NEWUSER | SIGCHLD,
@@ -240,11 +334,14 @@ auto private_namespace_read(std::string_view cmdline)
   if (pid == -1) {
     throw std::runtime_error("Could not clone");
   }
-  close(pipefd[1]);
+  close(socket_fds[1]);
+  if (while_editing) {
+    while_editing();
+  }
 
-  // std::println("Waiting for content...");
-  auto content = read_until_closed(pipefd[0]);
-  // std::println("Received content");
+  // Waits until the editor has been closed, or the child exited without
+  // sending anything
+  auto content = receive_sealed_memfd(receiving_socket.fd);
 
   // Wait for the child process to complete
   if (waitpid(pid, nullptr, 0) == -1) {
@@ -1,13 +1,27 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
 #include <string_view>
 
 #include "crypto/safe_buffer.hpp"
 
-auto private_namespace_read(std::string_view cmdline)
+/**
+Run the editor in a mount namespace of its own, returning what was written.
+
+`while_editing` is called once the editor has been started, to do other work
+while waiting for the user. Threads must not be started before that, as the
+namespace is entered by a child cloned from this process.
+*/
+auto private_namespace_read(std::string_view cmdline,
+                            const std::function<void()>& while_editing = {})
     -> safe_vector<unsigned char>;
 
+/**
+Run the editor on a temporary file in `temp_file_dir`, see
+`private_namespace_read` regarding `while_editing`
+*/
 auto interactive_content_entry(std::string_view cmdline,
-                               const std::filesystem::path& temp_file_dir)
+                               const std::filesystem::path& temp_file_dir,
+                               const std::function<void()>& while_editing = {})
     -> safe_vector<unsigned char>;
\ No newline at end of file
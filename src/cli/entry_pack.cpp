@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "./entry_pack.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util/char.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+#include "util/little_endian.hpp"
+#include "util/smart_fd.hpp"
+
+namespace
+{
+/*
+Layout of a pack, integers are little endian:
+
+  magic | version | ciphertexts | entry count | index entries | index offset
+  | magic
+
+with each index entry being its name size as 2 bytes, the name, and the offset
+and size of its ciphertext as 8 bytes each.
+*/
+constexpr std::array<unsigned char, 8> pack_magic {
+    'd', 'i', 'a', 'r', 'i', 'a', 'p', 'k'};
+constexpr unsigned char pack_format_version = 1;
+constexpr std::size_t pack_header_size = pack_magic.size() + 1;
+constexpr std::size_t pack_footer_size =
+    sizeof(std::uint64_t) + pack_magic.size();
+
+[[noreturn]] void fail_pack(const std::filesystem::path& pack_path,
+                            std::string_view reason)
+{
+  throw std::runtime_error(
+      std::format("Pack \"{}\" is damaged: {}", pack_path.c_str(), reason));
+}
+
+auto parse_pack_index(const std::filesystem::path& pack_path,
+                      std::span<const unsigned char> bytes)
+    -> std::vector<packed_entry>
+{
+  if (bytes.size() < pack_header_size + pack_footer_size
+      || !std::ranges::equal(bytes.first(pack_magic.size()), pack_magic)
+      || !std::ranges::equal(bytes.last(pack_magic.size()), pack_magic))
+  {
+    fail_pack(pack_path, "Not a pack");
+  }
+  if (bytes[pack_magic.size()] != pack_format_version) {
+    fail_pack(pack_path, "Unknown pack version");
+  }
+  const auto index_end = bytes.size() - pack_footer_size;
+  const auto index_offset =
+      byte_reader {bytes.subspan(index_end, sizeof(std::uint64_t))}.integer(
+          sizeof(std::uint64_t));
+  if (index_offset < pack_header_size || index_offset > index_end) {
+    fail_pack(pack_path, "Index out of bounds");
+  }
+
+  byte_reader reader {bytes.subspan(index_offset, index_end - index_offset)};
+  const auto read_integer = [&reader, &pack_path](std::size_t size)
+  {
+    if (reader.data.size() < size) {
+      fail_pack(pack_path, "Index is truncated");
+    }
+    return reader.integer(size);
+  };
+  std::vector<packed_entry> index {};
+  const auto entry_count = read_integer(sizeof(std::uint64_t));
+  for (std::uint64_t entry = 0; entry < entry_count; ++entry) {
+    const auto name_size = read_integer(sizeof(std::uint16_t));
+    if (reader.data.size() < name_size) {
+      fail_pack(pack_path, "Index is truncated");
+    }
+    const auto name = reader.take(name_size);
+    packed_entry parsed {
+        .name = std::string(make_signed_char(name.data()), name.size()),
+        .offset = read_integer(sizeof(std::uint64_t)),
+        .size = read_integer(sizeof(std::uint64_t))};
+    // Names become paths when reading and filenames when dumping
+    if (parsed.name.empty() || parsed.name.contains('/')) {
+      fail_pack(pack_path, "Invalid entry name");
+    }
+    if (parsed.offset < pack_header_size || parsed.offset > index_offset
+        || parsed.size > index_offset - parsed.offset)
+    {
+      fail_pack(pack_path, "Entry out of bounds");
+    }
+    index.push_back(std::move(parsed));
+  }
+  // Sorted by name for looking entries up
+  std::ranges::sort(index, {}, &packed_entry::name);
+  return index;
+}
+}  // namespace
+
+entry_pack::entry_pack(const std::filesystem::path& pack_path)
+{
+  const smart_fd pack_fd {open(pack_path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (pack_fd.fd == -1) {
+    throw std::runtime_error(std::format("Could not open pack \"{}\"; {}",
+                                         pack_path.c_str(),
+                                         strerror(errno)));
+  }
+  struct stat pack_stat {};
+  if (fstat(pack_fd.fd, &pack_stat) == -1) {
+    throw std::runtime_error(
+        std::format("Could not stat pack \"{}\"", pack_path.c_str()));
+  }
+  // Entries are picked out of the pack, reading ahead of them is wasted
+  mapping = std::make_unique<mapped_file>(
+      pack_fd.fd, static_cast<std::size_t>(pack_stat.st_size), MADV_RANDOM);
+  index = parse_pack_index(pack_path, mapping->bytes());
+}
+
+auto entry_pack::find(std::string_view name) const
+    -> std::optional<std::span<const unsigned char>>
+{
+  const auto entry =
+      std::ranges::lower_bound(index, name, {}, &packed_entry::name);
+  if (entry == index.end() || entry->name != name) {
+    return std::nullopt;
+  }
+  return contents(*entry);
+}
+
+void write_pack(const std::filesystem::path& pack_path,
+                std::span<const pack_input> entries)
+{
+  std::vector<unsigned char> pack {pack_magic.begin(), pack_magic.end()};
+  pack.push_back(pack_format_version);
+  std::vector<std::uint64_t> offsets {};
+  for (const auto& entry : entries) {
+    offsets.push_back(pack.size());
+    pack.insert(pack.end(), entry.contents.begin(), entry.contents.end());
+  }
+  const auto index_offset = pack.size();
+  put_integer(pack, entries.size(), sizeof(std::uint64_t));
+  for (std::size_t entry = 0; entry < entries.size(); ++entry) {
+    const auto& [name, contents] = entries[entry];
+    put_integer(pack, name.size(), sizeof(std::uint16_t));
+    pack.insert(pack.end(), name.begin(), name.end());
+    put_integer(pack, offsets[entry], sizeof(std::uint64_t));
+    put_integer(pack, contents.size(), sizeof(std::uint64_t));
+  }
+  put_integer(pack, index_offset, sizeof(std::uint64_t));
+  pack.insert(pack.end(), pack_magic.begin(), pack_magic.end());
+
+  std::filesystem::create_directories(pack_path.parent_path());
+  write_file_durably(pack_path, pack, S_IRUSR | S_IRGRP | S_IROTH);
+}
+
+void write_pack(const std::filesystem::path& pack_path,
+                std::span<const std::filesystem::path> entries)
+{
+  std::vector<std::string> names {};
+  std::vector<std::vector<unsigned char>> contents {};
+  for (const auto& entry_path : entries) {
+    names.push_back(entry_path.filename().string());
+    contents.push_back(read_file(entry_path));
+  }
+  std::vector<pack_input> inputs {};
+  for (std::size_t entry = 0; entry < entries.size(); ++entry) {
+    inputs.push_back({.name = names[entry], .contents = contents[entry]});
+  }
+  write_pack(pack_path, inputs);
+}
+
+auto pack_name_for(std::string_view first, std::string_view last)
+    -> std::string
+{
+  return std::format("{}_{}{}",
+                     std::filesystem::path {first}.stem().string(),
+                     std::filesystem::path {last}.stem().string(),
+                     pack_extension);
+}
+
+auto split_packed_path(const std::filesystem::path& entry_path)
+    -> std::optional<std::pair<std::filesystem::path, std::string>>
+{
+  auto pack_path = entry_path.parent_path();
+  if (pack_path.extension() != std::filesystem::path {pack_extension}
+      || pack_path.parent_path().filename()
+          != std::filesystem::path {pack_directory_name})
+  {
+    return std::nullopt;
+  }
+  return std::pair {std::move(pack_path), entry_path.filename().string()};
+}
+
+auto entry_pack_cache::open(const std::filesystem::path& pack_path)
+    -> const entry_pack&
+{
+  auto& pack = packs[pack_path];
+  if (!pack) {
+    pack = std::make_unique<entry_pack>(pack_path);
+  }
+  return *pack;
+}
+
+auto entry_pack_cache::contents(const std::filesystem::path& entry_path)
+    -> std::optional<std::span<const unsigned char>>
+{
+  const auto packed = split_packed_path(entry_path);
+  if (!packed) {
+    return std::nullopt;
+  }
+  const auto& [pack_path, name] = *packed;
+  const auto entry = open(pack_path).find(name);
+  if (!entry) {
+    throw std::runtime_error(std::format(
+        "Pack \"{}\" has no entry \"{}\"", pack_path.c_str(), name));
+  }
+  return entry;
+}
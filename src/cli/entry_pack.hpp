@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "util/file_io.hpp"
+
+/**
+Directory of the repository holding the packs
+*/
+constexpr std::string_view pack_directory_name {"packs"};
+constexpr std::string_view pack_extension {".pack"};
+
+/**
+Entry stored within a pack
+*/
+struct packed_entry
+{
+  /**
+  Filename of the entry before it was packed
+  */
+  std::string name;
+  std::uint64_t offset {};
+  std::uint64_t size {};
+};
+
+/**
+Pack of entries, mapped into memory.
+
+A pack holds the ciphertexts of many entries one after another, followed by an
+index of their names and positions. Packs are written once and never modified,
+so their entries are handed out as slices of the mapping instead of being
+copied.
+*/
+class entry_pack
+{
+  std::unique_ptr<mapped_file> mapping;
+  std::vector<packed_entry> index;
+
+public:
+  explicit entry_pack(const std::filesystem::path& pack_path);
+
+  /**
+  Entries of the pack, sorted by their name
+  */
+  [[nodiscard]] auto entries() const -> std::span<const packed_entry>
+  {
+    return index;
+  }
+  [[nodiscard]] auto contents(const packed_entry& entry) const
+      -> std::span<const unsigned char>
+  {
+    return mapping->bytes().subspan(entry.offset, entry.size);
+  }
+
+  /**
+  Contents of the entry of the given name
+  */
+  [[nodiscard]] auto find(std::string_view name) const
+      -> std::optional<std::span<const unsigned char>>;
+};
+
+/**
+Entry to be written into a pack
+*/
+struct pack_input
+{
+  std::string_view name;
+  std::span<const unsigned char> contents;
+};
+
+/**
+Write the entries into a pack, which only appears at `pack_path` once it is
+complete and on disk, replacing an existing pack of the name
+*/
+void write_pack(const std::filesystem::path& pack_path,
+                std::span<const pack_input> entries);
+
+/**
+Write the entry files into a pack, see above. The entries keep their
+filenames.
+*/
+void write_pack(const std::filesystem::path& pack_path,
+                std::span<const std::filesystem::path> entries);
+
+/**
+Name of a pack holding the entries from `first` to `last`, given by their
+filenames, so listing a time range can skip packs outside of it
+*/
+auto pack_name_for(std::string_view first, std::string_view last)
+    -> std::string;
+
+/**
+Entries within a pack are addressed by the path of the pack followed by their
+name, like packs/<pack>.pack/<entry>.diaria. Splits such a path into the pack
+and the name, or returns nothing for entries stored in a file of their own.
+*/
+auto split_packed_path(const std::filesystem::path& entry_path)
+    -> std::optional<std::pair<std::filesystem::path, std::string>>;
+
+/**
+Packs opened while reading entries, each of them mapped once
+*/
+class entry_pack_cache
+{
+  std::map<std::filesystem::path, std::unique_ptr<entry_pack>> packs;
+
+public:
+  auto open(const std::filesystem::path& pack_path) -> const entry_pack&;
+
+  /**
+  Contents of the entry if it is stored in a pack, nothing if it is stored in
+  a file of its own
+  */
+  auto contents(const std::filesystem::path& entry_path)
+      -> std::optional<std::span<const unsigned char>>;
+};
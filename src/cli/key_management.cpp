@@ -1,10 +1,73 @@
+#include <algorithm>
 #include <cstdlib>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <string>
 
 #include "./key_management.hpp"
 
+#include <sodium/utils.h>
 #include <unistd.h>
 
+#include "crypto/compress.hpp"
+#include "crypto/entry.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+
 auto read_password() -> safe_string
 {
   return {getpass("Enter password: ")};
-}
\ No newline at end of file
+}
+
+auto load_symkey(const key_repo_paths_t& paths) -> symkey_t
+{
+  symkey_t symkey {};
+  read_file_start(paths.get_symkey_path(), symkey);
+  return symkey;
+}
+
+auto load_dictionary(const std::filesystem::path& path, symkey_span_t symkey)
+    -> compression_dictionary
+{
+  const auto encrypted = read_file(path);
+  const auto decrypted = symdec(symkey, encrypted);
+  compression_dictionary dictionary {};
+  if (decrypted.size() < dictionary.id.size()) {
+    throw std::runtime_error("Dictionary file is truncated");
+  }
+  const auto decrypted_span = std::span<const unsigned char>(decrypted);
+  std::ranges::copy(decrypted_span.first(dictionary.id.size()),
+                    dictionary.id.begin());
+  const auto content = decrypted_span.subspan(dictionary.id.size());
+  dictionary.content.assign(content.begin(), content.end());
+  return dictionary;
+}
+
+void store_dictionary(const key_repo_paths_t& paths,
+                      symkey_span_t symkey,
+                      const compression_dictionary& dictionary)
+{
+  safe_vector<unsigned char> plaintext {};
+  plaintext.insert(plaintext.end(), dictionary.id.begin(), dictionary.id.end());
+  plaintext.insert(plaintext.end(),
+                   dictionary.content.begin(),
+                   dictionary.content.end());
+  const auto encrypted = symenc(symkey, plaintext);
+
+  std::string id_hex(dictionary.id.size() * 2 + 1, '\0');
+  sodium_bin2hex(
+      id_hex.data(), id_hex.size(), dictionary.id.data(), dictionary.id.size());
+  id_hex.pop_back();
+
+  // Archived on disk first, so entries compressed with the new dictionary can
+  // always be decompressed, even after a crash
+  if (std::filesystem::create_directories(
+          paths.get_dictionary_archive_path()))
+  {
+    flush_directory(paths.get_dictionary_archive_path().parent_path());
+  }
+  write_file_durably(
+      paths.get_dictionary_archive_path() / (id_hex + ".sym"), encrypted);
+  write_file_durably(paths.get_dictionary_path(), encrypted);
+}
@@ -1,10 +1,15 @@
 
 #pragma once
+#include <cstddef>
 #include <filesystem>
+#include <memory>
 #include <vector>
 
+#include "crypto/compress.hpp"
 #include "crypto/entry.hpp"
 #include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
+#include "util/file_io.hpp"
 
 auto read_password() -> safe_string;
 
@@ -14,30 +19,155 @@ struct key_repo_paths_t
   [[nodiscard]] auto get_symkey_path() const { return root / "key.sym"; }
   [[nodiscard]] auto get_pubkey_path() const { return root / "key.pub"; }
   [[nodiscard]] auto get_private_key_path() const { return root / "key.key"; }
+  /**
+  Dictionary new entries are compressed with
+  */
+  [[nodiscard]] auto get_dictionary_path() const { return root / "dict.sym"; }
+  /**
+  Every dictionary ever used, entries refer to them by id
+  */
+  [[nodiscard]] auto get_dictionary_archive_path() const
+  {
+    return root / "dictionaries";
+  }
 };
 
+/**
+Read the symmetric key, which is stored without a password
+*/
+auto load_symkey(const key_repo_paths_t& paths) -> symkey_t;
+
+/**
+Read a compression dictionary, which is stored encrypted with the symmetric key
+*/
+auto load_dictionary(const std::filesystem::path& path, symkey_span_t symkey)
+    -> compression_dictionary;
+
+/**
+Add the dictionary to the archive and use it for new entries
+*/
+void store_dictionary(const key_repo_paths_t& paths,
+                      symkey_span_t symkey,
+                      const compression_dictionary& dictionary);
+
+/**
+Clones of the compression context for `count` worker threads
+*/
+inline auto make_worker_contexts(const compression_context& context,
+                                 std::size_t count)
+    -> std::vector<compression_context>
+{
+  std::vector<compression_context> contexts {};
+  contexts.reserve(count);
+  for (std::size_t worker = 0; worker < count; ++worker) {
+    contexts.push_back(context.clone());
+  }
+  return contexts;
+}
+
+/**
+Unlocked keys for reading entries. The compression context is kept between
+entries, so a decryptor must not be used from several threads at once.
+*/
 struct entry_decryptor
 {
   symkey_t symkey;
-  private_key_t private_key;
+  /**
+  Holder of the private key, this process or the key agent
+  */
+  std::unique_ptr<box_opener> opener;
+  compression_context context {};
 
-  [[nodiscard]] auto decrypt(std::span<const unsigned char> filebytes) const
+  [[nodiscard]] auto decrypt(std::span<const unsigned char> filebytes)
       -> safe_vector<unsigned char>
   {
-    return ::decrypt(
-        symkey_span_t {symkey}, private_key_span_t {private_key}, filebytes);
+    return ::decrypt(symkey_span_t {symkey}, *opener, context, filebytes);
+  }
+
+  /**
+  Decrypt the entry read from `input_fd`, streaming the plaintext into `output`
+  */
+  void decrypt(int input_fd, byte_sink& output)
+  {
+    decrypt(input_fd, output, context);
+  }
+
+  /**
+  Decrypt using the given compression context. The keys are only read and
+  openers can be shared between threads, so several threads can decrypt at
+  once with a context each.
+  */
+  void decrypt(int input_fd,
+               byte_sink& output,
+               compression_context& worker_context) const
+  {
+    entry_decrypt_sink decryption {symkey_span_t {symkey},
+                                   *opener,
+                                   worker_context,
+                                   output,
+                                   fd_size_hint(input_fd)};
+    pump_fd(input_fd, decryption);
+  }
+
+  /**
+  Decrypt the entry already read into memory, see above regarding the context
+  */
+  void decrypt(std::span<const unsigned char> filebytes,
+               byte_sink& output,
+               compression_context& worker_context) const
+  {
+    entry_decrypt_sink decryption {symkey_span_t {symkey},
+                                   *opener,
+                                   worker_context,
+                                   output,
+                                   filebytes.size()};
+    decryption.write(filebytes);
+    decryption.finish();
   }
 };
 
+/**
+Keys for writing entries, see `entry_decryptor` regarding the compression
+context
+*/
 struct entry_encryptor
 {
   symkey_t symkey;
   public_key_t public_key;
+  compression_context context {};
+  stream_cipher cipher {stream_cipher::xchacha20poly1305};
+
+  [[nodiscard]] auto encrypt(std::span<const unsigned char> filebytes)
+      -> std::vector<unsigned char>
+  {
+    return encrypt(filebytes, context);
+  }
 
-  [[nodiscard]] auto encrypt(std::span<const unsigned char> filebytes) const
+  /**
+  Encrypt using the given compression context, see `entry_decryptor`
+  */
+  [[nodiscard]] auto encrypt(std::span<const unsigned char> filebytes,
+                             compression_context& worker_context) const
       -> std::vector<unsigned char>
   {
-    return ::encrypt(
-        symkey_span_t {symkey}, public_key_span_t {public_key}, filebytes);
+    return ::encrypt(symkey_span_t {symkey},
+                     public_key_span_t {public_key},
+                     worker_context,
+                     filebytes,
+                     cipher);
+  }
+
+  /**
+  Encrypt the plaintext read from `input_fd`, streaming the entry into `output`
+  */
+  void encrypt(int input_fd, byte_sink& output)
+  {
+    entry_encrypt_sink encryption {symkey_span_t {symkey},
+                                   public_key_span_t {public_key},
+                                   context,
+                                   output,
+                                   fd_size_hint(input_fd),
+                                   cipher};
+    pump_fd(input_fd, encryption);
   }
-};
\ No newline at end of file
+};
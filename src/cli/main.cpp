@@ -1,19 +1,75 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <format>
 #include <memory>
 #include <optional>
 #include <print>
+#include <ranges>
+#include <stdexcept>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <CLI11/CLI11.hpp>
 #include <pwd.h>
 #include <unistd.h>
 
+#include "cli/agent.hpp"
 #include "cli/command_types.hpp"
 #include "cli/commands.hpp"
+#include "cli/repo_management.hpp"
 #include "cli_commands.hpp"
+#include "crypto/compress.hpp"
+#include "util/parallel.hpp"
+#include "util/time.hpp"
+
+namespace
+{
+/**
+Add --since and --until to the command, setting the range if either is given
+*/
+void add_time_range_options(CLI::App* command,
+                            std::optional<time_range>& range)
+{
+  command->add_option_function<std::string>(
+      "--since",
+      [&range](const std::string& since)
+      {
+        range = range.value_or(time_range {});
+        range->first = parse_time_bound(since, false);
+      },
+      "Only entries written at or after this date, or date and time");
+  command->add_option_function<std::string>(
+      "--until",
+      [&range](const std::string& until)
+      {
+        range = range.value_or(time_range {});
+        range->last = parse_time_bound(until, true);
+      },
+      "Only entries written at or before this date, or date and time");
+}
+
+/**
+Accepts durations like 3d, 2w, 6m or 1y
+*/
+auto duration_validator() -> CLI::Validator
+{
+  return CLI::Validator(
+      [](const std::string& duration) -> std::string
+      {
+        try {
+          parse_duration(duration);
+        } catch (const std::invalid_argument& error) {
+          return error.what();
+        }
+        return {};
+      },
+      "DURATION");
+}
+}  // namespace
 
 auto main(int argc, char** argv) -> int
 {
@@ -29,18 +85,37 @@ auto main(int argc, char** argv) -> int
 
   std::filesystem::path read_entry_path {};
   std::optional<std::filesystem::path> read_output {};
+  std::optional<time_range> read_range {};
   CLI::App* subcom_read =
       app->add_subcommand("read", "Read a diary entry")
           ->final_callback(
               [&keyrepo = base_command.keyrepo,
+               &repopath = base_command.repopath,
                &password = base_command.password,
+               &compression = base_command.compression,
                &read_entry_path,
-               &read_output]()
+               &read_output,
+               &read_range]()
               {
-                read_entry(std::make_unique<file_entry_decryptor_initializer>(
-                               std::move(password), keyrepo),
-                           read_entry_path,
-                           read_output);
+                auto keys = std::make_unique<file_entry_decryptor_initializer>(
+                    std::move(password), keyrepo, compression);
+                if (read_range) {
+                  if (!read_entry_path.empty()) {
+                    throw std::invalid_argument(
+                        "Give either an entry path or a time range");
+                  }
+                  read_entries(std::move(keys),
+                               keyrepo,
+                               repopath,
+                               *read_range,
+                               read_output);
+                  return;
+                }
+                if (read_entry_path.empty()) {
+                  throw std::invalid_argument(
+                      "Give an entry path or a time range");
+                }
+                read_entry(std::move(keys), read_entry_path, read_output);
               });
   subcom_read
       ->add_option(
@@ -57,8 +132,8 @@ auto main(int argc, char** argv) -> int
           "File to write output in")
       ->default_str("-");
   subcom_read->add_option("path", read_entry_path, "Path to entry")
-      ->check(CLI::ExistingFile)
-      ->required();
+      ->check(CLI::ExistingFile);
+  add_time_range_options(subcom_read, read_range);
   std::string dumped_repo_path {};
   CLI::App* subcom_repo_load = app->add_subcommand(
       "load", "Load a dumped directory of cleartext into the repository");
@@ -74,26 +149,39 @@ auto main(int argc, char** argv) -> int
                    dumped_repo_path,
                    "Directory to store the cleartext entries in")
       ->required();
+  std::optional<time_range> dump_range {};
+  add_time_range_options(subcom_repo_dump, dump_range);
 
   subcom_repo_dump->final_callback(
       [&keyrepo = base_command.keyrepo,
        &repopath = base_command.repopath,
        &password = base_command.password,
-       &dumped_repo_path]()
+       &compression = base_command.compression,
+       &jobs = base_command.jobs,
+       &dumped_repo_path,
+       &dump_range]()
       {
         dump_repo(std::make_unique<file_entry_decryptor_initializer>(
-                      std::move(password), keyrepo),
+                      std::move(password), keyrepo, compression),
+                  keyrepo,
                   repopath,
-                  dumped_repo_path);
+                  dumped_repo_path,
+                  dump_range,
+                  resolve_job_count(jobs));
       });
   subcom_repo_load->final_callback(
       [&keyrepo = base_command.keyrepo,
+       &compression = base_command.compression,
+       &cipher = base_command.cipher,
        &repopath = base_command.repopath,
+       &jobs = base_command.jobs,
        &dumped_repo_path]()
       {
-        load_repo(std::make_unique<file_entry_encryptor_initializer>(keyrepo),
+        load_repo(std::make_unique<file_entry_encryptor_initializer>(
+                      keyrepo, compression, cipher),
                   repopath,
-                  dumped_repo_path);
+                  dumped_repo_path,
+                  resolve_job_count(jobs));
       });
 
   CLI::App* subcom_repo_sync = app->add_subcommand(
@@ -109,22 +197,183 @@ auto main(int argc, char** argv) -> int
       "--long",
       summarize_long,
       "Do not press enter to advance to next entry, just print everything");
+  std::vector<std::string> summarize_intervals = default_summarize_intervals;
+  subcom_repo_summarize
+      ->add_option("--intervals",
+                   summarize_intervals,
+                   "How long ago the shown entries were written, like 3d, 2w, "
+                   "6m or 1y")
+      ->check(duration_validator())
+      ->capture_default_str();
   subcom_repo_summarize->final_callback(
       [&keyrepo = base_command.keyrepo,
        &repopath = base_command.repopath,
        &password = base_command.password,
-       &summarize_long]()
+       &compression = base_command.compression,
+       &jobs = base_command.jobs,
+       &summarize_long,
+       &summarize_intervals]()
       {
         summarize_repo(std::make_unique<file_entry_decryptor_initializer>(
-                           std::move(password), keyrepo),
+                           std::move(password), keyrepo, compression),
+                       keyrepo,
                        repopath,
-                       !summarize_long);
+                       summarize_intervals
+                           | std::views::transform(parse_duration)
+                           | std::ranges::to<std::vector>(),
+                       !summarize_long,
+                       resolve_job_count(jobs));
+      });
+
+  std::size_t dictionary_size = default_dictionary_size;
+  CLI::App* subcom_train = app->add_subcommand(
+      "train",
+      "Train a compression dictionary for new entries from the existing ones");
+  subcom_train
+      ->add_option(
+          "--size", dictionary_size, "Maximum size of the dictionary in bytes")
+      ->check(CLI::Range(std::size_t {1}, std::size_t {1} << 20U))
+      ->capture_default_str();
+  subcom_train->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &repopath = base_command.repopath,
+       &password = base_command.password,
+       &compression = base_command.compression,
+       &dictionary_size]()
+      {
+        train_repo_dictionary(
+            std::make_unique<file_entry_decryptor_initializer>(
+                std::move(password), keyrepo, compression),
+            keyrepo,
+            repopath,
+            dictionary_size);
       });
 
   CLI::App* subcom_repo_stats =
       app->add_subcommand("stats", "Show stats of the repository");
-  subcom_repo_stats->final_callback([&repopath = base_command.repopath]()
-                                    { repo_stats(repopath); });
+  std::optional<int> stats_year {};
+  subcom_repo_stats->add_option(
+      "--year", stats_year, "Only show the entries of this year");
+  subcom_repo_stats->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &repopath = base_command.repopath,
+       &stats_year]()
+      {
+        repo_stats(repopath,
+                   keyrepo,
+                   stats_year.transform([](int year)
+                                        { return std::chrono::year {year}; }));
+      });
+
+  std::string repack_age {"3m"};
+  std::uint64_t repack_pack_size = default_pack_size;
+  CLI::App* subcom_repo_repack = app->add_subcommand(
+      "repack",
+      "Move old entries out of their own files into packs, which are faster "
+      "to read through and to synchronize");
+  subcom_repo_repack
+      ->add_option("--older_than",
+                   repack_age,
+                   "Only pack entries written longer ago than this, like 3d, "
+                   "2w, 6m or 1y")
+      ->check(duration_validator())
+      ->capture_default_str();
+  subcom_repo_repack
+      ->add_option("--pack_size",
+                   repack_pack_size,
+                   "Bytes of entries put into a single pack")
+      ->check(CLI::PositiveNumber)
+      ->capture_default_str();
+  subcom_repo_repack->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &repopath = base_command.repopath,
+       &repack_age,
+       &repack_pack_size]()
+      {
+        repack_repo(
+            repopath, keyrepo, parse_duration(repack_age), repack_pack_size);
+      });
+
+  std::string recompress_age {"1y"};
+  std::uint32_t recompress_preset = 9;
+  CLI::App* subcom_repo_recompress = app->add_subcommand(
+      "recompress",
+      "Compress old entries again with the extreme variant of a high preset, "
+      "and the trained dictionary if there is one");
+  subcom_repo_recompress
+      ->add_option("--older_than",
+                   recompress_age,
+                   "Only recompress entries written longer ago than this, "
+                   "like 3d, 2w, 6m or 1y")
+      ->check(duration_validator())
+      ->capture_default_str();
+  subcom_repo_recompress
+      ->add_option("--preset", recompress_preset, "Preset level to use")
+      ->check(CLI::Range(0, 9))
+      ->capture_default_str();
+  subcom_repo_recompress->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &repopath = base_command.repopath,
+       &password = base_command.password,
+       &compression = base_command.compression,
+       &cipher = base_command.cipher,
+       &jobs = base_command.jobs,
+       &recompress_age,
+       &recompress_preset]()
+      {
+        auto strong_compression = compression;
+        strong_compression.preset = recompress_preset;
+        strong_compression.extreme_threshold = 1;
+        recompress_repo(std::make_unique<file_entry_decryptor_initializer>(
+                            std::move(password), keyrepo, compression),
+                        std::make_unique<file_entry_encryptor_initializer>(
+                            keyrepo, strong_compression, cipher),
+                        keyrepo,
+                        repopath,
+                        parse_duration(recompress_age),
+                        resolve_job_count(jobs));
+      });
+
+  std::size_t migrate_limit {};
+  CLI::App* subcom_repo_migrate = app->add_subcommand(
+      "migrate",
+      "Move the entries of the repository into a directory per month, new "
+      "entries are stored there as well");
+  subcom_repo_migrate
+      ->add_option("--limit",
+                   migrate_limit,
+                   "Move at most this many entries, 0 to move all. The "
+                   "migration continues where it stopped when run again")
+      ->capture_default_str();
+  subcom_repo_migrate->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &repopath = base_command.repopath,
+       &migrate_limit]()
+      { migrate_repo(repopath, keyrepo, migrate_limit); });
+
+  std::filesystem::path agent_socket = default_agent_socket_path();
+  unsigned int agent_timeout = 3600;
+  CLI::App* subcom_agent = app->add_subcommand(
+      "agent", "Keep the unlocked private key in memory for other commands");
+  subcom_agent->add_option("--socket", agent_socket, "Socket to listen on")
+      ->capture_default_str();
+  subcom_agent
+      ->add_option("--timeout",
+                   agent_timeout,
+                   "Exit after this many seconds without a request, 0 to "
+                   "never exit")
+      ->capture_default_str();
+  subcom_agent->final_callback(
+      [&keyrepo = base_command.keyrepo,
+       &password = base_command.password,
+       &agent_socket,
+       &agent_timeout]()
+      {
+        run_agent(std::move(password),
+                  keyrepo,
+                  agent_socket,
+                  std::chrono::seconds {agent_timeout});
+      });
   try {
     CLI11_PARSE(*app, argc, argv);
 
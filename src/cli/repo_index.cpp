@@ -0,0 +1,477 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <print>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "./repo_index.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "cli/command_types.hpp"
+#include "cli/entry_pack.hpp"
+#include "cli/key_management.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/compress.hpp"
+#include "crypto/entry.hpp"
+#include "crypto/stream.hpp"
+#include "util/char.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+#include "util/little_endian.hpp"
+#include "util/smart_fd.hpp"
+
+namespace
+{
+constexpr unsigned char index_format_version = 3;
+
+auto get_index_path(const repo_path_t& repo) -> std::filesystem::path
+{
+  return get_index_directory(repo) / "entries.sym";
+}
+
+auto get_index_lock_path(const repo_path_t& repo) -> std::filesystem::path
+{
+  return get_index_directory(repo) / "lock";
+}
+
+/**
+Open and lock the lock file of the index, -1 if that is not possible
+*/
+auto lock_index(const repo_path_t& repo) -> int
+{
+  std::error_code error {};
+  std::filesystem::create_directories(get_index_directory(repo), error);
+  const int lock_fd = open(get_index_lock_path(repo).c_str(),
+                           O_RDWR | O_CREAT | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR);
+  if (lock_fd == -1) {
+    return -1;
+  }
+  int locked = flock(lock_fd, LOCK_EX | LOCK_NB);
+  if (locked == -1 && errno == EWOULDBLOCK) {
+    std::println(stderr,
+                 "Waiting for another command writing to the repository");
+    do {
+      locked = flock(lock_fd, LOCK_EX);
+    } while (locked == -1 && errno == EINTR);
+  }
+  if (locked == -1) {
+    close(lock_fd);
+    return -1;
+  }
+  return lock_fd;
+}
+
+/**
+Filesystems with a timestamp granularity of seconds can modify the repository
+after the index has been written without changing its modification time
+*/
+constexpr auto coarse_timestamp_window = std::chrono::seconds {2};
+
+auto is_coarse(std::filesystem::file_time_type time) -> bool
+{
+  return time.time_since_epoch() % std::chrono::seconds {1}
+      == std::filesystem::file_time_type::duration::zero();
+}
+
+/**
+Modification time of a directory, relative to the repository
+*/
+struct directory_time
+{
+  std::string directory;
+  std::filesystem::file_time_type time;
+};
+
+/**
+Modification times of the repository, its shards and the pack directory,
+which change whenever an entry or pack is added to or removed from one of them.
+The repository itself comes first.
+*/
+auto directory_times(const repo_path_t& repo)
+    -> std::optional<std::vector<directory_time>>
+{
+  std::error_code error {};
+  std::vector<directory_time> result {
+      {.directory = {},
+       .time = std::filesystem::last_write_time(repo.repo, error)}};
+  // Listing the repository for its shards is what the index saves, so only
+  // sharded repositories are listed
+  auto directories = is_sharded(repo) ? shard_directories(repo)
+                                      : std::vector<std::filesystem::path> {};
+  if (std::filesystem::exists(repo.repo / pack_directory_name)) {
+    directories.emplace_back(pack_directory_name);
+  }
+  for (const auto& directory : directories) {
+    result.push_back({.directory = directory.string(),
+                      .time = std::filesystem::last_write_time(
+                          repo.repo / directory, error)});
+  }
+  if (error) {
+    return std::nullopt;
+  }
+  return result;
+}
+
+/**
+Parse the header at the start of an entry, given at least its header or all
+of it if shorter
+*/
+auto parse_header_of(std::span<const unsigned char> entry_start)
+    -> entry_header_info
+{
+  if (entry_start.size() < entry_prefix_size) {
+    throw std::runtime_error("Entry is truncated");
+  }
+  const auto header_size =
+      entry_header_size_of(entry_start.first<entry_prefix_size>());
+  if (entry_start.size() < header_size) {
+    throw std::runtime_error("Entry is truncated");
+  }
+  return parse_entry_header(entry_start.first(header_size));
+}
+
+auto read_entry_header(const std::filesystem::path& entry_path)
+    -> entry_header_info
+{
+  // Only the header is read, so readahead of the whole entry is wasted
+  const smart_fd entry_fd {open(entry_path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (entry_fd.fd == -1) {
+    throw std::runtime_error("Could not open entry file");
+  }
+  std::array<unsigned char, entry_header_size> header {};
+  // Headers of all versions fit, shorter ones are followed by ciphertext
+  const auto header_read = read_fully(entry_fd.fd, header);
+  return parse_header_of(std::span(header).first(header_read));
+}
+
+auto index_entry(const std::filesystem::path& entry_path,
+                 entry_pack_cache& packs) -> std::optional<entry_header_info>
+{
+  try {
+    if (const auto packed = packs.contents(entry_path)) {
+      return parse_header_of(
+          packed->first(std::min(packed->size(), entry_header_size)));
+    }
+    return read_entry_header(entry_path);
+  } catch (const std::exception&) {
+    // Reported once the entry is decrypted, listing it does not need the
+    // header
+    return std::nullopt;
+  }
+}
+
+auto serialize_index(const std::vector<directory_time>& times,
+                     const repo_index& index) -> std::vector<unsigned char>
+{
+  std::vector<unsigned char> serialized {index_format_version};
+  put_integer(serialized, times.size(), sizeof(std::uint64_t));
+  for (const auto& [directory, time] : times) {
+    put_integer(serialized, directory.size(), sizeof(std::uint16_t));
+    serialized.insert(serialized.end(), directory.begin(), directory.end());
+    put_integer(serialized,
+                static_cast<std::uint64_t>(time.time_since_epoch().count()),
+                sizeof(std::uint64_t));
+  }
+  const auto& entries = index.entries;
+  put_integer(serialized, entries.size(), sizeof(std::uint64_t));
+  for (std::size_t entry = 0; entry < entries.size(); ++entry) {
+    const auto& header = index.headers[entry];
+    put_integer(serialized,
+                static_cast<std::uint64_t>(
+                    entries.entry_time(entry).time_since_epoch().count()),
+                sizeof(std::uint64_t));
+    put_integer(serialized, entries.file_size(entry), sizeof(std::uint64_t));
+    serialized.push_back(static_cast<unsigned char>(header.has_value()));
+    const auto info = header.value_or(entry_header_info {});
+    serialized.push_back(info.version);
+    serialized.push_back(static_cast<unsigned char>(info.codec));
+    serialized.push_back(static_cast<unsigned char>(info.cipher));
+    const auto dictionary = info.dictionary.value_or(dictionary_id_t {});
+    serialized.insert(serialized.end(), dictionary.begin(), dictionary.end());
+    const auto name = entries.name(entry);
+    put_integer(serialized, name.size(), sizeof(std::uint16_t));
+    serialized.insert(serialized.end(), name.begin(), name.end());
+  }
+  return serialized;
+}
+
+auto deserialize_index(const repo_path_t& repo,
+                       std::span<const unsigned char> serialized)
+    -> std::pair<std::vector<directory_time>, repo_index>
+{
+  byte_reader reader {serialized};
+  if (reader.integer(1) != index_format_version) {
+    throw std::runtime_error("Unknown index version");
+  }
+  std::vector<directory_time> times {};
+  const auto directory_count = reader.integer(sizeof(std::uint64_t));
+  for (std::uint64_t directory = 0; directory < directory_count; ++directory) {
+    const auto name = reader.take(reader.integer(sizeof(std::uint16_t)));
+    times.push_back(
+        {.directory = std::string(make_signed_char(name.data()), name.size()),
+         .time = std::filesystem::file_time_type {
+             std::filesystem::file_time_type::duration {
+                 static_cast<std::filesystem::file_time_type::rep>(
+                     reader.integer(sizeof(std::uint64_t)))}}});
+  }
+  const auto entry_count = reader.integer(sizeof(std::uint64_t));
+  repo_index index {.entries = entry_catalog {repo.repo}, .headers = {}};
+  // Every entry takes at least a byte, so a damaged count can not make this
+  // reserve more than the size of the index
+  const auto reserved = std::min<std::uint64_t>(entry_count, serialized.size());
+  index.entries.reserve(reserved, reserved * iso_timestamp_length);
+  index.headers.reserve(reserved);
+  for (std::uint64_t entry = 0; entry < entry_count; ++entry) {
+    const time_point entry_time {time_point::duration {
+        static_cast<time_point::rep>(reader.integer(sizeof(std::uint64_t)))}};
+    const auto size = reader.integer(sizeof(std::uint64_t));
+    const bool has_header = reader.integer(1) != 0;
+    entry_header_info info {};
+    info.version = static_cast<unsigned char>(reader.integer(1));
+    info.codec = static_cast<compression_codec>(reader.integer(1));
+    info.cipher = static_cast<stream_cipher>(reader.integer(1));
+    const auto dictionary = reader.take(std::tuple_size_v<dictionary_id_t>);
+    if (!std::ranges::all_of(dictionary,
+                             [](unsigned char byte) { return byte == 0; }))
+    {
+      info.dictionary.emplace();
+      std::ranges::copy(dictionary, info.dictionary->begin());
+    }
+    index.headers.push_back(has_header ? std::optional {info} : std::nullopt);
+    const auto name = reader.take(reader.integer(sizeof(std::uint16_t)));
+    index.entries.push_back(
+        entry_time,
+        std::string_view {make_signed_char(name.data()), name.size()},
+        size);
+  }
+  return {std::move(times), std::move(index)};
+}
+auto current_directory_times(const repo_path_t& repo)
+    -> std::vector<directory_time>
+{
+  auto times = directory_times(repo);
+  if (!times) {
+    throw std::runtime_error("Could not read modification time of repository");
+  }
+  return std::move(*times);
+}
+
+void write_index(const repo_path_t& repo,
+                 symkey_span_t symkey,
+                 const std::vector<directory_time>& times,
+                 const repo_index& index)
+{
+  const auto encrypted = symenc(symkey, serialize_index(times, index));
+  // Replaced atomically once on disk, so neither a concurrent reader nor a
+  // crash leaves a partial index
+  write_file_durably(get_index_path(repo), encrypted);
+}
+}  // namespace
+
+auto get_index_directory(const repo_path_t& repo) -> std::filesystem::path
+{
+  return repo.repo / ".index";
+}
+
+auto repo_index::entry_name(const std::filesystem::path& entry_path) const
+    -> std::string
+{
+  return entry_path.lexically_relative(entries.repo_directory()).string();
+}
+
+void repo_index::insert(const std::string& name,
+                        std::uint64_t size,
+                        std::optional<entry_header_info> header)
+{
+  const auto entry_time =
+      parse_timestamp(std::filesystem::path {name}.filename().native());
+  if (!entry_time) {
+    throw std::runtime_error("Entry filename is not a timestamp");
+  }
+  if (const auto replaced = entries.find(name)) {
+    entries.erase(*replaced);
+    headers.erase(headers.begin() + static_cast<std::ptrdiff_t>(*replaced));
+  }
+  const auto times = entries.entry_times();
+  const auto position = static_cast<std::size_t>(
+      std::ranges::upper_bound(times, *entry_time) - times.begin());
+  entries.insert(position, *entry_time, name, size);
+  headers.insert(headers.begin() + static_cast<std::ptrdiff_t>(position),
+                 header);
+}
+
+void repo_index::add(const std::filesystem::path& entry_path)
+{
+  entry_pack_cache packs {};
+  const auto packed = packs.contents(entry_path);
+  insert(entry_name(entry_path),
+         packed ? packed->size() : std::filesystem::file_size(entry_path),
+         index_entry(entry_path, packs));
+}
+
+void repo_index::move(const std::filesystem::path& from,
+                      const std::filesystem::path& to)
+{
+  const auto moved = entries.find(entry_name(from));
+  if (!moved) {
+    add(to);
+    return;
+  }
+  const auto size = entries.file_size(*moved);
+  const auto header = headers[*moved];
+  entries.erase(*moved);
+  headers.erase(headers.begin() + static_cast<std::ptrdiff_t>(*moved));
+  insert(entry_name(to), size, header);
+}
+
+auto load_index(const repo_path_t& repo, symkey_span_t symkey)
+    -> std::optional<repo_index>
+{
+  std::error_code error {};
+  const auto index_time =
+      std::filesystem::last_write_time(get_index_path(repo), error);
+  if (error) {
+    return std::nullopt;
+  }
+  try {
+    auto [recorded_times, index] = deserialize_index(
+        repo, symdec(symkey, read_file(get_index_path(repo))));
+    // Only the recorded directories are checked. Shards and the pack
+    // directory can not appear or vanish without modifying their parent,
+    // which is recorded as well, down to the repository directory itself.
+    if (recorded_times.empty() || !recorded_times.front().directory.empty()) {
+      return std::nullopt;
+    }
+    for (const auto& recorded : recorded_times) {
+      const auto time = std::filesystem::last_write_time(
+          repo.repo / recorded.directory, error);
+      if (error || time != recorded.time
+          || (is_coarse(time) && index_time - time < coarse_timestamp_window))
+      {
+        return std::nullopt;
+      }
+    }
+    return std::move(index);
+  } catch (const std::exception&) {
+    // A damaged index is rebuilt like an outdated one
+    return std::nullopt;
+  }
+}
+
+auto scan_index(const repo_path_t& repo) -> repo_index
+{
+  // Reading the header of every entry would make rebuilding as slow as
+  // reading the whole repository on network filesystems
+  repo_index index {.entries = list_entries(repo), .headers = {}};
+  index.headers.resize(index.entries.size());
+  return index;
+}
+
+void store_index(const repo_path_t& repo,
+                 symkey_span_t symkey,
+                 const repo_index& index)
+{
+  // Creating the directory modifies the repository, so it has to happen before
+  // its modification time is recorded
+  std::filesystem::create_directories(get_index_directory(repo));
+  write_index(repo, symkey, current_directory_times(repo), index);
+}
+
+repo_index_lock::repo_index_lock(const repo_path_t& repo)
+    : lock_fd(lock_index(repo))
+{
+}
+
+repo_index_update::repo_index_update(repo_path_t in_repo,
+                                     symkey_span_t in_symkey)
+    : repo(std::move(in_repo))
+    , symkey(in_symkey)
+    , lock(repo)
+    , index(lock.held() ? load_index(repo, symkey) : std::nullopt)
+{
+}
+
+void repo_index_update::add(const std::filesystem::path& entry_path) noexcept
+{
+  if (!index) {
+    return;
+  }
+  try {
+    index->add(entry_path);
+  } catch (const std::exception&) {
+    index.reset();
+  }
+}
+
+void repo_index_update::move(const std::filesystem::path& from,
+                             const std::filesystem::path& to) noexcept
+{
+  if (!index) {
+    return;
+  }
+  try {
+    index->move(from, to);
+  } catch (const std::exception&) {
+    index.reset();
+  }
+}
+
+void repo_index_update::store() noexcept
+{
+  if (!index) {
+    return;
+  }
+  try {
+    store_index(repo, symkey, *index);
+  } catch (const std::exception&) {
+    // The outdated index is rebuilt by the next reader
+  }
+}
+
+auto list_entries(const repo_path_t& repo,
+                  const key_repo_paths_t& keyrepo,
+                  const std::vector<time_range>& ranges) -> entry_catalog
+{
+  if (!std::filesystem::exists(repo.repo)
+      || !std::filesystem::exists(keyrepo.get_symkey_path())
+      || (!ranges.empty() && is_sharded(repo)))
+  {
+    return list_entries(repo, ranges);
+  }
+  const auto symkey = load_symkey(keyrepo);
+  if (auto index = load_index(repo, symkey_span_t {symkey})) {
+    return std::move(index->entries);
+  }
+  // Recorded before scanning, so entries written during the scan leave the
+  // rebuilt index outdated instead of missing from it
+  std::error_code error {};
+  std::filesystem::create_directories(get_index_directory(repo), error);
+  const auto times = directory_times(repo);
+  auto index = scan_index(repo);
+  if (!error && times) {
+    try {
+      write_index(repo, symkey_span_t {symkey}, *times, index);
+    } catch (const std::exception&) {
+      // The repository might be read only, it can still be listed without an
+      // index
+    }
+  }
+  return std::move(index.entries);
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "cli/command_types.hpp"
+#include "cli/key_management.hpp"
+#include "cli/repo_management.hpp"
+#include "crypto/entry.hpp"
+#include "crypto/secret_key.hpp"
+#include "util/smart_fd.hpp"
+
+/**
+Metadata of every entry in a repository, so commands can list the entries
+without scanning the repository and reading every entry file.
+
+The index is stored in the repository, encrypted with the symmetric key. It is
+only used while the modification time of the repository directory matches the
+one recorded when it was written, which changes whenever an entry is added,
+removed or renamed. Entry files modified in place go unnoticed.
+*/
+struct repo_index
+{
+  entry_catalog entries;
+  /**
+  Header of each entry of the catalog, recorded when the entry is written.
+  Missing for entries found by rebuilding the index, and for files which could
+  not be read as an entry.
+  */
+  std::vector<std::optional<entry_header_info>> headers;
+
+  /**
+  Record the entry, stored in a file of its own or in a pack, replacing an
+  earlier record of the same name
+  */
+  void add(const std::filesystem::path& entry_path);
+
+  /**
+  Record that the entry file was moved within the repository
+  */
+  void move(const std::filesystem::path& from, const std::filesystem::path& to);
+
+private:
+  [[nodiscard]] auto entry_name(const std::filesystem::path& entry_path) const
+      -> std::string;
+  void insert(const std::string& name,
+              std::uint64_t size,
+              std::optional<entry_header_info> header);
+};
+
+/**
+Directory holding the index and other records about the repository. It is a
+subdirectory, so rewriting them does not modify the repository directory.
+*/
+auto get_index_directory(const repo_path_t& repo) -> std::filesystem::path;
+
+/**
+Read the index of the repository, if there is one matching the repository
+*/
+auto load_index(const repo_path_t& repo, symkey_span_t symkey)
+    -> std::optional<repo_index>;
+
+/**
+Build the index by listing the entries in the repository, without their
+headers
+*/
+auto scan_index(const repo_path_t& repo) -> repo_index;
+
+/**
+Write the index, recording the current state of the repository
+*/
+void store_index(const repo_path_t& repo,
+                 symkey_span_t symkey,
+                 const repo_index& index);
+
+/**
+Exclusive lock of the repository index, waiting for other holders. Commands
+writing entries hold it, so no two of them update the index at once, one of
+them overwriting the entries the other one added with an outdated index.
+*/
+class repo_index_lock
+{
+  smart_fd lock_fd;
+
+public:
+  explicit repo_index_lock(const repo_path_t& repo);
+
+  /**
+  Whether the lock is held, it can not be taken in read only repositories
+  */
+  [[nodiscard]] auto held() const -> bool { return lock_fd.fd != -1; }
+};
+
+/**
+Keeps the index current while entries are written to the repository. Has to be
+created before the repository is modified, and only updates an index which was
+current at that point. It holds the index lock until destroyed, so the index
+does not change in between. The symmetric key has to outlive it.
+
+The index is a cache, failing to update it only means the next command
+rebuilds it.
+*/
+class repo_index_update
+{
+  repo_path_t repo;
+  symkey_span_t symkey;
+  repo_index_lock lock;
+  std::optional<repo_index> index;
+
+public:
+  repo_index_update(repo_path_t in_repo, symkey_span_t in_symkey);
+
+  void add(const std::filesystem::path& entry_path) noexcept;
+  void move(const std::filesystem::path& from,
+            const std::filesystem::path& to) noexcept;
+  void store() noexcept;
+};
+
+/**
+Entries of the repository sorted by their creation date, taken from the index
+if it is current. Otherwise the repository is scanned and the index rebuilt.
+Without a symmetric key the repository is scanned on every call.
+
+Given ranges, the shards of a sharded repository outside of them are skipped
+instead, see `list_entries(const repo_path_t&, ...)`. The result has to be
+narrowed to the ranges using `entries_within`.
+*/
+auto list_entries(const repo_path_t& repo,
+                  const key_repo_paths_t& keyrepo,
+                  const std::vector<time_range>& ranges = {}) -> entry_catalog;
@@ -1,52 +1,568 @@
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <format>
+#include <numeric>
+#include <optional>
 #include <ranges>
 #include <spanstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
 #include <vector>
 
 #include "repo_management.hpp"
 
-// Function to parse the timestamp from the filename
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cli/entry_pack.hpp"
+#include "util/durable_write.hpp"
+#include "util/smart_fd.hpp"
+#include "util/time.hpp"
+
 auto parse_timestamp(std::string_view filename) -> std::optional<time_point>
 {
-  std::ispanstream input_stream {filename};
-  time_point timepoint;
-  std::chrono::from_stream(input_stream, "%FT%T", timepoint);
+  const auto parsed = parse_iso_timestamp(filename);
+  if (!parsed) {
+    return std::nullopt;
+  }
+  return std::chrono::utc_clock::from_sys(*parsed);
+}
+
+auto parse_time_bound(std::string_view text, bool end_of_day) -> time_point
+{
+  {
+    std::ispanstream input_stream {text};
+    time_point timepoint;
+    std::chrono::from_stream(input_stream, "%FT%T", timepoint);
+    if (!input_stream.fail()) {
+      return timepoint;
+    }
+  }
+  std::ispanstream input_stream {text};
+  std::chrono::year_month_day date {};
+  std::chrono::from_stream(input_stream, "%F", date);
   if (input_stream.fail()) {
-    throw std::runtime_error(std::format("Could not parse: \"{}\"", filename));
-  }
-  return timepoint;
-}
-
-// Returns the diaria entries, sorted by their creation date
-auto list_entries(const repo_path_t& repo) -> std::vector<diaria_entry_path>
-{
-  if (!std::filesystem::exists(repo.repo)) {
-    return {};
-  }
-  auto result =
-      std::filesystem::directory_iterator(repo.repo)
-      | std::views::filter([](const auto& entry)
-                           { return entry.is_regular_file(); })
-      | std::views::filter(
-          [](const auto& entry)
-          { return entry.path().filename().string().ends_with(".diaria"); })
-      | std::views::transform(
-          [](const auto& entry)
-          {
-            return std::make_pair(
-                parse_timestamp(std::string(entry.path().filename())),
-                entry.path());
-          })
-      | std::views::filter([](const auto& entry)
-                           { return entry.first.has_value(); })
-      | std::views::transform(
-          [](auto&& entry)
-          { return diaria_entry_path {entry.first.value(), entry.second}; })
-      | std::ranges::to<std::vector>();
-  std::ranges::sort(result,
-                    {},
-                    [](const diaria_entry_path& entry)
-                    { return entry.entry_time; });
+    throw std::invalid_argument(
+        std::format("Expected a date or date and time: \"{}\"", text));
+  }
+  const auto day_start =
+      std::chrono::utc_clock::from_sys(std::chrono::sys_days {date});
+  if (end_of_day) {
+    return day_start + std::chrono::days {1} - time_point::duration {1};
+  }
+  return day_start;
+}
+
+entry_catalog::entry_catalog(std::filesystem::path in_directory)
+    : directory(std::move(in_directory))
+{
+}
+
+auto entry_catalog::store_name(std::string_view name) -> name_span
+{
+  if (names.size() + name.size() > UINT32_MAX) {
+    throw std::length_error("Too many entries in the catalog");
+  }
+  const name_span span {.offset = static_cast<std::uint32_t>(names.size()),
+                        .length = static_cast<std::uint32_t>(name.size())};
+  names.append(name);
+  return span;
+}
+
+void entry_catalog::reserve(std::size_t entry_count, std::size_t name_bytes)
+{
+  times.reserve(entry_count);
+  sizes.reserve(entry_count);
+  name_spans.reserve(entry_count);
+  names.reserve(name_bytes);
+}
+
+void entry_catalog::push_back(time_point entry_time,
+                              std::string_view name,
+                              std::uint64_t file_size)
+{
+  name_spans.push_back(store_name(name));
+  times.push_back(entry_time);
+  sizes.push_back(file_size);
+}
+
+void entry_catalog::insert(std::size_t position,
+                           time_point entry_time,
+                           std::string_view name,
+                           std::uint64_t file_size)
+{
+  const auto offset = static_cast<std::ptrdiff_t>(position);
+  name_spans.insert(name_spans.begin() + offset, store_name(name));
+  times.insert(times.begin() + offset, entry_time);
+  sizes.insert(sizes.begin() + offset, file_size);
+}
+
+void entry_catalog::erase(std::size_t position)
+{
+  const auto offset = static_cast<std::ptrdiff_t>(position);
+  name_spans.erase(name_spans.begin() + offset);
+  times.erase(times.begin() + offset);
+  sizes.erase(sizes.begin() + offset);
+}
+
+void entry_catalog::sort()
+{
+  std::vector<std::size_t> order(size());
+  std::iota(order.begin(), order.end(), std::size_t {0});
+  std::ranges::stable_sort(
+      order, {}, [this](std::size_t index) { return times[index]; });
+
+  entry_catalog sorted {directory};
+  sorted.reserve(size(), names.size());
+  for (const auto index : order) {
+    sorted.push_back(times[index], name(index), sizes[index]);
+  }
+  *this = std::move(sorted);
+}
+
+auto entry_catalog::find(std::string_view entry_name) const
+    -> std::optional<std::size_t>
+{
+  // Entries are named by their time, so only those of the same time can match
+  const auto entry_time =
+      parse_timestamp(entry_name.substr(entry_name.rfind('/') + 1));
+  if (!entry_time) {
+    return std::nullopt;
+  }
+  const auto [same_time_begin, same_time_end] =
+      std::ranges::equal_range(times, *entry_time);
+  for (auto candidate = same_time_begin; candidate != same_time_end;
+       ++candidate)
+  {
+    const auto index = static_cast<std::size_t>(candidate - times.begin());
+    if (name(index) == entry_name) {
+      return index;
+    }
+  }
+  return std::nullopt;
+}
+
+auto entry_catalog::summaries() const -> std::vector<entry_summary>
+{
+  std::vector<entry_summary> result {};
+  result.reserve(size());
+  for (std::size_t index = 0; index < size(); ++index) {
+    result.push_back({.entry_time = times[index], .size = sizes[index]});
+  }
+  return result;
+}
+
+namespace
+{
+constexpr std::string_view entry_extension {".diaria"};
+
+constexpr std::size_t year_shard_digits = 4;
+constexpr std::size_t month_shard_digits = 2;
+
+/**
+Directory records are read in batches of this size
+*/
+constexpr std::size_t directory_buffer_size = 64UL * 1024;
+
+/**
+Call `callback` with the name and type of every directory entry.
+
+Uses getdents64 directly, so a large directory is read in few system calls and
+without allocating anything per entry. The type is DT_UNKNOWN on file systems
+not reporting it.
+*/
+template<typename Callback>
+void for_each_directory_entry(int directory_fd, Callback callback)
+{
+  alignas(dirent64) std::array<char, directory_buffer_size> buffer;
+  while (true) {
+    const auto filled =
+        syscall(SYS_getdents64, directory_fd, buffer.data(), buffer.size());
+    if (filled == -1) {
+      throw std::runtime_error(std::format(
+          "Could not read directory; Errno {} [{}]", errno, strerror(errno)));
+    }
+    if (filled == 0) {
+      return;
+    }
+    for (long position = 0; position < filled;) {
+      // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+      const auto* record = reinterpret_cast<const dirent64*>(
+          buffer.data() + static_cast<std::size_t>(position));
+      callback(std::string_view {record->d_name}, record->d_type);
+      position += record->d_reclen;
+    }
+  }
+}
+
+auto is_shard_name(std::string_view name, std::size_t digits) -> bool
+{
+  return name.size() == digits
+      && std::ranges::all_of(name,
+                             [](char digit)
+                             { return digit >= '0' && digit <= '9'; });
+}
+
+/**
+Whether the time from `begin` until before `end` overlaps any of the ranges,
+which is the case for all times if there are none
+*/
+auto overlaps_any(time_point begin,
+                  time_point end,
+                  const std::vector<time_range>& ranges) -> bool
+{
+  return ranges.empty()
+      || std::ranges::any_of(
+             ranges,
+             [begin, end](const time_range& range)
+             { return range.first < end && range.last >= begin; });
+}
+
+auto month_start(std::chrono::year_month month) -> time_point
+{
+  return std::chrono::utc_clock::from_sys(
+      std::chrono::sys_days {month / std::chrono::day {1}});
+}
+
+/**
+Add the entries of the directory to the catalog, their names prefixed by
+`prefix`. Returns the subdirectories named by a number of `shard_digits`
+digits, if given.
+*/
+auto scan_directory(int directory_fd,
+                    std::string_view prefix,
+                    entry_catalog& catalog,
+                    std::size_t shard_digits) -> std::vector<std::string>
+{
+  std::vector<std::string> shards {};
+  std::string prefixed_name {};
+  for_each_directory_entry(
+      directory_fd,
+      [&](std::string_view name, unsigned char type)
+      {
+        if (shard_digits != 0 && is_shard_name(name, shard_digits)
+            && (type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN))
+        {
+          shards.emplace_back(name);
+          return;
+        }
+        if (!name.ends_with(entry_extension)
+            || (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN))
+        {
+          return;
+        }
+        const auto entry_time = parse_timestamp(name);
+        if (!entry_time) {
+          return;
+        }
+        // Follows symbolic links, entries linked from elsewhere are listed
+        struct stat entry_stat {};
+        if (fstatat(directory_fd, name.data(), &entry_stat, 0) == -1
+            || !S_ISREG(entry_stat.st_mode))
+        {
+          return;
+        }
+        prefixed_name.assign(prefix).append(name);
+        catalog.push_back(*entry_time,
+                          prefixed_name,
+                          static_cast<std::uint64_t>(entry_stat.st_size));
+      });
+  std::ranges::sort(shards);
+  return shards;
+}
+
+/**
+Add the entry files of the directory not named by a timestamp to `untimed`.
+Returns the subdirectories named by a number of `shard_digits` digits, if
+given.
+*/
+auto scan_untimed_entries(int directory_fd,
+                          const std::filesystem::path& directory,
+                          std::vector<std::filesystem::path>& untimed,
+                          std::size_t shard_digits) -> std::vector<std::string>
+{
+  std::vector<std::string> shards {};
+  for_each_directory_entry(
+      directory_fd,
+      [&](std::string_view name, unsigned char type)
+      {
+        if (shard_digits != 0 && is_shard_name(name, shard_digits)
+            && (type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN))
+        {
+          shards.emplace_back(name);
+          return;
+        }
+        if (!name.ends_with(entry_extension) || parse_timestamp(name)
+            || (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN))
+        {
+          return;
+        }
+        struct stat entry_stat {};
+        if (fstatat(directory_fd, name.data(), &entry_stat, 0) == 0
+            && S_ISREG(entry_stat.st_mode))
+        {
+          untimed.push_back(directory / name);
+        }
+      });
+  return shards;
+}
+
+/**
+Add the entries of the packs to the catalog. Packs are named by the times of
+their first and last entry, the ones outside of all ranges are skipped.
+*/
+void scan_packs(const repo_path_t& repo,
+                const std::vector<time_range>& ranges,
+                entry_catalog& catalog)
+{
+  std::error_code error {};
+  for (const auto& pack_file : std::filesystem::directory_iterator(
+           repo.repo / pack_directory_name, error))
+  {
+    const auto pack_name = pack_file.path().filename().string();
+    if (!pack_file.is_regular_file() || !pack_name.ends_with(pack_extension)) {
+      continue;
+    }
+    const auto separator = pack_name.find('_');
+    const auto first = parse_timestamp(pack_name);
+    const auto last = separator == std::string::npos
+        ? std::nullopt
+        : parse_timestamp(std::string_view {pack_name}.substr(separator + 1));
+    if (first && last
+        && !overlaps_any(*first, *last + std::chrono::seconds {1}, ranges))
+    {
+      continue;
+    }
+    const entry_pack pack {pack_file.path()};
+    std::string prefixed_name {};
+    for (const auto& entry : pack.entries()) {
+      const auto entry_time = parse_timestamp(entry.name);
+      if (!entry_time) {
+        continue;
+      }
+      prefixed_name = std::format(
+          "{}/{}/{}", pack_directory_name, pack_name, entry.name);
+      catalog.push_back(*entry_time, prefixed_name, entry.size);
+    }
+  }
+}
+
+/**
+Packed entries are only removed from their own files once the pack is on
+disk, so an interrupted repack leaves entries in both places. The loose copy
+is kept, which the next repack packs again.
+*/
+void drop_packed_duplicates(entry_catalog& catalog)
+{
+  const auto filename = [&catalog](std::size_t entry)
+  {
+    const auto name = catalog.name(entry);
+    return name.substr(name.rfind('/') + 1);
+  };
+  for (std::size_t entry = catalog.size(); entry-- > 1;) {
+    if (catalog.entry_time(entry) != catalog.entry_time(entry - 1)
+        || filename(entry) != filename(entry - 1))
+    {
+      continue;
+    }
+    catalog.erase(catalog.name(entry).starts_with(pack_directory_name)
+                      ? entry
+                      : entry - 1);
+  }
+}
+
+auto open_directory(int parent_fd, const char* path) -> int
+{
+  return openat(parent_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+[[noreturn]] void fail_open_repo(const repo_path_t& repo)
+{
+  throw std::runtime_error(
+      std::format("Could not open repository \"{}\"; Errno {} [{}]",
+                  repo.repo.c_str(),
+                  errno,
+                  strerror(errno)));
+}
+}  // namespace
+
+auto is_sharded(const repo_path_t& repo) -> bool
+{
+  return std::filesystem::exists(repo.repo / shard_marker);
+}
+
+void mark_sharded(const repo_path_t& repo)
+{
+  std::filesystem::create_directories(repo.repo);
+  write_file_durably(repo.repo / shard_marker, {});
+}
+
+auto entry_path_for(const repo_path_t& repo, std::string_view filename)
+    -> std::filesystem::path
+{
+  if (!is_sharded(repo) || !parse_timestamp(filename)) {
+    return repo.repo / filename;
+  }
+  // The timestamp fixes the positions of year and month
+  return repo.repo / filename.substr(0, year_shard_digits)
+      / filename.substr(year_shard_digits + 1, month_shard_digits) / filename;
+}
+
+auto shard_directories(const repo_path_t& repo)
+    -> std::vector<std::filesystem::path>
+{
+  std::vector<std::filesystem::path> result {};
+  std::error_code error {};
+  for (const auto& year : std::filesystem::directory_iterator(repo.repo, error))
+  {
+    if (!year.is_directory()
+        || !is_shard_name(year.path().filename().native(), year_shard_digits))
+    {
+      continue;
+    }
+    result.push_back(year.path().filename());
+  }
+  std::ranges::sort(result);
+  std::vector<std::filesystem::path> with_months {};
+  for (const auto& year : result) {
+    with_months.push_back(year);
+    std::vector<std::filesystem::path> months {};
+    for (const auto& month :
+         std::filesystem::directory_iterator(repo.repo / year, error))
+    {
+      if (month.is_directory()
+          && is_shard_name(month.path().filename().native(),
+                           month_shard_digits))
+      {
+        months.push_back(year / month.path().filename());
+      }
+    }
+    std::ranges::sort(months);
+    with_months.insert(with_months.end(), months.begin(), months.end());
+  }
+  return with_months;
+}
+
+auto list_entries(const repo_path_t& repo,
+                  const std::vector<time_range>& ranges) -> entry_catalog
+{
+  entry_catalog result {repo.repo};
+  const smart_fd repo_fd {open_directory(AT_FDCWD, repo.repo.c_str())};
+  if (repo_fd.fd == -1) {
+    if (errno == ENOENT) {
+      return result;
+    }
+    fail_open_repo(repo);
+  }
+  const auto years = scan_directory(repo_fd.fd, {}, result, year_shard_digits);
+  for (const auto& year_name : years) {
+    const std::chrono::year year {std::stoi(year_name)};
+    if (!overlaps_any(month_start(year / std::chrono::January),
+                      month_start((year + std::chrono::years {1})
+                                  / std::chrono::January),
+                      ranges))
+    {
+      continue;
+    }
+    const smart_fd year_fd {open_directory(repo_fd.fd, year_name.c_str())};
+    if (year_fd.fd == -1) {
+      continue;
+    }
+    const auto months = scan_directory(
+        year_fd.fd, year_name + "/", result, month_shard_digits);
+    for (const auto& month_name : months) {
+      const auto month = year
+          / std::chrono::month {static_cast<unsigned>(std::stoi(month_name))};
+      if (!month.ok()
+          || !overlaps_any(month_start(month),
+                           month_start(month + std::chrono::months {1}),
+                           ranges))
+      {
+        continue;
+      }
+      const smart_fd month_fd {open_directory(year_fd.fd, month_name.c_str())};
+      if (month_fd.fd == -1) {
+        continue;
+      }
+      scan_directory(
+          month_fd.fd, std::format("{}/{}/", year_name, month_name), result, 0);
+    }
+  }
+  scan_packs(repo, ranges, result);
+  result.sort();
+  drop_packed_duplicates(result);
   return result;
-}
\ No newline at end of file
+}
+
+auto list_unsharded_entries(const repo_path_t& repo) -> entry_catalog
+{
+  entry_catalog result {repo.repo};
+  const smart_fd repo_fd {open_directory(AT_FDCWD, repo.repo.c_str())};
+  if (repo_fd.fd == -1) {
+    if (errno == ENOENT) {
+      return result;
+    }
+    fail_open_repo(repo);
+  }
+  scan_directory(repo_fd.fd, {}, result, 0);
+  result.sort();
+  return result;
+}
+
+auto list_untimed_entries(const repo_path_t& repo)
+    -> std::vector<std::filesystem::path>
+{
+  std::vector<std::filesystem::path> result {};
+  const smart_fd repo_fd {open_directory(AT_FDCWD, repo.repo.c_str())};
+  if (repo_fd.fd == -1) {
+    if (errno == ENOENT) {
+      return result;
+    }
+    fail_open_repo(repo);
+  }
+  // Only shards are descended into, which skips .git, .index and packs
+  for (const auto& year : scan_untimed_entries(
+           repo_fd.fd, repo.repo, result, year_shard_digits))
+  {
+    const smart_fd year_fd {open_directory(repo_fd.fd, year.c_str())};
+    if (year_fd.fd == -1) {
+      continue;
+    }
+    for (const auto& month : scan_untimed_entries(
+             year_fd.fd, repo.repo / year, result, month_shard_digits))
+    {
+      const smart_fd month_fd {open_directory(year_fd.fd, month.c_str())};
+      if (month_fd.fd != -1) {
+        scan_untimed_entries(month_fd.fd, repo.repo / year / month, result, 0);
+      }
+    }
+  }
+  return result;
+}
+
+auto entries_within(const entry_catalog& entries,
+                    std::vector<time_range> ranges)
+    -> std::vector<diaria_entry_path>
+{
+  std::vector<diaria_entry_path> result;
+  auto times = entries.entry_times();
+  for (const auto& slice : slices_within(times, std::move(ranges))) {
+    for (auto entry = slice.begin(); entry != slice.end(); ++entry) {
+      result.push_back(
+          entries[static_cast<std::size_t>(entry - times.begin())]);
+    }
+  }
+  return result;
+}
@@ -1,19 +1,208 @@
 #pragma once
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "command_types.hpp"
+#include "util/time.hpp"
 using time_point = std::chrono::utc_clock::time_point;
 
 struct diaria_entry_path
 {
   time_point entry_time;
   std::filesystem::path entry_path;
+  /**
+  Size of the entry file
+  */
+  std::uint64_t size {};
 };
 
-// Function to parse the timestamp from the filename
+/**
+Creation time and size of an entry, for going through all entries without
+building their paths
+*/
+struct entry_summary
+{
+  time_point entry_time;
+  std::uint64_t size {};
+};
+
+/**
+Entries of a repository, sorted by their creation date.
+
+Each property is kept in an array of its own, and the names are stored one
+after another in a single string, so a million entries take a few allocations
+instead of one per entry, and searching by time only touches the times. Paths
+are only built for the entries asked for. Names are relative to the
+repository, which for sharded repositories includes the shard directory.
+*/
+class entry_catalog
+{
+  /**
+  Position of a name within `names`
+  */
+  struct name_span
+  {
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  std::filesystem::path directory;
+  std::vector<time_point> times;
+  std::vector<std::uint64_t> sizes;
+  /**
+  Names of erased entries stay in here until the catalog is sorted
+  */
+  std::string names;
+  std::vector<name_span> name_spans;
+
+  auto store_name(std::string_view name) -> name_span;
+
+public:
+  explicit entry_catalog(std::filesystem::path in_directory = {});
+
+  [[nodiscard]] auto size() const -> std::size_t { return times.size(); }
+  [[nodiscard]] auto empty() const -> bool { return times.empty(); }
+
+  void reserve(std::size_t entry_count, std::size_t name_bytes);
+
+  /**
+  Append an entry, the catalog has to be sorted afterwards unless it is newer
+  than all others
+  */
+  void push_back(time_point entry_time,
+                 std::string_view name,
+                 std::uint64_t file_size);
+  void insert(std::size_t position,
+              time_point entry_time,
+              std::string_view name,
+              std::uint64_t file_size);
+  void erase(std::size_t position);
+
+  /**
+  Sort by creation date, compacting the stored names
+  */
+  void sort();
+
+  /**
+  Creation times of all entries, sorted
+  */
+  [[nodiscard]] auto entry_times() const -> std::span<const time_point>
+  {
+    return times;
+  }
+  [[nodiscard]] auto entry_time(std::size_t index) const -> time_point
+  {
+    return times[index];
+  }
+  [[nodiscard]] auto file_size(std::size_t index) const -> std::uint64_t
+  {
+    return sizes[index];
+  }
+  [[nodiscard]] auto name(std::size_t index) const -> std::string_view
+  {
+    const auto span = name_spans[index];
+    return std::string_view {names}.substr(span.offset, span.length);
+  }
+  [[nodiscard]] auto path(std::size_t index) const -> std::filesystem::path
+  {
+    return directory / name(index);
+  }
+  [[nodiscard]] auto repo_directory() const -> const std::filesystem::path&
+  {
+    return directory;
+  }
+  [[nodiscard]] auto operator[](std::size_t index) const -> diaria_entry_path
+  {
+    return {.entry_time = times[index],
+            .entry_path = path(index),
+            .size = sizes[index]};
+  }
+
+  /**
+  Position of the entry of the given name
+  */
+  [[nodiscard]] auto find(std::string_view entry_name) const
+      -> std::optional<std::size_t>;
+
+  [[nodiscard]] auto summaries() const -> std::vector<entry_summary>;
+};
+
+/**
+Parse the timestamp an entry is named by, ignoring the extension
+*/
 auto parse_timestamp(std::string_view filename) -> std::optional<time_point>;
 
-auto list_entries(const repo_path_t& repo) -> std::vector<diaria_entry_path>;
\ No newline at end of file
+/**
+Parse the bound of a time range, given as a date or a date and time. A date
+alone stands for its start, or its end if `end_of_day` is set.
+*/
+auto parse_time_bound(std::string_view text, bool end_of_day) -> time_point;
+
+/**
+File present in sharded repositories
+*/
+constexpr std::string_view shard_marker {".sharded"};
+
+/**
+Whether new entries go into shard directories.
+
+Entries of a sharded repository are stored in a directory per month, like
+2025/01, which keeps directories small and lets queries of a time range skip
+the others. Entries not migrated yet stay in the repository directory itself
+and are listed along with the sharded ones, so a repository can be used while
+being migrated.
+*/
+auto is_sharded(const repo_path_t& repo) -> bool;
+
+/**
+Store new entries of the repository in shards from now on
+*/
+void mark_sharded(const repo_path_t& repo);
+
+/**
+Path the entry of the given filename belongs at, its shard if the repository
+is sharded and the filename is a timestamp
+*/
+auto entry_path_for(const repo_path_t& repo, std::string_view filename)
+    -> std::filesystem::path;
+
+/**
+Shard directories of the repository relative to it, each year followed by its
+months
+*/
+auto shard_directories(const repo_path_t& repo)
+    -> std::vector<std::filesystem::path>;
+
+/**
+Scan the repository and its packs for entries named by their timestamp. Given
+ranges, shards and packs entirely outside of them are skipped, so the result
+also contains entries outside of the ranges but all entries within them.
+*/
+auto list_entries(const repo_path_t& repo,
+                  const std::vector<time_range>& ranges = {}) -> entry_catalog;
+
+/**
+Entries in the repository directory itself, which are not in any shard
+*/
+auto list_unsharded_entries(const repo_path_t& repo) -> entry_catalog;
+
+/**
+Entry files in the repository directory and its shards which are not named by
+their timestamp, and so not listed by `list_entries`
+*/
+auto list_untimed_entries(const repo_path_t& repo)
+    -> std::vector<std::filesystem::path>;
+
+/**
+Entries of a catalog within any of the ranges, in the order of the catalog
+*/
+auto entries_within(const entry_catalog& entries,
+                    std::vector<time_range> ranges)
+    -> std::vector<diaria_entry_path>;
@@ -1,48 +1,157 @@
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
 #include <print>
+#include <ranges>
+#include <span>
 #include <stdexcept>
 #include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "./compress.hpp"
 
 #include <lzma.h>
+#ifdef DIARIA_WITH_ZSTD
+#  include <zstd.h>
+#endif
+#ifdef DIARIA_WITH_LZ4
+#  include <lz4frame.h>
+#endif
 
 #include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
+#include "util/char.hpp"
 
 namespace
 {
-auto init_encoder(lzma_stream* strm) -> bool
+/**
+Inputs below this size are compressed using the cheaper hash chain match finder
+*/
+constexpr std::uint64_t small_input_size = 64UL * 1024;
+
+/**
+Blocks of the threaded encoder are not made smaller than this when dividing
+the input between the threads, smaller blocks compress noticeably worse
+*/
+constexpr std::uint64_t min_threaded_block_size = 1UL * 1024 * 1024;
+
+/**
+Number of threads to use, resolving 0 to one per core
+*/
+auto resolve_threads(std::uint32_t threads) -> std::uint32_t
+{
+  if (threads == 0) {
+    threads = lzma_cputhreads();
+  }
+  return std::max<std::uint32_t>(threads, 1);
+}
+
+/**
+Threads for coding an input of the given size, 1 below the threshold. Encoding
+goes by the uncompressed size, decoding by the compressed one, as the other
+size is not known before.
+*/
+auto threads_for_size(const compression_options& options,
+                      std::optional<std::uint64_t> size_hint) -> std::uint32_t
+{
+  if (!size_hint || options.threaded_threshold == 0
+      || *size_hint < options.threaded_threshold)
+  {
+    return 1;
+  }
+  return resolve_threads(options.threads);
+}
+
+/**
+Size of the LZMA2 filter properties, which precede a raw LZMA2 stream so the
+decoder knows the dictionary size
+*/
+constexpr std::size_t lzma2_properties_size = 1;
+using lzma2_properties_t = std::array<unsigned char, lzma2_properties_size>;
+
+/**
+Initialize a .xz encoder, or a raw LZMA2 encoder using the preset dictionary
+if given. The filter properties of the raw encoder are stored in `properties`.
+*/
+auto init_encoder(lzma_stream* strm,
+                  const compression_options& options,
+                  std::optional<std::uint64_t> size_hint,
+                  const compression_dictionary* dictionary,
+                  lzma2_properties_t& properties) -> bool
 {
-  // Use the default preset (6) for LZMA2.
-  //
   // The lzma_options_lzma structure and the lzma_lzma_preset() function
   // are declared in lzma/lzma12.h (src/liblzma/api/lzma/lzma12.h in the
   // source package or e.g. /usr/include/lzma/lzma12.h depending on
   // the install prefix).
+  std::uint32_t preset = options.preset;
+  if (size_hint && options.extreme_threshold != 0
+      && *size_hint >= options.extreme_threshold)
+  {
+    preset |= LZMA_PRESET_EXTREME;
+  }
   lzma_options_lzma opt_lzma2;
-  if (lzma_lzma_preset(&opt_lzma2, LZMA_PRESET_DEFAULT) != 0U) {
-    // It should never fail because the default preset
-    // (and presets 0-9 optionally with LZMA_PRESET_EXTREME)
-    // are supported by all stable liblzma versions.
+  if (lzma_lzma_preset(&opt_lzma2, preset) != 0U) {
+    // Presets 0-9 optionally with LZMA_PRESET_EXTREME are supported by all
+    // stable liblzma versions, so this is either a bug or a preset outside
+    // of that range.
     //
     // (The encoder initialization later in this function may
     // still fail due to unsupported preset *if* the features
     // required by the preset have been disabled at build time,
     // but no-one does such things except on embedded systems.)
-    std::println(stderr, "Unsupported preset, possibly a bug\n");
+    std::println(stderr, "Unsupported preset {}", options.preset);
     return false;
   }
-  // Now we could customize the LZMA2 options if we wanted. For example,
-  // we could set the dictionary size (opt_lzma2.dict_size) to
-  // something else than the default (8 MiB) of the default preset.
-  // See lzma/lzma12.h for details of all LZMA2 options.
-  //
+
+  const std::uint64_t preset_dict_size =
+      dictionary == nullptr ? 0 : dictionary->content.size();
+  if (options.adaptive && size_hint) {
+    // The dictionary never needs to be larger than the input, plus the preset
+    // dictionary if any. The encoder allocates its match finder tables
+    // according to the dictionary size, so this is what makes compressing a
+    // small entry cheap. The decoder reads the dictionary size from the stream
+    // header, so this stays standard .xz.
+    const auto fitting_dict_size = std::max<std::uint64_t>(
+        std::bit_ceil(*size_hint + preset_dict_size), LZMA_DICT_SIZE_MIN);
+    opt_lzma2.dict_size = static_cast<std::uint32_t>(
+        std::min<std::uint64_t>(fitting_dict_size, opt_lzma2.dict_size));
+    if (*size_hint < small_input_size) {
+      opt_lzma2.mf = LZMA_MF_HC4;
+      opt_lzma2.depth = 0;
+    }
+  }
+
+  const std::uint32_t threads =
+      dictionary == nullptr ? threads_for_size(options, size_hint) : 1;
+  std::uint64_t block_size = options.block_size;
+  if (threads > 1) {
+    if (block_size == 0) {
+      block_size = std::max((*size_hint + threads - 1) / threads,
+                            min_threaded_block_size);
+    }
+    // Blocks are compressed independently of each other, so a dictionary
+    // larger than a block is never filled
+    const auto block_dict_size =
+        std::max<std::uint64_t>(std::bit_ceil(block_size), LZMA_DICT_SIZE_MIN);
+    opt_lzma2.dict_size = static_cast<std::uint32_t>(
+        std::min<std::uint64_t>(block_dict_size, opt_lzma2.dict_size));
+  }
+
   // The x86 BCJ filter will try to modify the x86 instruction stream so
   // that LZMA2 can compress it better. The x86 BCJ filter doesn't need
   // any options so it will be set to NULL below.
@@ -59,8 +168,30 @@ auto init_encoder(lzma_stream* strm) -> bool
       lzma_filter {.id = LZMA_VLI_UNKNOWN, .options = NULL},
   };
 
-  // Initialize the encoder using the custom filter chain.
-  lzma_ret ret = lzma_stream_encoder(strm, filters.data(), LZMA_CHECK_CRC64);
+  // Initialize the encoder using the custom filter chain. The raw encoder has
+  // no container and no integrity check of its own, entries are authenticated
+  // by the encryption anyway.
+  lzma_ret ret {};
+  if (threads > 1) {
+    // Each block header records its sizes, which lets a threaded decoder
+    // decompress the blocks in parallel as well
+    lzma_mt threaded_options {};
+    threaded_options.threads = threads;
+    threaded_options.block_size = block_size;
+    threaded_options.filters = filters.data();
+    threaded_options.check = LZMA_CHECK_CRC64;
+    ret = lzma_stream_encoder_mt(strm, &threaded_options);
+  } else if (dictionary == nullptr) {
+    ret = lzma_stream_encoder(strm, filters.data(), LZMA_CHECK_CRC64);
+  } else {
+    opt_lzma2.preset_dict = dictionary->content.data();
+    opt_lzma2.preset_dict_size =
+        static_cast<std::uint32_t>(dictionary->content.size());
+    ret = lzma_raw_encoder(strm, filters.data());
+    if (ret == LZMA_OK) {
+      ret = lzma_properties_encode(filters.data(), properties.data());
+    }
+  }
 
   if (ret == LZMA_OK) {
     return true;
@@ -89,47 +220,30 @@ auto init_encoder(lzma_stream* strm) -> bool
   return false;
 }
 
-// This function is identical to the one in 01_compress_easy.c.
-auto compress_lzma(lzma_stream* strm, std::span<const unsigned char> input)
-    -> safe_vector<unsigned char>
+/**
+Initialize a .xz decoder using several threads, liblzma before 5.4 only has
+the single threaded one
+*/
+auto init_threaded_decoder(lzma_stream* strm, std::uint32_t threads)
+    -> lzma_ret
 {
-  const lzma_action action = LZMA_FINISH;
-
-  safe_array<unsigned char, BUFSIZ> outbuf {};
-  safe_vector<unsigned char> result {};
-
-  strm->next_in = input.data();
-  strm->avail_in = input.size();
-  strm->next_out = outbuf.data();
-  strm->avail_out = outbuf.size();
-
-  while (true) {
-    lzma_ret ret = lzma_code(strm, action);
-
-    if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
-      const size_t write_size = outbuf.size() - strm->avail_out;
-
-      result.insert(result.end(),
-                    outbuf.begin(),
-                    outbuf.begin() + static_cast<int64_t>(write_size));
-
-      strm->next_out = outbuf.data();
-      strm->avail_out = outbuf.size();
-    }
-
-    if (ret == LZMA_STREAM_END) {
-      return result;
-    }
-    if (ret != LZMA_OK) {
-      std::println(stderr,
-                   "Encoder error (error code {})",
-                   static_cast<std::underlying_type_t<lzma_ret>>(ret));
-      throw std::runtime_error("Could not compress");
-    }
-  }
+#if LZMA_VERSION >= 50040002
+  lzma_mt threaded_options {};
+  threaded_options.threads = threads;
+  // Streams needing more memory than this for decoding in parallel are
+  // decoded by a single thread, like xz itself does it
+  const std::uint64_t physical_memory = lzma_physmem();
+  threaded_options.memlimit_threading =
+      physical_memory == 0 ? UINT64_MAX : physical_memory / 4;
+  threaded_options.memlimit_stop = UINT64_MAX;
+  return lzma_stream_decoder_mt(strm, &threaded_options);
+#else
+  std::ignore = threads;
+  return lzma_stream_decoder(strm, UINT64_MAX, 0);
+#endif
 }
 
-auto init_decoder(lzma_stream* strm) -> bool
+auto init_decoder(lzma_stream* strm, std::uint32_t threads = 1) -> bool
 {
   // Initialize a .xz decoder. The decoder supports a memory usage limit
   // and a set of flags.
@@ -164,7 +278,8 @@ auto init_decoder(lzma_stream* strm) -> bool
   // (src/liblzma/api/lzma/container.h in the source package or e.g.
   // /usr/include/lzma/container.h depending on the install prefix)
   // for details.
-  lzma_ret ret = lzma_stream_decoder(strm, UINT64_MAX, 0);
+  lzma_ret ret = threads > 1 ? init_threaded_decoder(strm, threads)
+                             : lzma_stream_decoder(strm, UINT64_MAX, 0);
 
   // Return successfully if the initialization went fine.
   if (ret == LZMA_OK) {
@@ -206,7 +321,34 @@ auto init_decoder(lzma_stream* strm) -> bool
   return false;
 }
 
-auto decompress_error(lzma_ret return_code)
+/**
+Initialize a raw LZMA2 decoder from the filter properties preceding the stream
+*/
+auto init_raw_decoder(lzma_stream* strm,
+                      const lzma2_properties_t& properties,
+                      const compression_dictionary& dictionary) -> lzma_ret
+{
+  lzma_filter lzma2_filter {.id = LZMA_FILTER_LZMA2, .options = nullptr};
+  const lzma_ret ret = lzma_properties_decode(
+      &lzma2_filter, nullptr, properties.data(), properties.size());
+  if (ret != LZMA_OK) {
+    return ret;
+  }
+  // The options are allocated by liblzma using malloc, the decoder copies the
+  // preset dictionary during initialization
+  const std::unique_ptr<lzma_options_lzma, decltype(&free)> opt_lzma2 {
+      static_cast<lzma_options_lzma*>(lzma2_filter.options), &free};
+  opt_lzma2->preset_dict = dictionary.content.data();
+  opt_lzma2->preset_dict_size =
+      static_cast<std::uint32_t>(dictionary.content.size());
+  std::array filters = {
+      lzma2_filter,
+      lzma_filter {.id = LZMA_VLI_UNKNOWN, .options = NULL},
+  };
+  return lzma_raw_decoder(strm, filters.data());
+}
+
+[[noreturn]] void decompress_error(lzma_ret return_code)
 {
   // It is important to check for LZMA_STREAM_END. Do not
   // assume that getting ret != LZMA_OK would mean that
@@ -282,106 +424,863 @@ auto decompress_error(lzma_ret return_code)
                   static_cast<std::underlying_type_t<lzma_ret>>(return_code)));
 }
 
-auto decompress_lzma(lzma_stream* strm, std::span<const unsigned char> input)
-    -> safe_vector<unsigned char>
+/**
+lzma_stream which is only released on destruction. Initializing an encoder or
+decoder again on an already used stream reuses its allocations where possible.
+*/
+struct owned_lzma_stream
 {
-  // When LZMA_CONCATENATED flag was used when initializing the decoder,
-  // we need to tell lzma_code() when there will be no more input.
-  // This is done by setting action to LZMA_FINISH instead of LZMA_RUN
-  // in the same way as it is done when encoding.
-  //
-  // When LZMA_CONCATENATED isn't used, there is no need to use
-  // LZMA_FINISH to tell when all the input has been read, but it
-  // is still OK to use it if you want. When LZMA_CONCATENATED isn't
-  // used, the decoder will stop after the first .xz stream. In that
-  // case some unused data may be left in strm->next_in.
-  const lzma_action action = LZMA_FINISH;
-
-  safe_array<unsigned char, BUFSIZ> outbuf {};
-  safe_vector<unsigned char> result {};
+  lzma_stream strm {};
+  owned_lzma_stream() { strm = LZMA_STREAM_INIT; }
+  owned_lzma_stream(const owned_lzma_stream&) = delete;
+  owned_lzma_stream(owned_lzma_stream&&) = delete;
+  auto operator=(const owned_lzma_stream&) -> owned_lzma_stream& = delete;
+  auto operator=(owned_lzma_stream&&) -> owned_lzma_stream& = delete;
+  ~owned_lzma_stream() { lzma_end(&strm); }
+};
 
+/**
+Run the stream over the given input, forwarding all output to `next`.
+
+With LZMA_RUN this returns once all input has been consumed, with LZMA_FINISH
+it returns once the end of the stream has been reached.
+*/
+auto code_lzma(lzma_stream* strm,
+               std::span<const unsigned char> input,
+               lzma_action action,
+               std::span<unsigned char> outbuf,
+               byte_sink& next) -> lzma_ret
+{
+  if (action == LZMA_RUN && input.empty()) {
+    return LZMA_OK;
+  }
   strm->next_in = input.data();
   strm->avail_in = input.size();
-  strm->next_out = outbuf.data();
-  strm->avail_out = outbuf.size();
 
   while (true) {
-    lzma_ret const ret = lzma_code(strm, action);
+    strm->next_out = outbuf.data();
+    strm->avail_out = outbuf.size();
+    const lzma_ret ret = lzma_code(strm, action);
 
-    if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
-      const size_t write_size = outbuf.size() - strm->avail_out;
+    const size_t write_size = outbuf.size() - strm->avail_out;
+    if (write_size > 0) {
+      next.write(outbuf.first(write_size));
+    }
 
-      result.insert(result.end(),
-                    outbuf.begin(),
-                    outbuf.begin() + static_cast<int64_t>(write_size));
+    if (ret != LZMA_OK) {
+      return ret;
+    }
+    if (action == LZMA_RUN && strm->avail_in == 0 && strm->avail_out != 0) {
+      return ret;
+    }
+  }
+}
+
+class lzma_compress_sink final : public byte_sink
+{
+  lzma_stream* strm;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
 
-      strm->next_out = outbuf.data();
-      strm->avail_out = outbuf.size();
+  void code(std::span<const unsigned char> input, lzma_action action)
+  {
+    const lzma_ret ret = code_lzma(strm, input, action, outbuf, *next);
+    if (ret == LZMA_OK || ret == LZMA_STREAM_END) {
+      return;
     }
+    std::println(stderr,
+                 "Encoder error (error code {})",
+                 static_cast<std::underlying_type_t<lzma_ret>>(ret));
+    throw std::runtime_error("Could not compress");
+  }
 
+public:
+  lzma_compress_sink(lzma_stream* in_strm,
+                     const compression_options& options,
+                     std::optional<std::uint64_t> size_hint,
+                     const compression_dictionary* dictionary,
+                     std::span<unsigned char> in_outbuf,
+                     byte_sink& in_next)
+      : strm(in_strm)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+  {
+    lzma2_properties_t properties {};
+    if (!init_encoder(strm, options, size_hint, dictionary, properties)) {
+      throw std::runtime_error("Could not initialize compression stream");
+    }
+    if (dictionary != nullptr) {
+      next->write(properties);
+    }
+  }
+
+  void write(std::span<const unsigned char> data) override
+  {
+    code(data, LZMA_RUN);
+  }
+  void finish() override
+  {
+    code({}, LZMA_FINISH);
+    next->finish();
+  }
+};
+
+class lzma_decompress_sink final : public byte_sink
+{
+  lzma_stream* strm;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
+  const compression_dictionary* dictionary;
+  lzma2_properties_t properties {};
+  std::size_t properties_fill {};
+  bool stream_end {};
+
+  void code(std::span<const unsigned char> input, lzma_action action)
+  {
+    // Without LZMA_CONCATENATED the decoder stops after the first .xz stream,
+    // any data following it is ignored
+    if (stream_end) {
+      return;
+    }
+    const lzma_ret ret = code_lzma(strm, input, action, outbuf, *next);
     if (ret == LZMA_STREAM_END) {
-      // Once everything has been decoded successfully, the
-      // return value of lzma_code() will be LZMA_STREAM_END.
-      return result;
+      stream_end = true;
+      return;
     }
     if (ret != LZMA_OK) {
       decompress_error(ret);
     }
   }
+
+public:
+  lzma_decompress_sink(lzma_stream* in_strm,
+                       const compression_dictionary* in_dictionary,
+                       std::uint32_t threads,
+                       std::span<unsigned char> in_outbuf,
+                       byte_sink& in_next)
+      : strm(in_strm)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+      , dictionary(in_dictionary)
+  {
+    // The raw decoder is initialized once the filter properties arrived
+    if (dictionary == nullptr && !init_decoder(strm, threads)) {
+      throw std::runtime_error("Could not initialize compression stream");
+    }
+  }
+
+  void write(std::span<const unsigned char> data) override
+  {
+    if (dictionary != nullptr && properties_fill < properties.size()) {
+      const auto take =
+          std::min(properties.size() - properties_fill, data.size());
+      std::ranges::copy(data.first(take), properties.begin() + properties_fill);
+      properties_fill += take;
+      data = data.subspan(take);
+      if (properties_fill < properties.size()) {
+        return;
+      }
+      const lzma_ret ret = init_raw_decoder(strm, properties, *dictionary);
+      if (ret != LZMA_OK) {
+        decompress_error(ret);
+      }
+    }
+    code(data, LZMA_RUN);
+  }
+  void finish() override
+  {
+    if (dictionary != nullptr && properties_fill < properties.size()) {
+      decompress_error(LZMA_BUF_ERROR);
+    }
+    // LZMA_FINISH tells the decoder that there will be no more input. It is
+    // important to check for LZMA_STREAM_END, not getting more output does not
+    // mean that everything has been decoded.
+    code({}, LZMA_FINISH);
+    if (!stream_end) {
+      decompress_error(LZMA_BUF_ERROR);
+    }
+    next->finish();
+  }
+};
+/**
+Forwards the data unchanged, for entries which are not compressed
+*/
+class passthrough_sink final : public byte_sink
+{
+  byte_sink* next;
+
+public:
+  explicit passthrough_sink(byte_sink& in_next)
+      : next(&in_next)
+  {
+  }
+  void write(std::span<const unsigned char> data) override
+  {
+    next->write(data);
+  }
+  void finish() override { next->finish(); }
+};
+
+#ifdef DIARIA_WITH_ZSTD
+void check_zstd(std::size_t return_code, std::string_view operation)
+{
+  if (ZSTD_isError(return_code) != 0U) {
+    throw std::runtime_error(std::format(
+        "Could not {}: {}", operation, ZSTD_getErrorName(return_code)));
+  }
 }
-}  // namespace
 
-struct owned_lzma_decode_stream
+class zstd_compress_sink final : public byte_sink
 {
-  lzma_stream strm {};
-  owned_lzma_decode_stream()
+  ZSTD_CCtx* cctx;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
+
+  /**
+  Returns whether the output buffer has been filled completely, so the
+  compressor might have more output pending
+  */
+  auto code(ZSTD_inBuffer& input, ZSTD_EndDirective directive) -> std::size_t
   {
-    strm = LZMA_STREAM_INIT;
-    if (!init_decoder(&strm)) {
-      throw std::runtime_error("Could not initialize compression stream");
+    ZSTD_outBuffer output {
+        .dst = outbuf.data(), .size = outbuf.size(), .pos = 0};
+    const std::size_t remaining =
+        ZSTD_compressStream2(cctx, &output, &input, directive);
+    check_zstd(remaining, "compress");
+    if (output.pos > 0) {
+      next->write(outbuf.first(output.pos));
+    }
+    return remaining;
+  }
+
+public:
+  zstd_compress_sink(ZSTD_CCtx* in_cctx,
+                     const compression_options& options,
+                     const compression_dictionary* dictionary,
+                     std::span<unsigned char> in_outbuf,
+                     byte_sink& in_next)
+      : cctx(in_cctx)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+  {
+    check_zstd(ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters),
+               "initialize compression");
+    check_zstd(ZSTD_CCtx_setParameter(cctx,
+                                      ZSTD_c_compressionLevel,
+                                      static_cast<int>(options.preset) + 1),
+               "initialize compression");
+    // Entries are authenticated by the encryption already
+    check_zstd(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0),
+               "initialize compression");
+    if (dictionary != nullptr) {
+      // A prefix is only used for the next frame and not copied
+      check_zstd(ZSTD_CCtx_refPrefix(cctx,
+                                     dictionary->content.data(),
+                                     dictionary->content.size()),
+                 "initialize compression");
+    }
+  }
+
+  void write(std::span<const unsigned char> data) override
+  {
+    ZSTD_inBuffer input {.src = data.data(), .size = data.size(), .pos = 0};
+    while (input.pos < input.size) {
+      code(input, ZSTD_e_continue);
     }
   }
-  owned_lzma_decode_stream(const owned_lzma_decode_stream&) = delete;
-  owned_lzma_decode_stream(owned_lzma_decode_stream&&) = delete;
-  auto operator=(const owned_lzma_decode_stream&)
-      -> owned_lzma_decode_stream& = delete;
-  auto operator=(owned_lzma_decode_stream&&)
-      -> owned_lzma_decode_stream& = delete;
-  ~owned_lzma_decode_stream() { lzma_end(&strm); }
+  void finish() override
+  {
+    ZSTD_inBuffer input {.src = nullptr, .size = 0, .pos = 0};
+    while (code(input, ZSTD_e_end) != 0) {
+    }
+    next->finish();
+  }
 };
-struct owned_lzma_encode_stream
+
+class zstd_decompress_sink final : public byte_sink
 {
-  lzma_stream strm {};
-  owned_lzma_encode_stream()
+  ZSTD_DCtx* dctx;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
+  bool frame_end {};
+
+  void code(std::span<const unsigned char> data)
   {
-    strm = LZMA_STREAM_INIT;
-    if (!init_encoder(&strm)) {
-      throw std::runtime_error("Could not initialize compression stream");
+    ZSTD_inBuffer input {.src = data.data(), .size = data.size(), .pos = 0};
+    // Keep going while there is input left or the output buffer has been
+    // filled, which means the decompressor might hold more output
+    while (!frame_end) {
+      ZSTD_outBuffer output {
+          .dst = outbuf.data(), .size = outbuf.size(), .pos = 0};
+      const std::size_t hint = ZSTD_decompressStream(dctx, &output, &input);
+      check_zstd(hint, "decompress");
+      if (output.pos > 0) {
+        next->write(outbuf.first(output.pos));
+      }
+      // Like the xz decoder, data following the frame is ignored
+      frame_end = hint == 0;
+      if (input.pos == input.size && output.pos < output.size) {
+        break;
+      }
     }
   }
-  owned_lzma_encode_stream(const owned_lzma_encode_stream&) = delete;
-  owned_lzma_encode_stream(owned_lzma_encode_stream&&) = delete;
-  auto operator=(const owned_lzma_encode_stream&)
-      -> owned_lzma_encode_stream& = delete;
-  auto operator=(owned_lzma_encode_stream&&)
-      -> owned_lzma_encode_stream& = delete;
-  ~owned_lzma_encode_stream() { lzma_end(&strm); }
+
+public:
+  zstd_decompress_sink(ZSTD_DCtx* in_dctx,
+                       const compression_dictionary* dictionary,
+                       std::span<unsigned char> in_outbuf,
+                       byte_sink& in_next)
+      : dctx(in_dctx)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+  {
+    check_zstd(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters),
+               "initialize decompression");
+    if (dictionary != nullptr) {
+      check_zstd(ZSTD_DCtx_refPrefix(dctx,
+                                     dictionary->content.data(),
+                                     dictionary->content.size()),
+                 "initialize decompression");
+    }
+  }
+
+  void write(std::span<const unsigned char> data) override { code(data); }
+  void finish() override
+  {
+    code({});
+    if (!frame_end) {
+      throw std::runtime_error(
+          "Could not decompress: Compressed data is truncated");
+    }
+    next->finish();
+  }
 };
+#endif
+
+#ifdef DIARIA_WITH_LZ4
+void check_lz4(LZ4F_errorCode_t return_code, std::string_view operation)
+{
+  if (LZ4F_isError(return_code) != 0U) {
+    throw std::runtime_error(std::format(
+        "Could not {}: {}", operation, LZ4F_getErrorName(return_code)));
+  }
+}
+
+/**
+Input is fed to the lz4 frame compressor in pieces of this size, so the output
+buffer only needs to hold the compression bound of one piece
+*/
+constexpr std::size_t lz4_piece_size = stream_chunk_size;
+
+constexpr LZ4F_preferences_t lz4_preferences = {
+    .frameInfo = {.blockSizeID = LZ4F_max64KB,
+                  .blockMode = LZ4F_blockLinked,
+                  .contentChecksumFlag = LZ4F_noContentChecksum,
+                  .frameType = LZ4F_frame,
+                  .contentSize = 0,
+                  .dictID = 0,
+                  .blockChecksumFlag = LZ4F_noBlockChecksum},
+    .compressionLevel = 0,
+    .autoFlush = 0,
+    .favorDecSpeed = 1,
+    .reserved = {}};
+
+auto lz4_outbuf_size() -> std::size_t
+{
+  return std::max<std::size_t>(
+      LZ4F_compressBound(lz4_piece_size, &lz4_preferences),
+      LZ4F_HEADER_SIZE_MAX);
+}
+
+class lz4_compress_sink final : public byte_sink
+{
+  LZ4F_cctx* cctx;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
+
+  void forward(std::size_t written)
+  {
+    check_lz4(written, "compress");
+    if (written > 0) {
+      next->write(outbuf.first(written));
+    }
+  }
+
+public:
+  lz4_compress_sink(LZ4F_cctx* in_cctx,
+                    std::span<unsigned char> in_outbuf,
+                    byte_sink& in_next)
+      : cctx(in_cctx)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+  {
+    forward(LZ4F_compressBegin(
+        cctx, outbuf.data(), outbuf.size(), &lz4_preferences));
+  }
+
+  void write(std::span<const unsigned char> data) override
+  {
+    while (!data.empty()) {
+      const auto piece = data.first(std::min(lz4_piece_size, data.size()));
+      forward(LZ4F_compressUpdate(cctx,
+                                  outbuf.data(),
+                                  outbuf.size(),
+                                  piece.data(),
+                                  piece.size(),
+                                  nullptr));
+      data = data.subspan(piece.size());
+    }
+  }
+  void finish() override
+  {
+    forward(LZ4F_compressEnd(cctx, outbuf.data(), outbuf.size(), nullptr));
+    next->finish();
+  }
+};
+
+class lz4_decompress_sink final : public byte_sink
+{
+  LZ4F_dctx* dctx;
+  std::span<unsigned char> outbuf;
+  byte_sink* next;
+  bool frame_end {};
+
+  void code(std::span<const unsigned char> data)
+  {
+    while (!frame_end) {
+      std::size_t output_size = outbuf.size();
+      std::size_t input_size = data.size();
+      const std::size_t hint = LZ4F_decompress(dctx,
+                                               outbuf.data(),
+                                               &output_size,
+                                               data.data(),
+                                               &input_size,
+                                               nullptr);
+      check_lz4(hint, "decompress");
+      if (output_size > 0) {
+        next->write(outbuf.first(output_size));
+      }
+      data = data.subspan(input_size);
+      frame_end = hint == 0;
+      if (data.empty() && output_size < outbuf.size()) {
+        break;
+      }
+    }
+  }
+
+public:
+  lz4_decompress_sink(LZ4F_dctx* in_dctx,
+                      std::span<unsigned char> in_outbuf,
+                      byte_sink& in_next)
+      : dctx(in_dctx)
+      , outbuf(in_outbuf)
+      , next(&in_next)
+  {
+    LZ4F_resetDecompressionContext(dctx);
+  }
+
+  void write(std::span<const unsigned char> data) override { code(data); }
+  void finish() override
+  {
+    code({});
+    if (!frame_end) {
+      throw std::runtime_error(
+          "Could not decompress: Compressed data is truncated");
+    }
+    next->finish();
+  }
+};
+#endif
+}  // namespace
+
+auto codec_available(compression_codec codec) -> bool
+{
+  switch (codec) {
+    case compression_codec::none:
+    case compression_codec::xz:
+    case compression_codec::lzma2:
+      return true;
+    case compression_codec::zstd:
+#ifdef DIARIA_WITH_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    case compression_codec::lz4:
+#ifdef DIARIA_WITH_LZ4
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+struct compression_context::codec_state
+{
+  owned_lzma_stream encoder;
+  owned_lzma_stream decoder;
+  // Separate buffers, so the output of a decompression sink can be fed into a
+  // compression sink of the same context
+  safe_array<unsigned char, BUFSIZ> encoder_outbuf;
+  safe_array<unsigned char, BUFSIZ> decoder_outbuf;
+#ifdef DIARIA_WITH_ZSTD
+  std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> zstd_encoder {
+      ZSTD_createCCtx(), &ZSTD_freeCCtx};
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> zstd_decoder {
+      ZSTD_createDCtx(), &ZSTD_freeDCtx};
+#endif
+#ifdef DIARIA_WITH_LZ4
+  std::unique_ptr<LZ4F_cctx, decltype(&LZ4F_freeCompressionContext)>
+      lz4_encoder {nullptr, &LZ4F_freeCompressionContext};
+  std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)>
+      lz4_decoder {nullptr, &LZ4F_freeDecompressionContext};
+  safe_vector<unsigned char> lz4_outbuf;
+#endif
+  std::vector<compression_dictionary> dictionaries;
+  std::optional<dictionary_id_t> used_dictionary;
+
+  codec_state()
+  {
+#ifdef DIARIA_WITH_ZSTD
+    if (!zstd_encoder || !zstd_decoder) {
+      throw std::runtime_error("Could not allocate zstd context");
+    }
+#endif
+#ifdef DIARIA_WITH_LZ4
+    LZ4F_cctx* lz4_cctx {};
+    LZ4F_dctx* lz4_dctx {};
+    check_lz4(LZ4F_createCompressionContext(&lz4_cctx, LZ4F_VERSION),
+              "allocate lz4 context");
+    lz4_encoder.reset(lz4_cctx);
+    check_lz4(LZ4F_createDecompressionContext(&lz4_dctx, LZ4F_VERSION),
+              "allocate lz4 context");
+    lz4_decoder.reset(lz4_dctx);
+    lz4_outbuf.resize(lz4_outbuf_size());
+#endif
+  }
+
+  [[nodiscard]] auto find_dictionary(const dictionary_id_t& id) const
+      -> const compression_dictionary&
+  {
+    const auto found = std::ranges::find(
+        dictionaries, id, [](const auto& dictionary) { return dictionary.id; });
+    if (found == dictionaries.end()) {
+      throw std::runtime_error("Unknown compression dictionary");
+    }
+    return *found;
+  }
+};
+
+compression_context::compression_context(compression_options in_options)
+    : options(in_options)
+    , state(std::make_unique<codec_state>())
+{
+  if (options.codec == compression_codec::lzma2) {
+    throw std::invalid_argument(
+        "lzma2 is picked automatically when using a dictionary with xz");
+  }
+  if (!codec_available(options.codec)) {
+    throw std::invalid_argument(
+        "The compression codec is not supported by this build");
+  }
+}
+
+compression_context::compression_context(compression_context&&) noexcept =
+    default;
+auto compression_context::operator=(compression_context&&) noexcept
+    -> compression_context& = default;
+compression_context::~compression_context() = default;
+
+auto compression_context::clone() const -> compression_context
+{
+  compression_context result {options};
+  for (const auto& dictionary : state->dictionaries) {
+    result.add_dictionary(
+        {.id = dictionary.id, .content = dictionary.content});
+  }
+  result.state->used_dictionary = state->used_dictionary;
+  return result;
+}
+
+void compression_context::add_dictionary(compression_dictionary dictionary)
+{
+  state->dictionaries.push_back(std::move(dictionary));
+}
+
+void compression_context::use_dictionary(std::optional<dictionary_id_t> id)
+{
+  if (id) {
+    // Fail early instead of on the next entry
+    std::ignore = state->find_dictionary(*id);
+  }
+  state->used_dictionary = id;
+}
+
+auto compression_context::codec() const -> compression_codec
+{
+  if (options.codec == compression_codec::xz && state->used_dictionary) {
+    return compression_codec::lzma2;
+  }
+  return options.codec;
+}
+
+auto compression_context::dictionary() const -> std::optional<dictionary_id_t>
+{
+  switch (codec()) {
+    case compression_codec::lzma2:
+    case compression_codec::zstd:
+      return state->used_dictionary;
+    default:
+      return std::nullopt;
+  }
+}
+
+auto compression_context::make_compress_sink(
+    byte_sink& next, std::optional<std::uint64_t> size_hint)
+    -> std::unique_ptr<byte_sink>
+{
+  const auto used_dictionary = dictionary();
+  const compression_dictionary* found_dictionary =
+      used_dictionary ? &state->find_dictionary(*used_dictionary) : nullptr;
+  switch (codec()) {
+    case compression_codec::none:
+      return std::make_unique<passthrough_sink>(next);
+    case compression_codec::xz:
+    case compression_codec::lzma2:
+      return std::make_unique<lzma_compress_sink>(&state->encoder.strm,
+                                                  options,
+                                                  size_hint,
+                                                  found_dictionary,
+                                                  state->encoder_outbuf.span(),
+                                                  next);
+#ifdef DIARIA_WITH_ZSTD
+    case compression_codec::zstd:
+      return std::make_unique<zstd_compress_sink>(state->zstd_encoder.get(),
+                                                  options,
+                                                  found_dictionary,
+                                                  state->encoder_outbuf.span(),
+                                                  next);
+#endif
+#ifdef DIARIA_WITH_LZ4
+    case compression_codec::lz4:
+      return std::make_unique<lz4_compress_sink>(
+          state->lz4_encoder.get(), state->lz4_outbuf, next);
+#endif
+    default:
+      throw std::invalid_argument(
+          "The compression codec is not supported by this build");
+  }
+}
+
+auto compression_context::make_decompress_sink(
+    byte_sink& next,
+    compression_codec codec,
+    std::optional<dictionary_id_t> dictionary,
+    std::optional<std::uint64_t> size_hint)
+    -> std::unique_ptr<byte_sink>
+{
+  const compression_dictionary* found_dictionary =
+      dictionary ? &state->find_dictionary(*dictionary) : nullptr;
+  switch (codec) {
+    case compression_codec::none:
+      return std::make_unique<passthrough_sink>(next);
+    case compression_codec::xz:
+    case compression_codec::lzma2:
+      if ((codec == compression_codec::lzma2) != (found_dictionary != nullptr))
+      {
+        throw std::runtime_error(
+            "Only lzma2 compressed entries use a dictionary");
+      }
+      return std::make_unique<lzma_decompress_sink>(
+          &state->decoder.strm,
+          found_dictionary,
+          threads_for_size(options, size_hint),
+          state->decoder_outbuf.span(),
+          next);
+#ifdef DIARIA_WITH_ZSTD
+    case compression_codec::zstd:
+      return std::make_unique<zstd_decompress_sink>(state->zstd_decoder.get(),
+                                                    found_dictionary,
+                                                    state->decoder_outbuf.span(),
+                                                    next);
+#endif
+#ifdef DIARIA_WITH_LZ4
+    case compression_codec::lz4:
+      return std::make_unique<lz4_decompress_sink>(
+          state->lz4_decoder.get(), state->decoder_outbuf.span(), next);
+#endif
+    default:
+      throw std::runtime_error(
+          "Entry uses a compression codec not supported by this build");
+  }
+}
 
 auto decompress(std::span<const unsigned char> input)
     -> safe_vector<unsigned char>
 {
-  owned_lzma_decode_stream strm {};
-  auto result = decompress_lzma(&strm.strm, input);
-  return result;
+  compression_context context {};
+  return context.decompress(input);
 }
 
 auto compress(std::span<const unsigned char> input)
     -> safe_vector<unsigned char>
 {
-  owned_lzma_encode_stream strm {};
+  compression_context context {};
+  return context.compress(input);
+}
+
+auto xz_uncompressed_size(std::span<const unsigned char> input)
+    -> std::optional<std::uint64_t>
+{
+  if (input.size() < 2 * LZMA_STREAM_HEADER_SIZE) {
+    return std::nullopt;
+  }
+  lzma_stream_flags footer {};
+  if (lzma_stream_footer_decode(
+          &footer, input.last(LZMA_STREAM_HEADER_SIZE).data())
+      != LZMA_OK)
+  {
+    return std::nullopt;
+  }
+  const auto without_footer =
+      input.first(input.size() - LZMA_STREAM_HEADER_SIZE);
+  if (footer.backward_size > without_footer.size()) {
+    return std::nullopt;
+  }
+  const auto encoded_index = without_footer.last(footer.backward_size);
+  lzma_index* index = nullptr;
+  std::uint64_t memlimit = UINT64_MAX;
+  std::size_t index_position = 0;
+  if (lzma_index_buffer_decode(&index,
+                               &memlimit,
+                               nullptr,
+                               encoded_index.data(),
+                               &index_position,
+                               encoded_index.size())
+      != LZMA_OK)
+  {
+    return std::nullopt;
+  }
+  const std::unique_ptr<lzma_index, void (*)(lzma_index*)> index_owner {
+      index, [](lzma_index* owned) { lzma_index_end(owned, nullptr); }};
+  // Concatenated streams or stream padding, the index only covers the last
+  // stream
+  if (lzma_index_file_size(index) != input.size()) {
+    return std::nullopt;
+  }
+  return lzma_index_uncompressed_size(index);
+}
+
+auto compression_context::decompress(std::span<const unsigned char> input,
+                                     compression_codec codec,
+                                     std::optional<dictionary_id_t> dictionary)
+    -> safe_vector<unsigned char>
+{
+  if (codec == compression_codec::xz) {
+    const auto size = xz_uncompressed_size(input);
+    if (size && *size <= max_presized_output) {
+      return decompress_presized(input, *size);
+    }
+  }
+  safe_vector<unsigned char> result {};
+  container_sink sink {result};
+  const auto decompression =
+      make_decompress_sink(sink, codec, dictionary, input.size());
+  decompression->write(input);
+  decompression->finish();
+  return result;
+}
+
+auto compression_context::decompress_presized(
+    std::span<const unsigned char> input, std::uint64_t size)
+    -> safe_vector<unsigned char>
+{
+  safe_vector<unsigned char> result(size);
+  lzma_stream* strm = &state->decoder.strm;
+  if (!init_decoder(strm, threads_for_size(options, input.size()))) {
+    throw std::runtime_error("Could not initialize compression stream");
+  }
+  strm->next_in = input.data();
+  strm->avail_in = input.size();
+  strm->next_out = result.data();
+  strm->avail_out = result.size();
+  // Once the output is full the decoder still has to verify the check, index
+  // and footer, which needs further calls without output space
+  lzma_ret ret = LZMA_OK;
+  while (ret == LZMA_OK) {
+    ret = lzma_code(strm, LZMA_FINISH);
+  }
+  if (ret != LZMA_STREAM_END) {
+    decompress_error(ret);
+  }
+  if (strm->avail_out != 0) {
+    decompress_error(LZMA_DATA_ERROR);
+  }
+  return result;
+}
+
+auto compression_context::compress(std::span<const unsigned char> input)
+    -> safe_vector<unsigned char>
+{
+  safe_vector<unsigned char> result {};
+  container_sink sink {result};
+  const auto compression = make_compress_sink(sink, input.size());
+  compression->write(input);
+  compression->finish();
+  return result;
+}
 
-  auto compressed = compress_lzma(&strm.strm, input);
+auto train_dictionary(std::span<const safe_vector<unsigned char>> samples,
+                      std::size_t max_size) -> safe_vector<unsigned char>
+{
+  // Lines recurring in several entries, like headings or greetings, are the
+  // most useful content. LZMA encodes short distances more cheaply, so they
+  // go to the end of the dictionary, with the most valuable one last.
+  std::unordered_map<std::string_view, std::size_t> line_counts {};
+  for (const auto& sample : samples) {
+    const std::string_view text {make_signed_char(sample.data()),
+                                 sample.size()};
+    std::unordered_set<std::string_view> sample_lines {};
+    std::size_t line_start = 0;
+    while (line_start < text.size()) {
+      const auto line_end =
+          std::min(text.find('\n', line_start), text.size() - 1) + 1;
+      const auto line = text.substr(line_start, line_end - line_start);
+      if (line.size() > 1 && sample_lines.insert(line).second) {
+        ++line_counts[line];
+      }
+      line_start = line_end;
+    }
+  }
+
+  // The dictionary is only protected by the symmetric key, so text written
+  // down in just one or two entries must not end up in it
+  std::vector<std::pair<std::string_view, std::size_t>> shared_lines {};
+  std::ranges::copy_if(
+      line_counts,
+      std::back_inserter(shared_lines),
+      [](const auto& line) { return line.second >= min_shared_line_entries; });
+  std::ranges::sort(shared_lines,
+                    std::greater {},
+                    [](const auto& line)
+                    { return line.first.size() * line.second; });
 
-  return compressed;
+  std::vector<std::string_view> picked_lines {};
+  std::size_t dictionary_size = 0;
+  for (const auto& [line, count] : shared_lines) {
+    if (dictionary_size + line.size() > max_size) {
+      continue;
+    }
+    picked_lines.push_back(line);
+    dictionary_size += line.size();
+  }
+
+  safe_vector<unsigned char> dictionary {};
+  dictionary.reserve(dictionary_size);
+  for (const auto& line : picked_lines | std::views::reverse) {
+    const auto bytes = std::span(make_unsigned_char(line.data()), line.size());
+    dictionary.insert(dictionary.end(), bytes.begin(), bytes.end());
+  }
+  return dictionary;
 }
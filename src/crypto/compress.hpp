@@ -1,8 +1,217 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
 
 #include "crypto/safe_buffer.hpp"
+#include "crypto/stream.hpp"
 
+/**
+Codecs entries can be compressed with, the value is stored in the entry header.
+zstd and lz4 are only available if enabled at build time.
+*/
+enum class compression_codec : unsigned char
+{
+  none = 0,
+  xz = 1,
+  /**
+  Raw LZMA2 stream primed with a preset dictionary, used in place of xz when
+  a dictionary is in use
+  */
+  lzma2 = 2,
+  zstd = 3,
+  lz4 = 4,
+};
+
+/**
+Whether this build can compress and decompress the codec
+*/
+auto codec_available(compression_codec codec) -> bool;
+
+/**
+Default size from which xz entries are compressed by several threads
+*/
+constexpr std::uint64_t default_threaded_threshold = 8UL * 1024 * 1024;
+
+struct compression_options
+{
+  compression_codec codec = compression_codec::xz;
+  /**
+  Preset level from 0 to 9. For xz this is the xz preset, zstd uses the level
+  one above it, lz4 only has a single level.
+  */
+  std::uint32_t preset = 6;
+  /**
+  Fit the encoder to the input size: the dictionary is shrunk to the input and
+  small inputs use a cheaper match finder
+  */
+  bool adaptive = true;
+  /**
+  Inputs of at least this many bytes use the extreme variant of the preset,
+  0 disables it
+  */
+  std::uint64_t extreme_threshold = 0;
+  /**
+  xz inputs of at least this many bytes are split into blocks compressed by
+  several threads, 0 disables it. The result is still a single .xz stream.
+  Decompression uses several threads for compressed inputs of at least this
+  size, if liblzma supports it, which only speeds up streams with several
+  blocks.
+  */
+  std::uint64_t threaded_threshold = default_threaded_threshold;
+  /**
+  Threads used above `threaded_threshold`, 0 for one per core
+  */
+  std::uint32_t threads = 0;
+  /**
+  Uncompressed size of the blocks compressed by separate threads, 0 to divide
+  the input evenly between the threads
+  */
+  std::uint64_t block_size = 0;
+};
+
+using dictionary_id_t = std::array<unsigned char, 16>;
+
+/**
+Preset dictionary for compressing short entries.
+
+The dictionary primes the compressor with text that entries typically contain,
+so even a short entry can refer back to it. xz and zstd make use of it, entries
+compressed with a dictionary can only be decompressed with the same dictionary,
+which is identified by a random id.
+*/
+struct compression_dictionary
+{
+  dictionary_id_t id {};
+  safe_vector<unsigned char> content;
+};
+
+constexpr std::size_t default_dictionary_size = 32UL * 1024;
+
+/**
+Entries a line has to occur in to be put into a trained dictionary
+*/
+constexpr std::size_t min_shared_line_entries = 3;
+
+/**
+Build a dictionary of at most `max_size` bytes from the lines occurring in at
+least `min_shared_line_entries` of the sample entries. It is empty if there
+are no such lines.
+*/
+auto train_dictionary(std::span<const safe_vector<unsigned char>> samples,
+                      std::size_t max_size) -> safe_vector<unsigned char>;
+
+/**
+Keeps the compression streams alive between entries.
+
+Setting up the encoder allocates the dictionary and match finder, which costs
+more than compressing a typical entry. A context resets its streams for every
+new sink instead, so bulk operations only pay for that once. Only one sink of
+each kind may be in use at a time.
+*/
+class compression_context
+{
+  struct codec_state;
+  compression_options options;
+  std::unique_ptr<codec_state> state;
+
+  auto decompress_presized(std::span<const unsigned char> input,
+                           std::uint64_t size) -> safe_vector<unsigned char>;
+
+public:
+  explicit compression_context(compression_options in_options = {});
+  compression_context(const compression_context&) = delete;
+  compression_context(compression_context&&) noexcept;
+  auto operator=(const compression_context&) -> compression_context& = delete;
+  auto operator=(compression_context&&) noexcept -> compression_context&;
+  ~compression_context();
+
+  /**
+  New context with the same options and dictionaries, but streams of its own,
+  for use on another thread
+  */
+  [[nodiscard]] auto clone() const -> compression_context;
+
+  /**
+  Make the dictionary available for decompression
+  */
+  void add_dictionary(compression_dictionary dictionary);
+
+  /**
+  Compress with the previously added dictionary of the given id from now on,
+  or without dictionary if empty
+  */
+  void use_dictionary(std::optional<dictionary_id_t> id);
+
+  /**
+  Codec new sinks compress with
+  */
+  [[nodiscard]] auto codec() const -> compression_codec;
+
+  /**
+  Id of the dictionary new sinks compress with, if the codec supports one
+  */
+  [[nodiscard]] auto dictionary() const -> std::optional<dictionary_id_t>;
+
+  /**
+  Stage compressing everything written to it using `codec()`, which is
+  forwarded to `next`. The expected input size selects the encoder settings,
+  see `compression_options`.
+  */
+  auto make_compress_sink(byte_sink& next,
+                          std::optional<std::uint64_t> size_hint)
+      -> std::unique_ptr<byte_sink>;
+
+  /**
+  Stage decompressing a stream of the given codec written to it, forwarding the
+  plaintext to `next`. A dictionary used for compression has to be added
+  before. The expected size of the compressed input selects whether to decode
+  using several threads.
+  */
+  auto make_decompress_sink(
+      byte_sink& next,
+      compression_codec codec = compression_codec::xz,
+      std::optional<dictionary_id_t> dictionary = std::nullopt,
+      std::optional<std::uint64_t> size_hint = std::nullopt)
+      -> std::unique_ptr<byte_sink>;
+
+  auto compress(std::span<const unsigned char> input)
+      -> safe_vector<unsigned char>;
+
+  /**
+  Decompress the whole input. A single .xz stream is decoded straight into an
+  output buffer sized from its index, everything else grows its output.
+  */
+  auto decompress(std::span<const unsigned char> input,
+                  compression_codec codec = compression_codec::xz,
+                  std::optional<dictionary_id_t> dictionary = std::nullopt)
+      -> safe_vector<unsigned char>;
+};
+
+/**
+Larger sizes recorded in an .xz index are not trusted to allocate the output
+up front, the output grows while decoding instead
+*/
+constexpr std::uint64_t max_presized_output = 1UL << 30U;
+
+/**
+Uncompressed size recorded in the index of the input, if it is exactly one
+.xz stream
+*/
+auto xz_uncompressed_size(std::span<const unsigned char> input)
+    -> std::optional<std::uint64_t>;
+
+/**
+Compress using a fresh context
+*/
 auto compress(std::span<const unsigned char> input)
     -> safe_vector<unsigned char>;
 
+/**
+Decompress using a fresh context
+*/
 auto decompress(std::span<const unsigned char> input)
     -> safe_vector<unsigned char>;
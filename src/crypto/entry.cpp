@@ -1,8 +1,12 @@
 #include <algorithm>
 #include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <ranges>
 #include <span>
 #include <stdexcept>
+#include <tuple>
 #include <vector>
 
 #include "entry.hpp"
@@ -10,10 +14,12 @@
 #include <sodium/crypto_box_curve25519xchacha20poly1305.h>
 #include <sodium/crypto_scalarmult.h>
 #include <sodium/crypto_secretbox_xchacha20poly1305.h>
+#include <sodium/crypto_secretstream_xchacha20poly1305.h>
 #include <sodium/randombytes.h>
 
 #include "compress.hpp"
 #include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
 
 auto symenc(symkey_span_t key, std::span<const unsigned char> plaintext)
     -> std::vector<unsigned char>
@@ -45,6 +51,11 @@ auto symenc(symkey_span_t key, std::span<const unsigned char> plaintext)
 auto symdec(symkey_span_t key, std::span<const unsigned char> ciphertext)
     -> safe_vector<unsigned char>
 {
+  if (ciphertext.size() < crypto_secretbox_xchacha20poly1305_NONCEBYTES
+          + crypto_secretbox_xchacha20poly1305_MACBYTES)
+  {
+    throw std::invalid_argument("Symmetric decryption failed");
+  }
   auto nonce = std::ranges::subrange(
       ciphertext.begin(),
       ciphertext.begin() + crypto_secretbox_xchacha20poly1305_NONCEBYTES);
@@ -65,6 +76,32 @@ auto symdec(symkey_span_t key, std::span<const unsigned char> ciphertext)
   return plaintext;
 }
 
+auto symdec_in_place(symkey_span_t key, std::span<unsigned char> ciphertext)
+    -> std::span<unsigned char>
+{
+  if (ciphertext.size() < crypto_secretbox_xchacha20poly1305_NONCEBYTES
+          + crypto_secretbox_xchacha20poly1305_MACBYTES)
+  {
+    throw std::invalid_argument("Symmetric decryption failed");
+  }
+  const auto nonce =
+      ciphertext.first(crypto_secretbox_xchacha20poly1305_NONCEBYTES);
+  const auto text =
+      ciphertext.subspan(crypto_secretbox_xchacha20poly1305_NONCEBYTES);
+  // Decrypting to the start of the buffer would overwrite the nonce while it
+  // is still needed, so the plaintext replaces the MAC and ciphertext instead
+  if (crypto_secretbox_xchacha20poly1305_open_easy(text.data(),
+                                                   text.data(),
+                                                   text.size(),
+                                                   nonce.data(),
+                                                   key.element.data())
+      != 0)
+  {
+    throw std::invalid_argument("Symmetric decryption failed");
+  }
+  return text.first(text.size() - crypto_secretbox_xchacha20poly1305_MACBYTES);
+}
+
 auto asymenc(public_key_span_t key, std::span<const unsigned char> plaintext)
     -> std::vector<unsigned char>
 {
@@ -98,49 +135,272 @@ auto asymdec(private_key_span_t key, std::span<const unsigned char> ciphertext)
   return output;
 }
 
-constexpr std::array<unsigned char, 6> magictag = {
-    'D', 'I', 'A', 'R', 'I', 'A'};
+namespace
+{
+static_assert(crypto_secretstream_xchacha20poly1305_KEYBYTES
+              == crypto_secretbox_xchacha20poly1305_KEYBYTES);
+
+auto write_header(byte_sink& output,
+                  compression_codec codec,
+                  std::optional<dictionary_id_t> dictionary,
+                  stream_cipher cipher)
+    -> std::array<unsigned char, entry_header_size>
+{
+  std::array<unsigned char, entry_header_size> header {};
+  std::ranges::copy(magictag, header.begin());
+  header[magictag.size()] = current_diaria_version;
+  header[entry_codec_offset] = static_cast<unsigned char>(codec);
+  if (dictionary) {
+    std::ranges::copy(*dictionary, header.begin() + entry_dictionary_offset);
+  }
+  header[entry_cipher_offset] = static_cast<unsigned char>(cipher);
+  output.write(header);
+  return header;
+}
+
+void decrypt_v0(symkey_span_t symkey,
+                const box_opener& opener,
+                compression_context& context,
+                std::span<unsigned char> ciphertext,
+                byte_sink& output)
+{
+  const auto compressed =
+      opener.open_in_place(symdec_in_place(symkey, ciphertext));
+  // Version 0 entries are a single .xz stream, whose index tells the size of
+  // the plaintext, so the output grows only once
+  if (const auto size = xz_uncompressed_size(compressed);
+      size && *size <= max_presized_output)
+  {
+    output.reserve(static_cast<std::size_t>(*size));
+  }
+  const auto decompression = context.make_decompress_sink(
+      output, compression_codec::xz, std::nullopt, compressed.size());
+  decompression->write(compressed);
+  decompression->finish();
+}
+}  // namespace
+
+entry_encrypt_sink::entry_encrypt_sink(symkey_span_t symkey,
+                                       public_key_span_t pubkey,
+                                       compression_context& context,
+                                       byte_sink& output,
+                                       std::optional<std::uint64_t> size_hint,
+                                       stream_cipher cipher)
+    : symmetric(make_stream_encrypt_sink(
+          cipher,
+          symkey.element,
+          output,
+          write_header(
+              output, context.codec(), context.dictionary(), cipher)))
+    , asymmetric(
+          std::make_unique<sealed_encrypt_sink>(pubkey, *symmetric, cipher))
+    , compression(context.make_compress_sink(*asymmetric, size_hint))
+{
+}
+
+void entry_encrypt_sink::write(std::span<const unsigned char> data)
+{
+  compression->write(data);
+}
+
+void entry_encrypt_sink::finish()
+{
+  compression->finish();
+}
+
+auto entry_header_size_of(
+    std::span<const unsigned char, entry_prefix_size> prefix) -> std::size_t
+{
+  if (!std::ranges::equal(prefix.first(magictag.size()), magictag)) {
+    throw std::runtime_error("Decrypting file which is not a diaria entry");
+  }
+  const auto version = prefix[magictag.size()];
+  if (version > current_diaria_version) {
+    throw std::runtime_error("Unknown diaria entry version");
+  }
+  if (version == 2) {
+    return entry_prefix_size + std::tuple_size_v<dictionary_id_t>;
+  }
+  if (version == 3) {
+    return entry_cipher_offset;
+  }
+  if (version >= 4) {
+    return entry_header_size;
+  }
+  return entry_prefix_size;
+}
+
+auto parse_entry_header(std::span<const unsigned char> header)
+    -> entry_header_info
+{
+  entry_header_info info {.version = header[magictag.size()]};
+  if (info.version == 0) {
+    return info;
+  }
+  // Version 1 has no dictionary id, version 2 no codec byte, it uses xz or
+  // lzma2 with a dictionary
+  const std::size_t dictionary_offset =
+      info.version >= 3 ? entry_dictionary_offset : entry_prefix_size;
+  const auto dictionary_id = info.version == 1
+      ? std::span<const unsigned char> {}
+      : header.subspan(dictionary_offset, std::tuple_size_v<dictionary_id_t>);
+  if (!std::ranges::all_of(dictionary_id,
+                           [](unsigned char byte) { return byte == 0; }))
+  {
+    info.dictionary.emplace();
+    std::ranges::copy(dictionary_id, info.dictionary->begin());
+  }
+  info.codec =
+      info.dictionary ? compression_codec::lzma2 : compression_codec::xz;
+  if (info.version >= 3) {
+    if (header[entry_codec_offset]
+        > static_cast<unsigned char>(compression_codec::lz4))
+    {
+      throw std::runtime_error("Unknown compression codec");
+    }
+    info.codec = static_cast<compression_codec>(header[entry_codec_offset]);
+  }
+  if (info.version >= 4) {
+    if (header[entry_cipher_offset]
+        > static_cast<unsigned char>(stream_cipher::aes256gcm))
+    {
+      throw std::runtime_error("Unknown stream cipher");
+    }
+    info.cipher = static_cast<stream_cipher>(header[entry_cipher_offset]);
+  }
+  return info;
+}
+
+entry_decrypt_sink::entry_decrypt_sink(symkey_span_t in_symkey,
+                                       const box_opener& in_opener,
+                                       compression_context& in_context,
+                                       byte_sink& in_output,
+                                       std::optional<std::uint64_t> in_size_hint)
+    : symkey(in_symkey)
+    , opener(&in_opener)
+    , context(&in_context)
+    , output(&in_output)
+    , size_hint(in_size_hint)
+{
+}
+
+void entry_decrypt_sink::start()
+{
+  const auto used_header =
+      std::span<const unsigned char>(header).first(header_size);
+  const auto info = parse_entry_header(used_header);
+  if (info.version == 0) {
+    // Collected to be decrypted at once, see `decrypt_v0`
+    if (size_hint && *size_hint > header_size) {
+      legacy_entry.reserve(static_cast<std::size_t>(*size_hint - header_size));
+    }
+    return;
+  }
+  decompression =
+      context->make_decompress_sink(
+          *output, info.codec, info.dictionary, size_hint);
+  asymmetric = std::make_unique<sealed_decrypt_sink>(
+      *opener, *decompression, info.cipher);
+  // Version 1 does not authenticate its header
+  const auto additional_data =
+      info.version == 1 ? std::span<const unsigned char> {} : used_header;
+  symmetric = make_stream_decrypt_sink(
+      info.cipher, symkey.element, *asymmetric, additional_data);
+}
+
+void entry_decrypt_sink::write(std::span<const unsigned char> data)
+{
+  while (header_fill < header_size) {
+    if (data.empty()) {
+      return;
+    }
+    const auto take = std::min(header_size - header_fill, data.size());
+    std::ranges::copy(data.first(take),
+                      std::span(header).subspan(header_fill).begin());
+    header_fill += take;
+    data = data.subspan(take);
+    if (header_fill == entry_prefix_size) {
+      header_size = entry_header_size_of(
+          std::span<const unsigned char>(header).first<entry_prefix_size>());
+    }
+    if (header_fill == header_size) {
+      start();
+    }
+  }
+  if (symmetric) {
+    symmetric->write(data);
+    return;
+  }
+  legacy_entry.insert(legacy_entry.end(), data.begin(), data.end());
+}
+
+void entry_decrypt_sink::finish()
+{
+  if (header_fill < header_size) {
+    throw std::runtime_error("Decrypting file which is not a diaria entry");
+  }
+  if (symmetric) {
+    symmetric->finish();
+    return;
+  }
+  decrypt_v0(symkey, *opener, *context, legacy_entry, *output);
+}
 
-constexpr unsigned char current_diaria_version = 0;
 auto encrypt(symkey_span_t symkey,
              public_key_span_t pubkey,
-             std::span<const unsigned char> filebytes)
+             compression_context& context,
+             std::span<const unsigned char> filebytes,
+             stream_cipher cipher)
     -> std::vector<unsigned char>
 {
-  auto compressed = compress(filebytes);
-  auto asymmetric_encrypted = asymenc(pubkey, compressed);
-  auto symmetric_encrypted = symenc(symkey, asymmetric_encrypted);
-  symmetric_encrypted.insert(symmetric_encrypted.begin(),
-                             current_diaria_version);
-  static_assert(std::cbegin(magictag) != nullptr);
-
-  /* -Wnull-dereference gets confused here */
-  // symmetric_encrypted.insert(
-  //     symmetric_encrypted.begin(), std::cbegin(magictag),
-  //     std::cend(magictag));
+  std::vector<unsigned char> result {};
+  container_sink sink {result};
+  entry_encrypt_sink encryption {
+      symkey, pubkey, context, sink, filebytes.size(), cipher};
+  encryption.write(filebytes);
+  encryption.finish();
+  return result;
+}
 
-  std::ranges::copy(magictag, std::back_inserter(symmetric_encrypted));
-  std::ranges::rotate(std::begin(symmetric_encrypted),
-                      std::end(symmetric_encrypted) - magictag.size(),
-                      std::end(symmetric_encrypted));
-  return symmetric_encrypted;
+auto decrypt(symkey_span_t symkey,
+             const box_opener& opener,
+             compression_context& context,
+             std::span<const unsigned char> filebytes)
+    -> safe_vector<unsigned char>
+{
+  safe_vector<unsigned char> result {};
+  container_sink sink {result};
+  entry_decrypt_sink decryption {
+      symkey, opener, context, sink, filebytes.size()};
+  decryption.write(filebytes);
+  decryption.finish();
+  return result;
 }
+
 auto decrypt(symkey_span_t symkey,
              private_key_span_t private_key,
+             compression_context& context,
              std::span<const unsigned char> filebytes)
     -> safe_vector<unsigned char>
 {
-  if (!std::equal(magictag.begin(), magictag.end(), filebytes.begin())) {
-    throw std::runtime_error("Decrypting file which is not a diaria entry");
-  }
-  const auto version = filebytes.subspan(magictag.size())[0];
-  if (version > current_diaria_version) {
-    throw std::runtime_error("Unknown diaria entry version");
-  }
+  const private_key_opener opener {private_key};
+  return decrypt(symkey, opener, context, filebytes);
+}
 
-  auto plaintext = filebytes.subspan(magictag.size() + 1);
-  auto symmetric_decrypted = symdec(symkey, plaintext);
-  auto asymmetric_decrypted = asymdec(private_key, symmetric_decrypted);
-  auto decompressed = decompress(asymmetric_decrypted);
-  return decompressed;
+auto encrypt(symkey_span_t symkey,
+             public_key_span_t pubkey,
+             std::span<const unsigned char> filebytes)
+    -> std::vector<unsigned char>
+{
+  compression_context context {};
+  return encrypt(symkey, pubkey, context, filebytes);
+}
+
+auto decrypt(symkey_span_t symkey,
+             private_key_span_t private_key,
+             std::span<const unsigned char> filebytes)
+    -> safe_vector<unsigned char>
+{
+  compression_context context {};
+  return decrypt(symkey, private_key, context, filebytes);
 }
@@ -1,10 +1,81 @@
 #pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <span>
+#include <tuple>
 #include <vector>
 
 #include <sodium/randombytes.h>
 
+#include "compress.hpp"
 #include "secret_key.hpp"
+#include "stream.hpp"
+
+constexpr std::array<unsigned char, 6> magictag = {
+    'D', 'I', 'A', 'R', 'I', 'A'};
+
+/**
+Version 0 encrypts the whole entry at once, version 1 is a chunked stream.
+Version 2 adds the id of the compression dictionary to the header, which is
+authenticated with every chunk. Version 3 adds the compression codec, version
+4 the stream cipher.
+*/
+constexpr unsigned char current_diaria_version = 4;
+
+/**
+Magic tag and version, which every entry starts with
+*/
+constexpr std::size_t entry_prefix_size = magictag.size() + 1;
+
+/**
+Position of the compression codec in the header
+*/
+constexpr std::size_t entry_codec_offset = entry_prefix_size;
+
+/**
+Position of the dictionary id in the header. An id of all zeroes means no
+dictionary has been used.
+*/
+constexpr std::size_t entry_dictionary_offset = entry_codec_offset + 1;
+
+/**
+Position of the stream cipher in the header
+*/
+constexpr std::size_t entry_cipher_offset =
+    entry_dictionary_offset + std::tuple_size_v<dictionary_id_t>;
+
+/**
+Header of the current version: prefix, compression codec, dictionary id and
+stream cipher
+*/
+constexpr std::size_t entry_header_size = entry_cipher_offset + 1;
+
+/**
+Metadata recorded in the header of an entry
+*/
+struct entry_header_info
+{
+  unsigned char version {};
+  compression_codec codec {compression_codec::xz};
+  std::optional<dictionary_id_t> dictionary;
+  stream_cipher cipher {stream_cipher::xchacha20poly1305};
+};
+
+/**
+Size of the header of an entry starting with `prefix`. Throws if the prefix
+does not belong to an entry of a known version.
+*/
+auto entry_header_size_of(
+    std::span<const unsigned char, entry_prefix_size> prefix) -> std::size_t;
+
+/**
+Read the metadata from a complete header, as sized by `entry_header_size_of`
+*/
+auto parse_entry_header(std::span<const unsigned char> header)
+    -> entry_header_info;
 
 auto symenc(symkey_span_t key, std::span<const unsigned char> plaintext)
     -> std::vector<unsigned char>;
@@ -12,12 +83,104 @@ auto symenc(symkey_span_t key, std::span<const unsigned char> plaintext)
 auto symdec(symkey_span_t key, std::span<const unsigned char> ciphertext)
     -> safe_vector<unsigned char>;
 
+/**
+Decrypt the output of `symenc` without allocating. The plaintext overwrites the
+ciphertext and is returned, the nonce at the start of the input stays intact.
+*/
+auto symdec_in_place(symkey_span_t key, std::span<unsigned char> ciphertext)
+    -> std::span<unsigned char>;
+
 auto asymenc(public_key_span_t key, std::span<const unsigned char> plaintext)
     -> std::vector<unsigned char>;
 
 auto asymdec(private_key_span_t key, std::span<const unsigned char> ciphertext)
     -> safe_vector<unsigned char>;
 
+/**
+Encrypts the plaintext written to it into an entry of the current version.
+
+The plaintext is compressed, encrypted with a stream key sealed to the public
+key and then encrypted with the symmetric key, every stage working on bounded
+chunks. The entry file is written to `output`. If known, the plaintext size is
+used to pick the compression settings. The codec and dictionary in use by the
+context are recorded in the header, as is the cipher of both streams.
+*/
+class entry_encrypt_sink final : public byte_sink
+{
+  std::unique_ptr<byte_sink> symmetric;
+  std::unique_ptr<byte_sink> asymmetric;
+  std::unique_ptr<byte_sink> compression;
+
+public:
+  entry_encrypt_sink(symkey_span_t symkey,
+                     public_key_span_t pubkey,
+                     compression_context& context,
+                     byte_sink& output,
+                     std::optional<std::uint64_t> size_hint = std::nullopt,
+                     stream_cipher cipher = stream_cipher::xchacha20poly1305);
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+/**
+Decrypts an entry file written to it, forwarding the plaintext to `output`.
+
+Entries of version 0 are buffered and decrypted as a whole once finished. Both
+encryption layers are opened inside that buffer, the decompressed plaintext is
+streamed to `output`.
+*/
+class entry_decrypt_sink final : public byte_sink
+{
+  symkey_span_t symkey;
+  const box_opener* opener;
+  compression_context* context;
+  byte_sink* output;
+  std::optional<std::uint64_t> size_hint;
+  std::array<unsigned char, entry_header_size> header {};
+  std::size_t header_fill {};
+  std::size_t header_size {entry_prefix_size};
+  safe_vector<unsigned char> legacy_entry;
+  std::unique_ptr<byte_sink> decompression;
+  std::unique_ptr<byte_sink> asymmetric;
+  std::unique_ptr<byte_sink> symmetric;
+
+  void start();
+
+public:
+  /**
+  The expected size of the entry lets large entries be decompressed by several
+  threads
+  */
+  entry_decrypt_sink(symkey_span_t in_symkey,
+                     const box_opener& in_opener,
+                     compression_context& in_context,
+                     byte_sink& in_output,
+                     std::optional<std::uint64_t> in_size_hint = std::nullopt);
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+auto encrypt(symkey_span_t symkey,
+             public_key_span_t pubkey,
+             compression_context& context,
+             std::span<const unsigned char> filebytes,
+             stream_cipher cipher = stream_cipher::xchacha20poly1305)
+    -> std::vector<unsigned char>;
+
+auto decrypt(symkey_span_t symkey,
+             const box_opener& opener,
+             compression_context& context,
+             std::span<const unsigned char> filebytes)
+    -> safe_vector<unsigned char>;
+
+auto decrypt(symkey_span_t symkey,
+             private_key_span_t private_key,
+             compression_context& context,
+             std::span<const unsigned char> filebytes)
+    -> safe_vector<unsigned char>;
+
 auto encrypt(symkey_span_t symkey,
              public_key_span_t pubkey,
              std::span<const unsigned char> filebytes)
@@ -33,4 +196,4 @@ inline auto generate_symkey() -> symkey_t
   symkey_t symkey {};
   randombytes_buf(symkey.data(), symkey.size());
   return symkey;
-}
\ No newline at end of file
+}
@@ -4,7 +4,11 @@
 #include <print>
 
 auto diaria_sodium_malloc(std::size_t size) -> void*;
-void diaria_sodium_free(void* pointer);
+/**
+`size` has to be the size passed when allocating, the backends of large
+buffers need it to unmap them
+*/
+void diaria_sodium_free(void* pointer, std::size_t size);
 
 template<typename T>
 struct sodium_allocator : public std::allocator<T>
@@ -26,9 +30,9 @@ struct sodium_allocator : public std::allocator<T>
 
     throw std::bad_alloc();
   }
-  void deallocate(sodium_allocator::value_type* pointer, std::size_t /*n*/)
+  void deallocate(sodium_allocator::value_type* pointer, std::size_t n)
   {
-    diaria_sodium_free(pointer);
+    diaria_sodium_free(pointer, n * sizeof(value_type));
   }
 
   sodium_allocator(sodium_allocator&&) = default;
@@ -1,16 +1,41 @@
+#include <stdexcept>
+
 #include "./safe_buffer.hpp"
 
 #include <sodium/core.h>
-#include <sodium/utils.h>
 
-auto diaria_sodium_malloc(std::size_t size) -> void*
+#include "crypto/secure_arena.hpp"
+#include "crypto/secure_memory.hpp"
+
+namespace
 {
-  if (sodium_init() < 0) {
+/**
+sodium_init takes a lock on every call, even once initialized
+*/
+void ensure_sodium_initialized()
+{
+  static const bool initialized = sodium_init() >= 0;
+  if (!initialized) {
     throw std::runtime_error("Could not initialize sodium secure memory");
   }
-  return sodium_malloc(size);
 }
-void diaria_sodium_free(void* pointer)
+}  // namespace
+
+auto diaria_sodium_malloc(std::size_t size) -> void*
 {
-  sodium_free(pointer);
+  // The rest of libsodium relies on having been initialized here
+  ensure_sodium_initialized();
+  if (void* const chunk = secure_arena::instance().allocate(size)) {
+    return chunk;
+  }
+  return secure_memory_allocate(size);
+}
+void diaria_sodium_free(void* pointer, std::size_t size)
+{
+  if (pointer == nullptr) {
+    return;
+  }
+  if (!secure_arena::instance().deallocate(pointer)) {
+    secure_memory_deallocate(pointer, size);
+  }
 }
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "./secure_arena.hpp"
+
+#include <sodium/utils.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace
+{
+/**
+Regions hold at least this much, so the small size classes do not need a region
+per handful of chunks
+*/
+constexpr std::size_t minimum_region_size = 64UL * 1024;
+
+/**
+Upper bound of the budget if RLIMIT_MEMLOCK is unlimited
+*/
+constexpr std::size_t maximum_arena_budget = 64UL * 1024 * 1024;
+
+auto page_size() -> std::size_t
+{
+  static const auto size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+auto chunk_size_of(std::size_t size_class) -> std::size_t
+{
+  return secure_arena::smallest_chunk << size_class;
+}
+
+auto size_class_of(std::size_t size) -> std::size_t
+{
+  constexpr auto smallest_width = std::bit_width(secure_arena::smallest_chunk);
+  return static_cast<std::size_t>(
+      std::bit_width(std::max(size, secure_arena::smallest_chunk) - 1)
+      - (smallest_width - 1));
+}
+}  // namespace
+
+auto default_arena_budget() -> std::size_t
+{
+  rlimit limit {};
+  if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0) {
+    return 0;
+  }
+  if (limit.rlim_cur == RLIM_INFINITY) {
+    return maximum_arena_budget;
+  }
+  // The other half is left to sodium_malloc, which locks every buffer it
+  // serves
+  return std::min(static_cast<std::size_t>(limit.rlim_cur / 2),
+                  maximum_arena_budget);
+}
+
+secure_arena::secure_arena(std::size_t in_budget)
+    : budget(in_budget)
+{
+}
+
+secure_arena::~secure_arena()
+{
+  for (const auto& [begin, unmapped] : regions) {
+    munlock(unmapped.begin, unmapped.size);
+    munmap(unmapped.begin - page_size(), unmapped.size + 2 * page_size());
+  }
+}
+
+auto secure_arena::instance() -> secure_arena&
+{
+  // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+  static auto* const arena = new secure_arena(default_arena_budget());
+  return *arena;
+}
+
+auto secure_arena::add_region(std::size_t size_class) -> bool
+{
+  const auto chunk_size = chunk_size_of(size_class);
+  const auto usable_size = std::max(2 * chunk_size, minimum_region_size);
+  if (locked + usable_size > budget) {
+    return false;
+  }
+  const auto guard_size = page_size();
+  auto* const mapping = mmap(nullptr,
+                             usable_size + 2 * guard_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1,
+                             0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  auto* const begin = static_cast<std::byte*>(mapping) + guard_size;
+  if (mprotect(mapping, guard_size, PROT_NONE) != 0
+      || mprotect(begin + usable_size, guard_size, PROT_NONE) != 0
+      || mlock(begin, usable_size) != 0)
+  {
+    munmap(mapping, usable_size + 2 * guard_size);
+    // Locking fails once the limit is reached, so do not try again
+    budget = locked;
+    return false;
+  }
+  madvise(begin, usable_size, MADV_DONTDUMP);
+  locked += usable_size;
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  regions.emplace(reinterpret_cast<std::uintptr_t>(begin),
+                  region {.begin = begin,
+                          .size = usable_size,
+                          .chunk_size = chunk_size});
+  // Chained back to front, so the chunks are handed out in address order
+  for (std::size_t offset = usable_size; offset >= chunk_size;
+       offset -= chunk_size)
+  {
+    auto* const chunk = begin + offset - chunk_size;
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    *reinterpret_cast<void**>(chunk) = free_chunks.at(size_class);
+    free_chunks.at(size_class) = chunk;
+  }
+  return true;
+}
+
+auto secure_arena::allocate(std::size_t size) -> void*
+{
+  if (size == 0 || size > largest_chunk) {
+    return nullptr;
+  }
+  const auto size_class = size_class_of(size);
+  const std::scoped_lock lock {mutex};
+  if (free_chunks.at(size_class) == nullptr && !add_region(size_class)) {
+    return nullptr;
+  }
+  void* const chunk = free_chunks.at(size_class);
+  free_chunks.at(size_class) = *static_cast<void**>(chunk);
+  *static_cast<void**>(chunk) = nullptr;
+  return chunk;
+}
+
+auto secure_arena::deallocate(void* pointer) -> bool
+{
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const auto address = reinterpret_cast<std::uintptr_t>(pointer);
+  const std::scoped_lock lock {mutex};
+  auto found = regions.upper_bound(address);
+  if (found == regions.begin()) {
+    return false;
+  }
+  --found;
+  const auto& [begin, found_region] = *found;
+  if (address >= begin + found_region.size) {
+    return false;
+  }
+  sodium_memzero(pointer, found_region.chunk_size);
+  const auto size_class = size_class_of(found_region.chunk_size);
+  *static_cast<void**>(pointer) = free_chunks.at(size_class);
+  free_chunks.at(size_class) = pointer;
+  return true;
+}
+
+auto secure_arena::locked_size() -> std::size_t
+{
+  const std::scoped_lock lock {mutex};
+  return locked;
+}
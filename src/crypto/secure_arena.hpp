@@ -0,0 +1,93 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+/**
+Hands out small secure buffers from locked regions, instead of mapping,
+locking and guarding every buffer on its own like `sodium_malloc`.
+
+Every region is locked with `mlock`, excluded from core dumps and enclosed by
+guard pages. It is split into chunks of a single size class, freed chunks are
+wiped and reused. Overflowing a chunk therefore reaches its neighbours instead
+of a guard page, which is why large buffers, where the syscalls do not matter
+compared to the work done on them, are left to `sodium_malloc`.
+
+Locked memory is limited by RLIMIT_MEMLOCK, the arena only uses a part of it so
+`sodium_malloc` keeps working. Once that budget is used up the arena declines
+further allocations.
+*/
+class secure_arena
+{
+public:
+  static constexpr std::size_t smallest_chunk = 64;
+  static constexpr std::size_t size_class_count = 12;
+  /**
+  Larger buffers are not served by the arena
+  */
+  static constexpr std::size_t largest_chunk = smallest_chunk
+      << (size_class_count - 1);
+
+private:
+  struct region
+  {
+    std::byte* begin;
+    std::size_t size;
+    std::size_t chunk_size;
+  };
+
+  std::mutex mutex;
+  /**
+  Freed chunks of every size class, linked through their first bytes
+  */
+  std::array<void*, size_class_count> free_chunks {};
+  /**
+  Keyed by the first address of the region
+  */
+  std::map<std::uintptr_t, region> regions;
+  std::size_t locked {};
+  std::size_t budget;
+
+  auto add_region(std::size_t size_class) -> bool;
+
+public:
+  explicit secure_arena(std::size_t in_budget);
+  secure_arena(const secure_arena&) = delete;
+  secure_arena(secure_arena&&) = delete;
+  auto operator=(const secure_arena&) -> secure_arena& = delete;
+  auto operator=(secure_arena&&) -> secure_arena& = delete;
+  /**
+  Unmaps the regions, every chunk has to be freed before
+  */
+  ~secure_arena();
+
+  /**
+  Shared by all secure buffers of the process. It is never destroyed, so
+  buffers freed during static destruction can still be returned.
+  */
+  static auto instance() -> secure_arena&;
+
+  /**
+  Chunk of at least `size` bytes, or nullptr if the size is not served by the
+  arena or its budget is used up
+  */
+  auto allocate(std::size_t size) -> void*;
+
+  /**
+  Wipe and return a chunk. Returns false if the pointer does not belong to the
+  arena.
+  */
+  auto deallocate(void* pointer) -> bool;
+
+  /**
+  Bytes of locked memory in use by the regions
+  */
+  [[nodiscard]] auto locked_size() -> std::size_t;
+};
+
+/**
+Part of RLIMIT_MEMLOCK the arena of the process may use
+*/
+auto default_arena_budget() -> std::size_t;
@@ -0,0 +1,258 @@
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+
+#include "./secure_memory.hpp"
+
+#include <fcntl.h>
+#include <sodium/utils.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+auto page_size() -> std::size_t
+{
+  static const auto size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+auto round_to_pages(std::size_t size) -> std::size_t
+{
+  return (size + page_size() - 1) / page_size() * page_size();
+}
+
+/**
+Reserve the buffer with a guard page on either side. Returns the start of the
+buffer, which is not accessible yet.
+*/
+auto reserve_guarded(std::size_t mapped_size) -> std::byte*
+{
+  auto* const reservation = mmap(nullptr,
+                                 mapped_size + 2 * page_size(),
+                                 PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1,
+                                 0);
+  if (reservation == MAP_FAILED) {
+    return nullptr;
+  }
+  return static_cast<std::byte*>(reservation) + page_size();
+}
+
+void release_guarded(std::byte* buffer, std::size_t mapped_size)
+{
+  munmap(buffer - page_size(), mapped_size + 2 * page_size());
+}
+
+struct sodium_backend final : secure_memory_backend
+{
+  auto allocate(std::size_t size) -> void* override
+  {
+    return sodium_malloc(size);
+  }
+  void deallocate(void* pointer, std::size_t /*size*/) override
+  {
+    sodium_free(pointer);
+  }
+  [[nodiscard]] auto name() const -> std::string_view override
+  {
+    return "sodium";
+  }
+};
+
+struct mlock_backend final : secure_memory_backend
+{
+  auto allocate(std::size_t size) -> void* override
+  {
+    const auto mapped_size = round_to_pages(size);
+    auto* const buffer = reserve_guarded(mapped_size);
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+    if (mprotect(buffer, mapped_size, PROT_READ | PROT_WRITE) != 0
+        || mlock(buffer, mapped_size) != 0)
+    {
+      release_guarded(buffer, mapped_size);
+      return nullptr;
+    }
+    madvise(buffer, mapped_size, MADV_DONTDUMP);
+    return buffer;
+  }
+  void deallocate(void* pointer, std::size_t size) override
+  {
+    const auto mapped_size = round_to_pages(size);
+    sodium_memzero(pointer, mapped_size);
+    munlock(pointer, mapped_size);
+    release_guarded(static_cast<std::byte*>(pointer), mapped_size);
+  }
+  [[nodiscard]] auto name() const -> std::string_view override
+  {
+    return "mlock";
+  }
+};
+
+#ifdef SYS_memfd_secret
+auto open_secret_memory() -> int
+{
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+  return static_cast<int>(syscall(SYS_memfd_secret, O_CLOEXEC));
+}
+#else
+auto open_secret_memory() -> int
+{
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+struct memfd_secret_backend final : secure_memory_backend
+{
+  memfd_secret_backend()
+  {
+    const int probe = open_secret_memory();
+    if (probe == -1) {
+      throw std::runtime_error(
+          std::format("memfd_secret is not available; Errno {} [{}]",
+                      errno,
+                      std::string_view {strerror(errno)}));
+    }
+    close(probe);
+  }
+  auto allocate(std::size_t size) -> void* override
+  {
+    const auto mapped_size = round_to_pages(size);
+    auto* const buffer = reserve_guarded(mapped_size);
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+    const int secret_fd = open_secret_memory();
+    if (secret_fd == -1
+        || ftruncate(secret_fd, static_cast<off_t>(mapped_size)) != 0
+        || mmap(buffer,
+                mapped_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED,
+                secret_fd,
+                0)
+            == MAP_FAILED)
+    {
+      if (secret_fd != -1) {
+        close(secret_fd);
+      }
+      release_guarded(buffer, mapped_size);
+      return nullptr;
+    }
+    // The mapping keeps the memory alive, secret memory is always locked
+    close(secret_fd);
+    return buffer;
+  }
+  void deallocate(void* pointer, std::size_t size) override
+  {
+    const auto mapped_size = round_to_pages(size);
+    sodium_memzero(pointer, mapped_size);
+    release_guarded(static_cast<std::byte*>(pointer), mapped_size);
+  }
+  [[nodiscard]] auto name() const -> std::string_view override
+  {
+    return "memfd_secret";
+  }
+};
+
+std::mutex selection_mutex;
+std::atomic<secure_memory_backend*> selected_backend {nullptr};
+std::atomic<std::size_t> live_buffers {0};
+
+auto default_backend() -> secure_memory_backend&
+{
+  // NOLINTNEXTLINE(concurrency-mt-unsafe)
+  const char* const configured = std::getenv("DIARIA_SECURE_MEMORY");
+  if (configured == nullptr) {
+    return get_secure_memory_backend(secure_memory_kind::sodium);
+  }
+  return get_secure_memory_backend(parse_secure_memory_kind(configured));
+}
+
+auto current_backend() -> secure_memory_backend&
+{
+  auto* backend = selected_backend.load();
+  if (backend != nullptr) {
+    return *backend;
+  }
+  const std::scoped_lock lock {selection_mutex};
+  backend = selected_backend.load();
+  if (backend == nullptr) {
+    backend = &default_backend();
+    selected_backend.store(backend);
+  }
+  return *backend;
+}
+}  // namespace
+
+auto get_secure_memory_backend(secure_memory_kind kind)
+    -> secure_memory_backend&
+{
+  switch (kind) {
+    case secure_memory_kind::sodium: {
+      static sodium_backend backend {};
+      return backend;
+    }
+    case secure_memory_kind::mlock: {
+      static mlock_backend backend {};
+      return backend;
+    }
+    case secure_memory_kind::memfd_secret: {
+      static memfd_secret_backend backend {};
+      return backend;
+    }
+  }
+  throw std::invalid_argument("Unknown secure memory backend");
+}
+
+void select_secure_memory_backend(secure_memory_kind kind)
+{
+  auto& backend = get_secure_memory_backend(kind);
+  const std::scoped_lock lock {selection_mutex};
+  if (selected_backend.load() != &backend && live_buffers.load() != 0) {
+    throw std::logic_error(
+        "Secure memory backend changed while buffers are allocated");
+  }
+  selected_backend.store(&backend);
+}
+
+auto secure_memory_allocate(std::size_t size) -> void*
+{
+  void* const buffer = current_backend().allocate(size);
+  if (buffer != nullptr) {
+    ++live_buffers;
+  }
+  return buffer;
+}
+
+void secure_memory_deallocate(void* pointer, std::size_t size)
+{
+  current_backend().deallocate(pointer, size);
+  --live_buffers;
+}
+
+auto parse_secure_memory_kind(std::string_view name) -> secure_memory_kind
+{
+  if (name == "sodium") {
+    return secure_memory_kind::sodium;
+  }
+  if (name == "mlock") {
+    return secure_memory_kind::mlock;
+  }
+  if (name == "memfd_secret") {
+    return secure_memory_kind::memfd_secret;
+  }
+  throw std::invalid_argument(
+      std::format("Unknown secure memory backend \"{}\"", name));
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+/**
+Where buffers too large for the secure arena get their memory from
+*/
+enum class secure_memory_kind : unsigned char
+{
+  /**
+  `sodium_malloc`, with guard pages and a canary around every buffer
+  */
+  sodium,
+  /**
+  Locked anonymous mappings with guard pages, without the canary checks and
+  extra page of `sodium_malloc`
+  */
+  mlock,
+  /**
+  `memfd_secret` mappings, which are also removed from the direct map of the
+  kernel, so not even the kernel can read them by accident. Needs Linux 5.14
+  with secretmem enabled.
+  */
+  memfd_secret,
+};
+
+/**
+Source of large secure buffers. Implementations have to be usable from several
+threads at once.
+*/
+struct secure_memory_backend
+{
+  /**
+  Buffer of `size` bytes, or nullptr if the memory could not be allocated
+  */
+  virtual auto allocate(std::size_t size) -> void* = 0;
+  /**
+  Wipe and free a buffer of this backend, `size` as given when allocating it
+  */
+  virtual void deallocate(void* pointer, std::size_t size) = 0;
+  [[nodiscard]] virtual auto name() const -> std::string_view = 0;
+  virtual ~secure_memory_backend() = default;
+};
+
+/**
+Backend of the given kind, throws if this system does not support it
+*/
+auto get_secure_memory_backend(secure_memory_kind kind)
+    -> secure_memory_backend&;
+
+/**
+Backend for large buffers from now on. Can only be changed while no large
+buffer is allocated, so every buffer is freed by the backend which allocated
+it. Without a choice, $DIARIA_SECURE_MEMORY is used and otherwise sodium.
+*/
+void select_secure_memory_backend(secure_memory_kind kind);
+
+/**
+Allocate a large buffer using the selected backend
+*/
+auto secure_memory_allocate(std::size_t size) -> void*;
+
+void secure_memory_deallocate(void* pointer, std::size_t size);
+
+/**
+Kind named by `sodium`, `mlock` or `memfd_secret`
+*/
+auto parse_secure_memory_kind(std::string_view name) -> secure_memory_kind;
@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+#include "./stream.hpp"
+
+#include <sodium/core.h>
+#include <sodium/crypto_aead_aes256gcm.h>
+#include <sodium/crypto_box_curve25519xchacha20poly1305.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/crypto_scalarmult.h>
+#include <sodium/crypto_secretstream_xchacha20poly1305.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
+#include <unistd.h>
+
+#include "crypto/safe_buffer.hpp"
+#include "util/file_io.hpp"
+
+fd_sink::fd_sink(int in_fd)
+    : fd(in_fd)
+{
+  buffer.reserve(stream_chunk_size);
+}
+
+void fd_sink::flush()
+{
+  write_fully(fd, buffer);
+  buffer.clear();
+}
+
+void fd_sink::write(std::span<const unsigned char> data)
+{
+  if (buffer.size() + data.size() > buffer.capacity()) {
+    flush();
+  }
+  if (data.size() >= buffer.capacity()) {
+    write_fully(fd, data);
+    return;
+  }
+  buffer.insert(buffer.end(), data.begin(), data.end());
+}
+
+void fd_sink::finish()
+{
+  flush();
+}
+
+void pump_fd(int input_fd, byte_sink& sink)
+{
+  const auto size = fd_size_hint(input_fd);
+  if (size && *size >= pump_map_threshold
+      && lseek(input_fd, 0, SEEK_CUR) == 0)
+  {
+    const mapped_file mapping {input_fd, static_cast<std::size_t>(*size)};
+    for (auto left = mapping.bytes(); !left.empty();) {
+      const auto part = left.first(std::min(left.size(), stream_chunk_size));
+      sink.write(part);
+      left = left.subspan(part.size());
+    }
+    // Whatever was appended after checking the size is read below
+    lseek(input_fd, static_cast<off_t>(*size), SEEK_SET);
+  }
+  safe_array<unsigned char, stream_chunk_size> buffer {};
+  while (true) {
+    const auto bytes_read = read_some(input_fd, buffer);
+    if (bytes_read == 0) {
+      break;
+    }
+    sink.write(std::span(buffer.data(), bytes_read));
+  }
+  sink.finish();
+}
+
+secretstream_encrypt_sink::secretstream_encrypt_sink(
+    stream_key_span_t key,
+    byte_sink& in_next,
+    std::span<const unsigned char> in_additional_data)
+    : next(&in_next)
+    , additional_data(in_additional_data.begin(), in_additional_data.end())
+{
+  stream_header_t header {};
+  if (crypto_secretstream_xchacha20poly1305_init_push(
+          &state, header.data(), key.data())
+      != 0)
+  {
+    throw std::invalid_argument("Could not initialize encryption stream");
+  }
+  plain_chunk.reserve(stream_chunk_size);
+  cipher_chunk.reserve(stream_chunk_size
+                       + crypto_secretstream_xchacha20poly1305_ABYTES);
+  next->write(header);
+}
+
+secretstream_encrypt_sink::~secretstream_encrypt_sink()
+{
+  sodium_memzero(&state, sizeof(state));
+}
+
+void secretstream_encrypt_sink::push_chunk(unsigned char tag)
+{
+  cipher_chunk.resize(plain_chunk.size()
+                      + crypto_secretstream_xchacha20poly1305_ABYTES);
+  if (crypto_secretstream_xchacha20poly1305_push(&state,
+                                                 cipher_chunk.data(),
+                                                 nullptr,
+                                                 plain_chunk.data(),
+                                                 plain_chunk.size(),
+                                                 additional_data.data(),
+                                                 additional_data.size(),
+                                                 tag)
+      != 0)
+  {
+    throw std::invalid_argument("Stream encryption failed");
+  }
+  plain_chunk.clear();
+  next->write(cipher_chunk);
+}
+
+void secretstream_encrypt_sink::write(std::span<const unsigned char> data)
+{
+  while (!data.empty()) {
+    const auto take =
+        std::min(stream_chunk_size - plain_chunk.size(), data.size());
+    const auto piece = data.first(take);
+    plain_chunk.insert(plain_chunk.end(), piece.begin(), piece.end());
+    data = data.subspan(take);
+    if (plain_chunk.size() == stream_chunk_size) {
+      push_chunk(crypto_secretstream_xchacha20poly1305_TAG_MESSAGE);
+    }
+  }
+}
+
+void secretstream_encrypt_sink::finish()
+{
+  // Full chunks are pushed as soon as they are complete, so the final chunk is
+  // always shorter and marks the end of the stream
+  push_chunk(crypto_secretstream_xchacha20poly1305_TAG_FINAL);
+  next->finish();
+}
+
+secretstream_decrypt_sink::secretstream_decrypt_sink(
+    stream_key_span_t in_key,
+    byte_sink& in_next,
+    std::span<const unsigned char> in_additional_data)
+    : next(&in_next)
+    , additional_data(in_additional_data.begin(), in_additional_data.end())
+{
+  std::ranges::copy(in_key, key.begin());
+  plain_chunk.reserve(stream_chunk_size);
+  cipher_chunk.reserve(stream_chunk_size
+                       + crypto_secretstream_xchacha20poly1305_ABYTES);
+}
+
+secretstream_decrypt_sink::~secretstream_decrypt_sink()
+{
+  sodium_memzero(&state, sizeof(state));
+}
+
+void secretstream_decrypt_sink::pull_chunk(bool last)
+{
+  if (cipher_chunk.size() < crypto_secretstream_xchacha20poly1305_ABYTES) {
+    throw std::runtime_error("Encrypted stream is truncated");
+  }
+  plain_chunk.resize(cipher_chunk.size()
+                     - crypto_secretstream_xchacha20poly1305_ABYTES);
+  unsigned long long plain_length {};
+  unsigned char tag {};
+  if (crypto_secretstream_xchacha20poly1305_pull(&state,
+                                                 plain_chunk.data(),
+                                                 &plain_length,
+                                                 &tag,
+                                                 cipher_chunk.data(),
+                                                 cipher_chunk.size(),
+                                                 additional_data.data(),
+                                                 additional_data.size())
+      != 0)
+  {
+    throw std::invalid_argument("Stream decryption failed");
+  }
+  const bool is_final = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+  if (is_final != last) {
+    throw std::runtime_error(
+        "Encrypted stream is truncated or contains trailing data");
+  }
+  cipher_chunk.clear();
+  next->write(std::span(plain_chunk.data(), plain_length));
+}
+
+void secretstream_decrypt_sink::write(std::span<const unsigned char> data)
+{
+  constexpr std::size_t full_chunk_size =
+      stream_chunk_size + crypto_secretstream_xchacha20poly1305_ABYTES;
+  while (!data.empty()) {
+    if (header_fill < header.size()) {
+      const auto take = std::min(header.size() - header_fill, data.size());
+      std::ranges::copy(data.first(take), header.begin() + header_fill);
+      header_fill += take;
+      data = data.subspan(take);
+      if (header_fill == header.size()
+          && crypto_secretstream_xchacha20poly1305_init_pull(
+                 &state, header.data(), key.data())
+              != 0)
+      {
+        throw std::invalid_argument("Invalid encryption stream header");
+      }
+      continue;
+    }
+    const auto take =
+        std::min(full_chunk_size - cipher_chunk.size(), data.size());
+    const auto piece = data.first(take);
+    cipher_chunk.insert(cipher_chunk.end(), piece.begin(), piece.end());
+    data = data.subspan(take);
+    if (cipher_chunk.size() == full_chunk_size) {
+      pull_chunk(false);
+    }
+  }
+}
+
+void secretstream_decrypt_sink::finish()
+{
+  if (header_fill < header.size()) {
+    throw std::runtime_error("Encrypted stream is truncated");
+  }
+  pull_chunk(true);
+  next->finish();
+}
+
+namespace
+{
+static_assert(crypto_aead_aes256gcm_KEYBYTES
+              == crypto_secretstream_xchacha20poly1305_KEYBYTES);
+
+using aes_nonce_t = std::array<unsigned char, crypto_aead_aes256gcm_NPUBBYTES>;
+
+void init_aes_stream(crypto_aead_aes256gcm_state& state,
+                     stream_key_span_t key,
+                     std::span<const unsigned char, aes_stream_salt_size> salt)
+{
+  if (!aes256gcm_available()) {
+    throw std::runtime_error("AES-256-GCM is not supported by this CPU");
+  }
+  stream_key_t stream_key {};
+  crypto_generichash(stream_key.data(),
+                     stream_key.size(),
+                     salt.data(),
+                     salt.size(),
+                     key.data(),
+                     key.size());
+  crypto_aead_aes256gcm_beforenm(&state, stream_key.data());
+}
+
+auto aes_chunk_nonce(std::uint64_t chunk_index, bool last) -> aes_nonce_t
+{
+  aes_nonce_t nonce {};
+  for (std::size_t byte = 0; byte < sizeof(chunk_index); ++byte) {
+    nonce.at(byte) = static_cast<unsigned char>(chunk_index >> (8U * byte));
+  }
+  nonce.back() = last ? 1 : 0;
+  return nonce;
+}
+}  // namespace
+
+aes_stream_encrypt_sink::aes_stream_encrypt_sink(
+    stream_key_span_t key,
+    byte_sink& in_next,
+    std::span<const unsigned char> in_additional_data)
+    : next(&in_next)
+    , additional_data(in_additional_data.begin(), in_additional_data.end())
+{
+  std::array<unsigned char, aes_stream_salt_size> salt {};
+  randombytes_buf(salt.data(), salt.size());
+  init_aes_stream(state, key, salt);
+  plain_chunk.reserve(stream_chunk_size);
+  cipher_chunk.reserve(stream_chunk_size + crypto_aead_aes256gcm_ABYTES);
+  next->write(salt);
+}
+
+aes_stream_encrypt_sink::~aes_stream_encrypt_sink()
+{
+  sodium_memzero(&state, sizeof(state));
+}
+
+void aes_stream_encrypt_sink::push_chunk(bool last)
+{
+  cipher_chunk.resize(plain_chunk.size() + crypto_aead_aes256gcm_ABYTES);
+  const auto nonce = aes_chunk_nonce(chunk_index++, last);
+  unsigned long long cipher_length {};
+  if (crypto_aead_aes256gcm_encrypt_afternm(cipher_chunk.data(),
+                                            &cipher_length,
+                                            plain_chunk.data(),
+                                            plain_chunk.size(),
+                                            additional_data.data(),
+                                            additional_data.size(),
+                                            nullptr,
+                                            nonce.data(),
+                                            &state)
+      != 0)
+  {
+    throw std::invalid_argument("Stream encryption failed");
+  }
+  plain_chunk.clear();
+  next->write(cipher_chunk);
+}
+
+void aes_stream_encrypt_sink::write(std::span<const unsigned char> data)
+{
+  while (!data.empty()) {
+    const auto take =
+        std::min(stream_chunk_size - plain_chunk.size(), data.size());
+    const auto piece = data.first(take);
+    plain_chunk.insert(plain_chunk.end(), piece.begin(), piece.end());
+    data = data.subspan(take);
+    if (plain_chunk.size() == stream_chunk_size) {
+      push_chunk(false);
+    }
+  }
+}
+
+void aes_stream_encrypt_sink::finish()
+{
+  push_chunk(true);
+  next->finish();
+}
+
+aes_stream_decrypt_sink::aes_stream_decrypt_sink(
+    stream_key_span_t in_key,
+    byte_sink& in_next,
+    std::span<const unsigned char> in_additional_data)
+    : next(&in_next)
+    , additional_data(in_additional_data.begin(), in_additional_data.end())
+{
+  std::ranges::copy(in_key, key.begin());
+  plain_chunk.reserve(stream_chunk_size);
+  cipher_chunk.reserve(stream_chunk_size + crypto_aead_aes256gcm_ABYTES);
+}
+
+aes_stream_decrypt_sink::~aes_stream_decrypt_sink()
+{
+  sodium_memzero(&state, sizeof(state));
+}
+
+void aes_stream_decrypt_sink::pull_chunk(bool last)
+{
+  if (cipher_chunk.size() < crypto_aead_aes256gcm_ABYTES) {
+    throw std::runtime_error("Encrypted stream is truncated");
+  }
+  plain_chunk.resize(cipher_chunk.size() - crypto_aead_aes256gcm_ABYTES);
+  // A stream cut off after a full chunk fails here, as that chunk was not
+  // encrypted as the final one
+  const auto nonce = aes_chunk_nonce(chunk_index++, last);
+  unsigned long long plain_length {};
+  if (crypto_aead_aes256gcm_decrypt_afternm(plain_chunk.data(),
+                                            &plain_length,
+                                            nullptr,
+                                            cipher_chunk.data(),
+                                            cipher_chunk.size(),
+                                            additional_data.data(),
+                                            additional_data.size(),
+                                            nonce.data(),
+                                            &state)
+      != 0)
+  {
+    throw std::invalid_argument("Stream decryption failed");
+  }
+  cipher_chunk.clear();
+  next->write(std::span(plain_chunk.data(), plain_length));
+}
+
+void aes_stream_decrypt_sink::write(std::span<const unsigned char> data)
+{
+  constexpr std::size_t full_chunk_size =
+      stream_chunk_size + crypto_aead_aes256gcm_ABYTES;
+  while (!data.empty()) {
+    if (salt_fill < salt.size()) {
+      const auto take = std::min(salt.size() - salt_fill, data.size());
+      std::ranges::copy(data.first(take), salt.begin() + salt_fill);
+      salt_fill += take;
+      data = data.subspan(take);
+      if (salt_fill == salt.size()) {
+        init_aes_stream(state, key.span(), salt);
+      }
+      continue;
+    }
+    const auto take =
+        std::min(full_chunk_size - cipher_chunk.size(), data.size());
+    const auto piece = data.first(take);
+    cipher_chunk.insert(cipher_chunk.end(), piece.begin(), piece.end());
+    data = data.subspan(take);
+    if (cipher_chunk.size() == full_chunk_size) {
+      pull_chunk(false);
+    }
+  }
+}
+
+void aes_stream_decrypt_sink::finish()
+{
+  if (salt_fill < salt.size()) {
+    throw std::runtime_error("Encrypted stream is truncated");
+  }
+  pull_chunk(true);
+  next->finish();
+}
+
+auto aes256gcm_available() -> bool
+{
+  // Detects the CPU features
+  if (sodium_init() < 0) {
+    throw std::runtime_error("Could not initialize sodium");
+  }
+  return crypto_aead_aes256gcm_is_available() != 0;
+}
+
+auto preferred_stream_cipher() -> stream_cipher
+{
+  return aes256gcm_available() ? stream_cipher::aes256gcm
+                               : stream_cipher::xchacha20poly1305;
+}
+
+auto make_stream_encrypt_sink(stream_cipher cipher,
+                              stream_key_span_t key,
+                              byte_sink& next,
+                              std::span<const unsigned char> additional_data)
+    -> std::unique_ptr<byte_sink>
+{
+  switch (cipher) {
+    case stream_cipher::xchacha20poly1305:
+      return std::make_unique<secretstream_encrypt_sink>(
+          key, next, additional_data);
+    case stream_cipher::aes256gcm:
+      return std::make_unique<aes_stream_encrypt_sink>(
+          key, next, additional_data);
+  }
+  throw std::invalid_argument("Unknown stream cipher");
+}
+
+auto make_stream_decrypt_sink(stream_cipher cipher,
+                              stream_key_span_t key,
+                              byte_sink& next,
+                              std::span<const unsigned char> additional_data)
+    -> std::unique_ptr<byte_sink>
+{
+  switch (cipher) {
+    case stream_cipher::xchacha20poly1305:
+      return std::make_unique<secretstream_decrypt_sink>(
+          key, next, additional_data);
+    case stream_cipher::aes256gcm:
+      return std::make_unique<aes_stream_decrypt_sink>(
+          key, next, additional_data);
+  }
+  throw std::invalid_argument("Unknown stream cipher");
+}
+
+sealed_encrypt_sink::sealed_encrypt_sink(public_key_span_t key,
+                                         byte_sink& next,
+                                         stream_cipher cipher)
+{
+  stream_key_t stream_key {};
+  crypto_secretstream_xchacha20poly1305_keygen(stream_key.data());
+
+  std::array<unsigned char, sealed_stream_key_size> sealed_key {};
+  if (crypto_box_curve25519xchacha20poly1305_seal(sealed_key.data(),
+                                                  stream_key.data(),
+                                                  stream_key.size(),
+                                                  key.element.data())
+      != 0)
+  {
+    throw std::invalid_argument("Asymmetric encryption failed");
+  }
+  next.write(sealed_key);
+  stream = make_stream_encrypt_sink(cipher, stream_key.span(), next);
+}
+
+void sealed_encrypt_sink::write(std::span<const unsigned char> data)
+{
+  stream->write(data);
+}
+
+void sealed_encrypt_sink::finish()
+{
+  stream->finish();
+}
+
+auto box_opener::open_in_place(std::span<unsigned char> sealed) const
+    -> std::span<unsigned char>
+{
+  const auto opened = open(sealed);
+  std::ranges::copy(opened, sealed.begin());
+  return sealed.first(opened.size());
+}
+
+private_key_opener::private_key_opener(private_key_t key)
+    : private_key(std::move(key))
+{
+  crypto_scalarmult_base(public_key.data(), private_key.data());
+}
+
+private_key_opener::private_key_opener(private_key_span_t key)
+{
+  std::ranges::copy(key.element, private_key.begin());
+  crypto_scalarmult_base(public_key.data(), private_key.data());
+}
+
+auto private_key_opener::open(std::span<const unsigned char> sealed) const
+    -> safe_vector<unsigned char>
+{
+  if (sealed.size() < crypto_box_curve25519xchacha20poly1305_SEALBYTES) {
+    throw std::invalid_argument("Asymmetric decryption failed");
+  }
+  safe_vector<unsigned char> opened(
+      sealed.size() - crypto_box_curve25519xchacha20poly1305_SEALBYTES);
+  if (crypto_box_curve25519xchacha20poly1305_seal_open(opened.data(),
+                                                       sealed.data(),
+                                                       sealed.size(),
+                                                       public_key.data(),
+                                                       private_key.data())
+      != 0)
+  {
+    throw std::invalid_argument("Asymmetric decryption failed");
+  }
+  return opened;
+}
+
+auto private_key_opener::open_in_place(std::span<unsigned char> sealed) const
+    -> std::span<unsigned char>
+{
+  if (sealed.size() < crypto_box_curve25519xchacha20poly1305_SEALBYTES) {
+    throw std::invalid_argument("Asymmetric decryption failed");
+  }
+  // libsodium reads the ephemeral key and authenticates the box before
+  // writing, and moves the ciphertext if it overlaps the output
+  if (crypto_box_curve25519xchacha20poly1305_seal_open(sealed.data(),
+                                                       sealed.data(),
+                                                       sealed.size(),
+                                                       public_key.data(),
+                                                       private_key.data())
+      != 0)
+  {
+    throw std::invalid_argument("Asymmetric decryption failed");
+  }
+  return sealed.first(sealed.size()
+                      - crypto_box_curve25519xchacha20poly1305_SEALBYTES);
+}
+
+sealed_decrypt_sink::sealed_decrypt_sink(const box_opener& in_opener,
+                                         byte_sink& in_next,
+                                         stream_cipher in_cipher)
+    : opener(&in_opener)
+    , next(&in_next)
+    , cipher(in_cipher)
+{
+}
+
+void sealed_decrypt_sink::write(std::span<const unsigned char> data)
+{
+  if (stream) {
+    stream->write(data);
+    return;
+  }
+  const auto take =
+      std::min(sealed_key.size() - sealed_key_fill, data.size());
+  std::ranges::copy(data.first(take), sealed_key.begin() + sealed_key_fill);
+  sealed_key_fill += take;
+  if (sealed_key_fill < sealed_key.size()) {
+    return;
+  }
+
+  const auto opened_key = opener->open(sealed_key);
+  if (opened_key.size() != crypto_secretstream_xchacha20poly1305_KEYBYTES) {
+    throw std::invalid_argument("Asymmetric decryption failed");
+  }
+  stream_key_t stream_key {};
+  std::ranges::copy(opened_key, stream_key.begin());
+  stream = make_stream_decrypt_sink(cipher, stream_key.span(), *next);
+  stream->write(data.subspan(take));
+}
+
+void sealed_decrypt_sink::finish()
+{
+  if (!stream) {
+    throw std::runtime_error("Encrypted stream is truncated");
+  }
+  stream->finish();
+}
@@ -0,0 +1,371 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <sodium/crypto_aead_aes256gcm.h>
+#include <sodium/crypto_secretstream_xchacha20poly1305.h>
+
+#include "safe_buffer.hpp"
+#include "secret_key.hpp"
+
+/**
+Receiving end of a byte stream.
+
+Entries are encrypted and decrypted by chaining sinks, every stage forwarding
+its transformed output to the next one. Stages only ever hold a bounded amount
+of data, so memory usage does not depend on the size of the entry.
+*/
+struct byte_sink
+{
+  virtual void write(std::span<const unsigned char> data) = 0;
+  /**
+  Called exactly once after the last write, flushes all buffered data and
+  finishes the next stage
+  */
+  virtual void finish() = 0;
+  /**
+  Announces that about `size` more bytes are going to be written, so the data
+  can be allocated for at once
+  */
+  virtual void reserve(std::size_t /*size*/) {}
+  virtual ~byte_sink() = default;
+};
+
+/**
+Collects the stream into a vector-like container
+*/
+template<typename Container>
+struct container_sink final : byte_sink
+{
+  Container* container;
+  explicit container_sink(Container& in_container)
+      : container(&in_container)
+  {
+  }
+  void write(std::span<const unsigned char> data) override
+  {
+    container->insert(container->end(), data.begin(), data.end());
+  }
+  void finish() override {}
+  void reserve(std::size_t size) override
+  {
+    container->reserve(container->size() + size);
+  }
+};
+
+/**
+Plaintext size of the chunks the secret streams are split into
+*/
+constexpr std::size_t stream_chunk_size = 64UL * 1024;
+
+/**
+Writes the stream to a file descriptor, which is not closed afterwards.
+
+Small writes are collected into chunks of `stream_chunk_size`, so decompressed
+output and separators between entries do not cost a system call each. Data
+still buffered is only written by `finish`, which may be called repeatedly to
+write several streams to the same descriptor.
+*/
+class fd_sink final : public byte_sink
+{
+  int fd;
+  safe_vector<unsigned char> buffer;
+
+  void flush();
+
+public:
+  explicit fd_sink(int in_fd);
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+/**
+Files at least this large are mapped by `pump_fd` instead of being read
+*/
+constexpr std::size_t pump_map_threshold = 1024UL * 1024;
+
+/**
+Read the file descriptor until EOF, feeding everything into the sink and
+finishing it afterwards.
+
+Large regular files read from their start are mapped and handed to the sink
+without copying them into a buffer first.
+*/
+void pump_fd(int input_fd, byte_sink& sink);
+
+using stream_key_t =
+    safe_array<unsigned char, crypto_secretstream_xchacha20poly1305_KEYBYTES>;
+using stream_key_span_t =
+    std::span<const unsigned char,
+              crypto_secretstream_xchacha20poly1305_KEYBYTES>;
+using stream_header_t =
+    std::array<unsigned char, crypto_secretstream_xchacha20poly1305_HEADERBYTES>;
+
+/**
+Encrypts the stream in chunks of `stream_chunk_size` using libsodium's
+secretstream. The stream header is written to the next stage on construction.
+The last chunk is always shorter than a full chunk and carries the final tag,
+so truncation and trailing data are detected when decrypting. The additional
+data is authenticated with every chunk.
+*/
+class secretstream_encrypt_sink final : public byte_sink
+{
+  crypto_secretstream_xchacha20poly1305_state state {};
+  byte_sink* next;
+  std::vector<unsigned char> additional_data;
+  safe_vector<unsigned char> plain_chunk;
+  safe_vector<unsigned char> cipher_chunk;
+
+  void push_chunk(unsigned char tag);
+
+public:
+  secretstream_encrypt_sink(
+      stream_key_span_t key,
+      byte_sink& in_next,
+      std::span<const unsigned char> in_additional_data = {});
+  secretstream_encrypt_sink(const secretstream_encrypt_sink&) = delete;
+  secretstream_encrypt_sink(secretstream_encrypt_sink&&) = delete;
+  auto operator=(const secretstream_encrypt_sink&)
+      -> secretstream_encrypt_sink& = delete;
+  auto operator=(secretstream_encrypt_sink&&)
+      -> secretstream_encrypt_sink& = delete;
+  ~secretstream_encrypt_sink() override;
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+class secretstream_decrypt_sink final : public byte_sink
+{
+  crypto_secretstream_xchacha20poly1305_state state {};
+  byte_sink* next;
+  std::vector<unsigned char> additional_data;
+  stream_key_t key;
+  stream_header_t header {};
+  std::size_t header_fill {};
+  safe_vector<unsigned char> plain_chunk;
+  safe_vector<unsigned char> cipher_chunk;
+
+  void pull_chunk(bool last);
+
+public:
+  secretstream_decrypt_sink(
+      stream_key_span_t in_key,
+      byte_sink& in_next,
+      std::span<const unsigned char> in_additional_data = {});
+  secretstream_decrypt_sink(const secretstream_decrypt_sink&) = delete;
+  secretstream_decrypt_sink(secretstream_decrypt_sink&&) = delete;
+  auto operator=(const secretstream_decrypt_sink&)
+      -> secretstream_decrypt_sink& = delete;
+  auto operator=(secretstream_decrypt_sink&&)
+      -> secretstream_decrypt_sink& = delete;
+  ~secretstream_decrypt_sink() override;
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+/**
+Size of the random salt starting an AES-256-GCM stream
+*/
+constexpr std::size_t aes_stream_salt_size = 32;
+
+/**
+Encrypts the stream with AES-256-GCM, chunked like
+`secretstream_encrypt_sink`, so the last chunk is always shorter than a full
+one.
+
+GCM nonces are too short to be picked at random, so every stream derives its
+own key from the given key and a random salt, which is written to the next
+stage on construction. Chunks are numbered in the nonce, whose last byte marks
+the final chunk.
+*/
+class aes_stream_encrypt_sink final : public byte_sink
+{
+  crypto_aead_aes256gcm_state state {};
+  byte_sink* next;
+  std::vector<unsigned char> additional_data;
+  std::uint64_t chunk_index {};
+  safe_vector<unsigned char> plain_chunk;
+  safe_vector<unsigned char> cipher_chunk;
+
+  void push_chunk(bool last);
+
+public:
+  aes_stream_encrypt_sink(
+      stream_key_span_t key,
+      byte_sink& in_next,
+      std::span<const unsigned char> in_additional_data = {});
+  aes_stream_encrypt_sink(const aes_stream_encrypt_sink&) = delete;
+  aes_stream_encrypt_sink(aes_stream_encrypt_sink&&) = delete;
+  auto operator=(const aes_stream_encrypt_sink&)
+      -> aes_stream_encrypt_sink& = delete;
+  auto operator=(aes_stream_encrypt_sink&&)
+      -> aes_stream_encrypt_sink& = delete;
+  ~aes_stream_encrypt_sink() override;
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+class aes_stream_decrypt_sink final : public byte_sink
+{
+  crypto_aead_aes256gcm_state state {};
+  byte_sink* next;
+  std::vector<unsigned char> additional_data;
+  stream_key_t key;
+  std::array<unsigned char, aes_stream_salt_size> salt {};
+  std::size_t salt_fill {};
+  std::uint64_t chunk_index {};
+  safe_vector<unsigned char> plain_chunk;
+  safe_vector<unsigned char> cipher_chunk;
+
+  void pull_chunk(bool last);
+
+public:
+  aes_stream_decrypt_sink(
+      stream_key_span_t in_key,
+      byte_sink& in_next,
+      std::span<const unsigned char> in_additional_data = {});
+  aes_stream_decrypt_sink(const aes_stream_decrypt_sink&) = delete;
+  aes_stream_decrypt_sink(aes_stream_decrypt_sink&&) = delete;
+  auto operator=(const aes_stream_decrypt_sink&)
+      -> aes_stream_decrypt_sink& = delete;
+  auto operator=(aes_stream_decrypt_sink&&)
+      -> aes_stream_decrypt_sink& = delete;
+  ~aes_stream_decrypt_sink() override;
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+/**
+Cipher of the secret streams of an entry.
+
+libsodium only implements AES-256-GCM using the AES instructions of the CPU,
+so entries using it can only be read on machines which have them.
+*/
+enum class stream_cipher : unsigned char
+{
+  xchacha20poly1305 = 0,
+  aes256gcm = 1,
+};
+
+/**
+Whether this CPU can encrypt and decrypt AES-256-GCM streams
+*/
+auto aes256gcm_available() -> bool;
+
+/**
+AES-256-GCM if the CPU accelerates it, XChaCha20-Poly1305 otherwise
+*/
+auto preferred_stream_cipher() -> stream_cipher;
+
+auto make_stream_encrypt_sink(
+    stream_cipher cipher,
+    stream_key_span_t key,
+    byte_sink& next,
+    std::span<const unsigned char> additional_data = {})
+    -> std::unique_ptr<byte_sink>;
+
+auto make_stream_decrypt_sink(
+    stream_cipher cipher,
+    stream_key_span_t key,
+    byte_sink& next,
+    std::span<const unsigned char> additional_data = {})
+    -> std::unique_ptr<byte_sink>;
+
+/**
+Size of a stream key sealed to a public key
+*/
+constexpr std::size_t sealed_stream_key_size =
+    crypto_secretstream_xchacha20poly1305_KEYBYTES
+    + crypto_box_curve25519xchacha20poly1305_SEALBYTES;
+
+/**
+Asymmetric layer of the streaming format.
+
+A random stream key is sealed to the public key and written first, the data
+itself is encrypted with that key using a secret stream.
+*/
+class sealed_encrypt_sink final : public byte_sink
+{
+  std::unique_ptr<byte_sink> stream;
+
+public:
+  sealed_encrypt_sink(public_key_span_t key,
+                      byte_sink& next,
+                      stream_cipher cipher = stream_cipher::xchacha20poly1305);
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
+
+/**
+Opens boxes sealed to the public key. The private key does not have to be held
+by this process, it can be kept by the key agent instead. Opening has to be
+safe from several threads at once.
+*/
+struct box_opener
+{
+  [[nodiscard]] virtual auto open(std::span<const unsigned char> sealed) const
+      -> safe_vector<unsigned char> = 0;
+  /**
+  Open the box, overwriting it with its content. Returns the content at the
+  start of the box.
+  */
+  virtual auto open_in_place(std::span<unsigned char> sealed) const
+      -> std::span<unsigned char>;
+  virtual ~box_opener() = default;
+};
+
+/**
+Opens boxes with the private key held in memory of this process. The public
+key is derived once, instead of for every opened box.
+*/
+class private_key_opener final : public box_opener
+{
+  private_key_t private_key;
+  public_key_t public_key {};
+
+public:
+  explicit private_key_opener(private_key_t key);
+  /**
+  Copies the key into memory owned by the opener
+  */
+  explicit private_key_opener(private_key_span_t key);
+
+  [[nodiscard]] auto open(std::span<const unsigned char> sealed) const
+      -> safe_vector<unsigned char> override;
+  auto open_in_place(std::span<unsigned char> sealed) const
+      -> std::span<unsigned char> override;
+
+  [[nodiscard]] auto get_public_key() const -> const public_key_t&
+  {
+    return public_key;
+  }
+};
+
+class sealed_decrypt_sink final : public byte_sink
+{
+  const box_opener* opener;
+  byte_sink* next;
+  std::array<unsigned char, sealed_stream_key_size> sealed_key {};
+  std::size_t sealed_key_fill {};
+  stream_cipher cipher;
+  std::unique_ptr<byte_sink> stream;
+
+public:
+  sealed_decrypt_sink(
+      const box_opener& in_opener,
+      byte_sink& in_next,
+      stream_cipher in_cipher = stream_cipher::xchacha20poly1305);
+
+  void write(std::span<const unsigned char> data) override;
+  void finish() override;
+};
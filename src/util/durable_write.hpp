@@ -0,0 +1,247 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "util/file_io.hpp"
+#include "util/smart_fd.hpp"
+
+/**
+Flush the directory, so files created in, renamed into or removed from it
+persist
+*/
+inline void flush_directory(const std::filesystem::path& directory)
+{
+  const smart_fd directory_fd {
+      open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (directory_fd.fd == -1 || fsync(directory_fd.fd) == -1) {
+    throw std::runtime_error(
+        std::format("Could not flush directory \"{}\"; Errno {} [{}]",
+                    directory.c_str(),
+                    errno,
+                    strerror(errno)));
+  }
+}
+
+/**
+Writes a batch of files, which only appear under their names once they are
+complete and on disk, replacing files of the same name.
+
+Files are written without a name using O_TMPFILE, or under a temporary name on
+file systems lacking it. `commit` flushes all of them with a single syncfs per
+file system, which costs about as much as flushing one file, before linking
+them to their names and flushing the directories. Files not committed are
+discarded.
+*/
+class durable_file_batch
+{
+  struct pending_file
+  {
+    int fd;
+    std::filesystem::path target;
+    /**
+    Empty for files written without a name
+    */
+    std::filesystem::path temporary;
+  };
+  std::vector<pending_file> pending;
+
+  [[noreturn]] static void fail(std::string_view action,
+                                const std::filesystem::path& path)
+  {
+    throw std::runtime_error(std::format("Could not {} \"{}\"; Errno {} [{}]",
+                                         action,
+                                         path.c_str(),
+                                         errno,
+                                         strerror(errno)));
+  }
+
+  static auto directory_of(const std::filesystem::path& path)
+      -> std::filesystem::path
+  {
+    return path.has_parent_path() ? path.parent_path()
+                                  : std::filesystem::path {"."};
+  }
+
+  static auto temporary_name_for(const std::filesystem::path& target)
+      -> std::filesystem::path
+  {
+    auto temporary = target;
+    temporary += std::format(".{}.tmp", getpid());
+    return temporary;
+  }
+
+  /**
+  Give the unnamed file its name. Linking does not replace existing files, so
+  those are replaced by linking under a temporary name and renaming.
+  */
+  static void link_unnamed(int file_fd, const std::filesystem::path& target)
+  {
+    const auto proc_path = std::format("/proc/self/fd/{}", file_fd);
+    const auto link_to = [&](const std::filesystem::path& name)
+    {
+      if (linkat(AT_FDCWD,
+                 proc_path.c_str(),
+                 AT_FDCWD,
+                 name.c_str(),
+                 AT_SYMLINK_FOLLOW)
+          == 0)
+      {
+        return 0;
+      }
+      if (errno != ENOENT) {
+        return errno;
+      }
+      // Without /proc, linking needs CAP_DAC_READ_SEARCH
+      if (linkat(file_fd, "", AT_FDCWD, name.c_str(), AT_EMPTY_PATH) == 0) {
+        return 0;
+      }
+      return errno;
+    };
+    const int link_error = link_to(target);
+    if (link_error == 0) {
+      return;
+    }
+    if (link_error != EEXIST) {
+      errno = link_error;
+      fail("link", target);
+    }
+    const auto temporary = temporary_name_for(target);
+    unlink(temporary.c_str());
+    errno = link_to(temporary);
+    if (errno != 0) {
+      fail("link", temporary);
+    }
+    if (rename(temporary.c_str(), target.c_str()) == -1) {
+      unlink(temporary.c_str());
+      fail("rename", temporary);
+    }
+  }
+
+  void discard()
+  {
+    for (const auto& file : pending) {
+      close(file.fd);
+      if (!file.temporary.empty()) {
+        unlink(file.temporary.c_str());
+      }
+    }
+    pending.clear();
+  }
+
+public:
+  durable_file_batch() = default;
+  durable_file_batch(const durable_file_batch&) = delete;
+  durable_file_batch(durable_file_batch&&) = delete;
+  auto operator=(const durable_file_batch&) -> durable_file_batch& = delete;
+  auto operator=(durable_file_batch&&) -> durable_file_batch& = delete;
+  ~durable_file_batch() { discard(); }
+
+  /**
+  Write the file, which appears at `target` once committed
+  */
+  void add(const std::filesystem::path& target,
+           std::span<const unsigned char> data,
+           mode_t mode = S_IRUSR | S_IWUSR)
+  {
+    const auto directory = directory_of(target);
+    std::filesystem::path temporary {};
+    int file_fd =
+        open(directory.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+    // EISDIR from kernels predating O_TMPFILE
+    if (file_fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+      temporary = temporary_name_for(target);
+      file_fd = open(temporary.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     mode);
+    }
+    if (file_fd == -1) {
+      fail("create file in", directory);
+    }
+    pending.push_back({.fd = file_fd,
+                       .target = target,
+                       .temporary = std::move(temporary)});
+    write_fully(file_fd, data);
+  }
+
+  [[nodiscard]] auto size() const -> std::size_t { return pending.size(); }
+
+  /**
+  Flush all written files and give them their names
+  */
+  void commit()
+  {
+    if (pending.empty()) {
+      return;
+    }
+    if (pending.size() == 1) {
+      if (fdatasync(pending.front().fd) == -1) {
+        fail("flush", pending.front().target);
+      }
+    } else {
+      std::vector<dev_t> synced_devices {};
+      for (const auto& file : pending) {
+        struct stat file_stat {};
+        if (fstat(file.fd, &file_stat) == -1) {
+          fail("flush", file.target);
+        }
+        if (std::ranges::find(synced_devices, file_stat.st_dev)
+            != synced_devices.end())
+        {
+          continue;
+        }
+        if (syncfs(file.fd) == -1) {
+          fail("flush", file.target);
+        }
+        synced_devices.push_back(file_stat.st_dev);
+      }
+    }
+
+    std::vector<std::filesystem::path> directories {};
+    for (const auto& file : pending) {
+      if (file.temporary.empty()) {
+        link_unnamed(file.fd, file.target);
+      } else if (rename(file.temporary.c_str(), file.target.c_str()) == -1) {
+        fail("rename", file.temporary);
+      }
+      auto directory = directory_of(file.target);
+      if (std::ranges::find(directories, directory) == directories.end()) {
+        directories.push_back(std::move(directory));
+      }
+    }
+    for (const auto& file : pending) {
+      close(file.fd);
+    }
+    pending.clear();
+    for (const auto& directory : directories) {
+      flush_directory(directory);
+    }
+  }
+};
+
+/**
+Replace the file with the data once it is on disk, so a crash leaves either
+the old or the new file
+*/
+inline void write_file_durably(const std::filesystem::path& path,
+                               std::span<const unsigned char> data,
+                               mode_t mode = S_IRUSR | S_IWUSR)
+{
+  durable_file_batch batch {};
+  batch.add(path, data, mode);
+  batch.commit();
+}
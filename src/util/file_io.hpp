@@ -0,0 +1,226 @@
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "util/smart_fd.hpp"
+
+/**
+Size of the file behind the descriptor, if it is a regular file
+*/
+inline auto fd_size_hint(int input_fd) -> std::optional<std::uint64_t>
+{
+  struct stat input_stat {};
+  if (fstat(input_fd, &input_stat) == -1 || !S_ISREG(input_stat.st_mode)) {
+    return std::nullopt;
+  }
+  return static_cast<std::uint64_t>(input_stat.st_size);
+}
+
+/**
+Open the file for reading it once from start to end, -1 if it can not be
+opened
+*/
+inline auto open_sequential(const std::filesystem::path& path) -> int
+{
+  const int input_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (input_fd != -1) {
+    // Only a hint for the readahead, failing is harmless
+    posix_fadvise(input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return input_fd;
+}
+
+/**
+Read once into the buffer, retrying when interrupted. Returns the number of
+bytes read, 0 at the end of the file.
+*/
+inline auto read_some(int input_fd, std::span<unsigned char> buffer)
+    -> std::size_t
+{
+  while (true) {
+    const ssize_t bytes_read = read(input_fd, buffer.data(), buffer.size());
+    if (bytes_read >= 0) {
+      return static_cast<std::size_t>(bytes_read);
+    }
+    if (errno != EINTR) {
+      throw std::runtime_error(std::format(
+          "Could not read input; Errno {} [{}]", errno, strerror(errno)));
+    }
+  }
+}
+
+/**
+Fill the buffer, unless the file ends before. Returns the number of bytes read.
+*/
+inline auto read_fully(int input_fd, std::span<unsigned char> buffer)
+    -> std::size_t
+{
+  std::size_t filled = 0;
+  while (filled < buffer.size()) {
+    const auto bytes_read = read_some(input_fd, buffer.subspan(filled));
+    if (bytes_read == 0) {
+      break;
+    }
+    filled += bytes_read;
+  }
+  return filled;
+}
+
+inline void write_fully(int output_fd, std::span<const unsigned char> data)
+{
+  while (!data.empty()) {
+    const ssize_t written = write(output_fd, data.data(), data.size());
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::format(
+          "Could not write output; Errno {} [{}]", errno, strerror(errno)));
+    }
+    data = data.subspan(static_cast<std::size_t>(written));
+  }
+}
+
+/**
+Growth of the buffer when reading something of unknown size
+*/
+constexpr std::size_t unsized_read_step = 64UL * 1024;
+
+/**
+Read the descriptor until its end into a vector-like container.
+
+Regular files are read into a buffer of their size at once, with one spare
+byte to notice the end of the file without growing the buffer again.
+*/
+template<typename Container = std::vector<unsigned char>>
+auto read_fd(int input_fd) -> Container
+{
+  Container contents {};
+  if (const auto size = fd_size_hint(input_fd)) {
+    contents.resize(static_cast<std::size_t>(*size) + 1);
+  }
+  std::size_t filled = 0;
+  while (true) {
+    if (filled == contents.size()) {
+      // Not a regular file, or one which is growing while being read
+      contents.resize(filled + unsized_read_step);
+    }
+    const auto bytes_read =
+        read_some(input_fd, std::span(contents).subspan(filled));
+    if (bytes_read == 0) {
+      break;
+    }
+    filled += bytes_read;
+  }
+  contents.resize(filled);
+  return contents;
+}
+
+/**
+Read the whole file into a vector-like container
+*/
+template<typename Container = std::vector<unsigned char>>
+auto read_file(const std::filesystem::path& path) -> Container
+{
+  const smart_fd input_fd {open_sequential(path)};
+  if (input_fd.fd == -1) {
+    throw std::runtime_error(
+        std::format("Could not open file \"{}\"", path.c_str()));
+  }
+  return read_fd<Container>(input_fd.fd);
+}
+
+/**
+Fill the buffer with the start of the file, which has to be at least as large
+*/
+inline void read_file_start(const std::filesystem::path& path,
+                            std::span<unsigned char> buffer)
+{
+  const smart_fd input_fd {open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (input_fd.fd == -1) {
+    throw std::runtime_error(
+        std::format("Could not open file \"{}\"", path.c_str()));
+  }
+  if (read_fully(input_fd.fd, buffer) != buffer.size()) {
+    throw std::runtime_error(
+        std::format("File \"{}\" is truncated", path.c_str()));
+  }
+}
+
+/**
+Replace the file with the data, creating it with `mode` if it does not exist
+*/
+inline void write_file(const std::filesystem::path& path,
+                       std::span<const unsigned char> data,
+                       mode_t mode = S_IRUSR | S_IWUSR)
+{
+  const smart_fd output_fd {
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)};
+  if (output_fd.fd == -1) {
+    throw std::runtime_error(
+        std::format("Could not open output file \"{}\"", path.c_str()));
+  }
+  write_fully(output_fd.fd, data);
+}
+
+/**
+Read-only mapping of the first `size` bytes of a file, by default advised to
+be read sequentially so the kernel reads ahead and drops pages behind.
+
+Accessing the mapping raises SIGBUS if the file is truncated meanwhile, so
+only map files nobody else is expected to shrink.
+*/
+class mapped_file
+{
+  void* mapping {MAP_FAILED};
+  std::size_t size;
+
+public:
+  mapped_file(int input_fd,
+              std::size_t in_size,
+              int advice = MADV_SEQUENTIAL)
+      : size(in_size)
+  {
+    if (size == 0) {
+      return;
+    }
+    mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error(std::format(
+          "Could not map input; Errno {} [{}]", errno, strerror(errno)));
+    }
+    madvise(mapping, size, advice);
+  }
+  mapped_file(const mapped_file&) = delete;
+  mapped_file(mapped_file&&) = delete;
+  auto operator=(const mapped_file&) -> mapped_file& = delete;
+  auto operator=(mapped_file&&) -> mapped_file& = delete;
+  ~mapped_file()
+  {
+    if (mapping != MAP_FAILED) {
+      munmap(mapping, size);
+    }
+  }
+
+  [[nodiscard]] auto bytes() const -> std::span<const unsigned char>
+  {
+    if (mapping == MAP_FAILED) {
+      return {};
+    }
+    return {static_cast<const unsigned char*>(mapping), size};
+  }
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+/**
+Append the lowest `bytes` bytes of the value, least significant first
+*/
+inline void put_integer(std::vector<unsigned char>& output,
+                        std::uint64_t value,
+                        std::size_t bytes)
+{
+  for (std::size_t byte = 0; byte < bytes; ++byte) {
+    output.push_back(static_cast<unsigned char>(value >> (8U * byte)));
+  }
+}
+
+/**
+Reads what `put_integer` wrote, throwing once reading past the end
+*/
+struct byte_reader
+{
+  std::span<const unsigned char> data;
+
+  auto take(std::size_t size) -> std::span<const unsigned char>
+  {
+    if (data.size() < size) {
+      throw std::runtime_error("Data is truncated");
+    }
+    const auto taken = data.first(size);
+    data = data.subspan(size);
+    return taken;
+  }
+
+  auto integer(std::size_t bytes) -> std::uint64_t
+  {
+    std::uint64_t value = 0;
+    for (std::size_t byte = 0; const unsigned char part : take(bytes)) {
+      value |= std::uint64_t {part} << (8U * byte++);
+    }
+    return value;
+  }
+};
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+Number of threads to use for a configured job count, 0 meaning one per core
+*/
+inline auto resolve_job_count(std::size_t jobs) -> std::size_t
+{
+  if (jobs != 0) {
+    return jobs;
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+/**
+Apply `work` to every item on up to `jobs` threads, handing the results to
+`consume` on the calling thread in the order of the items.
+
+`work` is called as `work(worker, item)`, with `worker` being the index of the
+calling thread below `jobs`, so every worker can keep state of its own. Workers
+run ahead of `consume` by at most twice the number of jobs, which bounds the
+number of results held in memory. `consume` returns whether to continue with
+the next item. An exception thrown by `work` is rethrown on the calling thread
+once `consume` would have been called with its result.
+*/
+template<std::ranges::random_access_range Items,
+         typename Work,
+         typename Consume>
+void ordered_parallel_for_each(const Items& items,
+                               std::size_t jobs,
+                               Work&& work,
+                               Consume&& consume)
+{
+  using result_t =
+      std::invoke_result_t<Work&,
+                           std::size_t,
+                           std::ranges::range_reference_t<const Items>>;
+  const auto item_count = static_cast<std::size_t>(std::ranges::size(items));
+  jobs = std::min(jobs, item_count);
+  if (jobs <= 1) {
+    for (const auto& item : items) {
+      if (!consume(work(std::size_t {0}, item))) {
+        return;
+      }
+    }
+    return;
+  }
+
+  struct slot
+  {
+    std::optional<result_t> result;
+    std::exception_ptr error;
+    bool done {};
+  };
+  const std::size_t window = 2 * jobs;
+  std::vector<slot> slots(window);
+  std::mutex mutex;
+  std::condition_variable slot_done;
+  std::condition_variable slot_freed;
+  std::size_t next_item = 0;
+  std::size_t next_consumed = 0;
+  bool stop = false;
+
+  const auto run_worker = [&](std::size_t worker)
+  {
+    while (true) {
+      std::size_t index {};
+      {
+        std::unique_lock lock {mutex};
+        slot_freed.wait(lock,
+                        [&]()
+                        {
+                          return stop || next_item >= item_count
+                              || next_item < next_consumed + window;
+                        });
+        if (stop || next_item >= item_count) {
+          return;
+        }
+        index = next_item++;
+      }
+      slot finished {};
+      try {
+        finished.result.emplace(work(
+            worker,
+            std::ranges::begin(items)[static_cast<
+                std::ranges::range_difference_t<const Items>>(index)]));
+      } catch (...) {
+        finished.error = std::current_exception();
+      }
+      finished.done = true;
+      {
+        const std::scoped_lock lock {mutex};
+        // The previous item in this slot has been consumed, otherwise the
+        // index would be outside the window
+        slots[index % window] = std::move(finished);
+      }
+      slot_done.notify_one();
+    }
+  };
+  const auto stop_workers = [&]()
+  {
+    {
+      const std::scoped_lock lock {mutex};
+      stop = true;
+    }
+    slot_freed.notify_all();
+  };
+
+  // Declared after the shared state, so the workers are joined before it is
+  // destroyed
+  std::vector<std::jthread> workers;
+  workers.reserve(jobs);
+  try {
+    for (std::size_t worker = 0; worker < jobs; ++worker) {
+      workers.emplace_back(run_worker, worker);
+    }
+    while (next_consumed < item_count) {
+      slot current {};
+      {
+        std::unique_lock lock {mutex};
+        auto& next_slot = slots[next_consumed % window];
+        slot_done.wait(lock, [&next_slot]() { return next_slot.done; });
+        current = std::exchange(next_slot, slot {});
+        ++next_consumed;
+      }
+      slot_freed.notify_all();
+      if (current.error) {
+        std::rethrow_exception(current.error);
+      }
+      if (!consume(std::move(*current.result))) {
+        break;
+      }
+    }
+  } catch (...) {
+    stop_workers();
+    throw;
+  }
+  stop_workers();
+}
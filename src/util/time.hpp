@@ -1,6 +1,18 @@
 #pragma once
+#include <algorithm>
+#include <charconv>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <optional>
 #include <ranges>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 inline auto to_ymd(const std::chrono::utc_clock::time_point& input_time)
     -> std::chrono::year_month_day
@@ -49,3 +61,155 @@ inline auto days_of_year(std::chrono::year year)
              [year](auto day)
              { return std::chrono::year_month_day {day}.year() == year; });
 }
+
+/**
+Length of an ISO 8601 date and time of the form 2025-01-13T15:35:35
+*/
+constexpr std::size_t iso_timestamp_length = 19;
+
+/**
+Parse the date and time at the start of `text`, which has exactly the form
+2025-01-13T15:35:35, anything following it is ignored.
+
+Reads the fixed positions directly instead of going through a stream, which
+matters when parsing the names of many entries.
+*/
+inline auto parse_iso_timestamp(std::string_view text)
+    -> std::optional<std::chrono::sys_seconds>
+{
+  if (text.size() < iso_timestamp_length) {
+    return std::nullopt;
+  }
+  bool valid = true;
+  const auto number = [&text, &valid](std::size_t position, std::size_t digits)
+  {
+    int value = 0;
+    for (std::size_t index = position; index < position + digits; ++index) {
+      const char digit = text[index];
+      valid = valid && digit >= '0' && digit <= '9';
+      value = value * 10 + (digit - '0');
+    }
+    return value;
+  };
+  const auto separator = [&text, &valid](std::size_t position, char expected)
+  { valid = valid && text[position] == expected; };
+
+  const int year = number(0, 4);
+  separator(4, '-');
+  const int month = number(5, 2);
+  separator(7, '-');
+  const int day = number(8, 2);
+  separator(10, 'T');
+  const int hour = number(11, 2);
+  separator(13, ':');
+  const int minute = number(14, 2);
+  separator(16, ':');
+  const int second = number(17, 2);
+
+  const std::chrono::year_month_day date {
+      std::chrono::year {year},
+      std::chrono::month {static_cast<unsigned int>(month)},
+      std::chrono::day {static_cast<unsigned int>(day)}};
+  constexpr int hours_per_day = 24;
+  constexpr int minutes_per_hour = 60;
+  if (!valid || !date.ok() || hour >= hours_per_day
+      || minute >= minutes_per_hour || second >= minutes_per_hour)
+  {
+    return std::nullopt;
+  }
+  return std::chrono::sys_days {date} + std::chrono::hours {hour}
+  + std::chrono::minutes {minute} + std::chrono::seconds {second};
+}
+
+/**
+Closed interval of points in time, unbounded by default
+*/
+struct time_range
+{
+  std::chrono::utc_clock::time_point first {
+      std::chrono::utc_clock::time_point::min()};
+  std::chrono::utc_clock::time_point last {
+      std::chrono::utc_clock::time_point::max()};
+};
+
+/**
+Sort the ranges by their start, merging the ones which overlap and dropping
+empty ones
+*/
+inline auto merge_time_ranges(std::vector<time_range> ranges)
+    -> std::vector<time_range>
+{
+  std::ranges::sort(ranges, {}, &time_range::first);
+  std::vector<time_range> merged;
+  for (const auto& range : ranges) {
+    if (range.first > range.last) {
+      continue;
+    }
+    if (!merged.empty() && range.first <= merged.back().last) {
+      merged.back().last = std::max(merged.back().last, range.last);
+      continue;
+    }
+    merged.push_back(range);
+  }
+  return merged;
+}
+
+/**
+Parts of `items` within any of `ranges`, the items being sorted by the time
+`projection` returns for them.
+
+The parts are in the order of the items and do not overlap, so every item is
+contained at most once. Each range costs a binary search over the items.
+*/
+template<std::ranges::random_access_range Items,
+         typename Projection = std::identity>
+auto slices_within(Items& items,
+                   std::vector<time_range> ranges,
+                   Projection projection = {})
+    -> std::vector<std::ranges::subrange<std::ranges::iterator_t<Items>>>
+{
+  std::vector<std::ranges::subrange<std::ranges::iterator_t<Items>>> slices;
+  auto remaining = std::ranges::begin(items);
+  for (const auto& range : merge_time_ranges(std::move(ranges))) {
+    const auto slice_begin = std::ranges::lower_bound(
+        remaining, std::ranges::end(items), range.first, {}, projection);
+    const auto slice_end = std::ranges::upper_bound(
+        slice_begin, std::ranges::end(items), range.last, {}, projection);
+    if (slice_begin != slice_end) {
+      slices.emplace_back(slice_begin, slice_end);
+    }
+    remaining = slice_end;
+  }
+  return slices;
+}
+
+/**
+Parse a duration given as a count and a unit, like "12h", "3d", "2w", "6m" or
+"1y"
+*/
+inline auto parse_duration(std::string_view text) -> std::chrono::seconds
+{
+  std::int64_t count {};
+  const auto* const text_end = text.data() + text.size();
+  const auto [unit_position, error] =
+      std::from_chars(text.data(), text_end, count);
+  if (error != std::errc {} || unit_position + 1 != text_end) {
+    throw std::invalid_argument(
+        std::format("Invalid duration \"{}\"", text));
+  }
+  switch (*unit_position) {
+    case 'h':
+      return count * std::chrono::seconds {std::chrono::hours {1}};
+    case 'd':
+      return count * std::chrono::seconds {std::chrono::days {1}};
+    case 'w':
+      return count * std::chrono::seconds {std::chrono::weeks {1}};
+    case 'm':
+      return count * std::chrono::seconds {std::chrono::months {1}};
+    case 'y':
+      return count * std::chrono::seconds {std::chrono::years {1}};
+    default:
+      throw std::invalid_argument(
+          std::format("Unknown unit in duration \"{}\"", text));
+  }
+}
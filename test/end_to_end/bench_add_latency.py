@@ -0,0 +1,96 @@
+"""Measure how long `diaria add` takes from the editor closing to returning.
+
+The editor is a script which waits a moment, as a user writing would, and
+records the time right before exiting. Not collected by pytest, run it as
+
+    DIARIA=build/src/cli/diaria python3 test/end_to_end/bench_add_latency.py
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import tempfile
+import time
+from pathlib import Path
+
+
+def write_fake_editor(directory: Path, think_time: float, entry_size: int) -> Path:
+    entry_file = directory / "entry.txt"
+    entry_file.write_text("Dear diary, " * (entry_size // 12 + 1), encoding="utf-8")
+    marker = directory / "editor_closed"
+    script = directory / "editor.sh"
+    script.write_text(
+        "#!/bin/sh\n"
+        f"sleep {think_time}\n"
+        f'cat "{entry_file}" > "$1"\n'
+        f'date +%s.%N > "{marker}"\n',
+        encoding="utf-8",
+    )
+    return script
+
+
+def measure(diaria: Path, args: argparse.Namespace) -> list[float]:
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp_path = Path(tmp)
+        keys = tmp_path / "keys"
+        keys.mkdir()
+        subprocess.run(
+            [str(diaria), "-p", "abc", "--keys", str(keys), "init"],
+            check=True,
+            stdout=subprocess.DEVNULL,
+        )
+        editor = write_fake_editor(tmp_path, args.think_time, args.entry_size)
+        marker = tmp_path / "editor_closed"
+        command = [
+            str(diaria),
+            "--keys",
+            str(keys),
+            "--entries",
+            str(tmp_path / "entries"),
+            "add",
+            "--editor",
+            f"sh {editor} %",
+        ]
+        if args.no_sandbox:
+            command.append("--no-sandbox")
+        if args.verify:
+            command.append("--verify")
+
+        latencies = []
+        for _ in range(args.runs):
+            subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+            returned = time.time()
+            closed = float(marker.read_text(encoding="utf-8"))
+            latencies.append(returned - closed)
+            # Entries are named by the second they were written in
+            time.sleep(1.0)
+        return latencies
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--diaria", type=Path, default=os.environ.get("DIARIA"))
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument(
+        "--think-time",
+        type=float,
+        default=0.5,
+        help="Seconds the editor stays open",
+    )
+    parser.add_argument("--entry-size", type=int, default=4096)
+    parser.add_argument("--no-sandbox", action="store_true")
+    parser.add_argument("--verify", action="store_true")
+    args = parser.parse_args()
+    if args.diaria is None:
+        parser.error('Pass --diaria or set the environment variable "DIARIA"')
+
+    latencies = measure(args.diaria, args)
+    print(f"Editor close to return over {len(latencies)} runs:")
+    print(f"\tmin    {min(latencies) * 1000:8.2f} ms")
+    print(f"\tmedian {statistics.median(latencies) * 1000:8.2f} ms")
+    print(f"\tmax    {max(latencies) * 1000:8.2f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,82 @@
+import os
+import subprocess
+import time
+import uuid
+from pathlib import Path
+from .helper import diaria, key_path
+
+
+def test_agent(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_text = str(uuid.uuid4())
+    entry_file = tmp_path / "plaintext_entry"
+    entry_file.write_text(entry_text, encoding="utf-8")
+    entry_path = tmp_path / "entries"
+    subprocess.run(
+        [
+            diaria,
+            "--keys",
+            key_path,
+            "--entries",
+            entry_path,
+            "--password",
+            "abc",
+            "add",
+            "--input",
+            entry_file,
+        ],
+        check=True,
+    )
+    [diary_file] = list(entry_path.glob("*.diaria"))
+
+    socket_path = tmp_path / "agent" / "agent.sock"
+    agent = subprocess.Popen(
+        [
+            diaria,
+            "--keys",
+            key_path,
+            "--password",
+            "abc",
+            "agent",
+            "--socket",
+            socket_path,
+            "--timeout",
+            "60",
+        ],
+        stdout=subprocess.PIPE,
+        encoding="utf-8",
+    )
+    try:
+        for _ in range(100):
+            if socket_path.exists():
+                break
+            time.sleep(0.1)
+        assert socket_path.exists()
+
+        # The agent opens the entry, so the wrong password is never used
+        read_output = subprocess.run(
+            [
+                diaria,
+                "--keys",
+                key_path,
+                "--password",
+                "wrong",
+                "read",
+                diary_file,
+            ],
+            check=True,
+            stdout=subprocess.PIPE,
+            encoding="utf-8",
+            env={**os.environ, "DIARIA_AGENT_SOCK": str(socket_path)},
+        ).stdout
+        assert read_output.strip() == entry_text
+    finally:
+        agent.terminate()
+        agent.wait(timeout=10)
+    assert not socket_path.exists()
+
+    # Without the agent the password is needed again
+    failed_read = subprocess.run(
+        [diaria, "--keys", key_path, "--password", "wrong", "read", diary_file],
+        env={**os.environ, "DIARIA_AGENT_SOCK": str(socket_path)},
+    )
+    assert failed_read.returncode != 0
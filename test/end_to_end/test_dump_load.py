@@ -51,3 +51,57 @@ def test_load_dump(diaria: Path, key_path: Path, tmp_path: Path):
             dump_1_path / x.with_suffix("").name, "r", encoding="utf-8"
         ) as source:
             assert sink.read() == source.read()
+
+
+def test_time_range(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    dump_path = tmp_path / "dump"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+    for day in range(1, 6):
+        entry_file = tmp_path / f"plaintext_entry_{day}"
+        with open(entry_file, "w", encoding="utf-8") as f:
+            f.write(f"--{day}--")
+        subprocess.run(
+            [
+                *diaria_cmd_base,
+                "add",
+                "--input",
+                entry_file,
+                "--output",
+                entry_path / f"2024-01-0{day}T12:00:00.diaria",
+            ],
+            check=True,
+        )
+
+    subprocess.run(
+        [
+            *diaria_cmd_base,
+            "dump",
+            "--since",
+            "2024-01-02",
+            "--until",
+            "2024-01-03",
+            dump_path,
+        ],
+        check=True,
+    )
+    assert sorted(x.name for x in dump_path.iterdir()) == [
+        "2024-01-02T12:00:00.txt",
+        "2024-01-03T12:00:00.txt",
+    ]
+
+    read_output = subprocess.run(
+        [*diaria_cmd_base, "read", "--since", "2024-01-04T00:00:00"],
+        check=True,
+        stdout=subprocess.PIPE,
+        encoding="utf-8",
+    ).stdout
+    assert read_output.split() == ["--4--", "--5--"]
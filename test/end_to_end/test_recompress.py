@@ -0,0 +1,64 @@
+import random
+import subprocess
+from pathlib import Path
+from .helper import diaria, key_path
+
+
+def test_recompress(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+
+    def run(*args: str | Path) -> str:
+        return subprocess.run(
+            [*diaria_cmd_base, *args],
+            check=True,
+            stdout=subprocess.PIPE,
+            encoding="utf-8",
+        ).stdout
+
+    words = ["dear", "diary", "today", "walked", "the", "dog", "rain", "again"]
+    rng = random.Random(4)
+    texts = {}
+
+    def add_entry(name: str):
+        text = " ".join(rng.choice(words) for _ in range(4000))
+        texts[name] = text
+        entry_file = tmp_path / f"plaintext_{name}"
+        entry_file.write_text(text, encoding="utf-8")
+        run(
+            "--compression_preset",
+            "0",
+            "add",
+            "--input",
+            entry_file,
+            "--output",
+            entry_path / f"{name}.diaria",
+        )
+
+    add_entry("2020-03-01T12:00:00")
+    add_entry("2020-03-02T12:00:00")
+    run("repack", "--older_than", "1m")
+    # Two entries packed, the other one in a file of its own
+    add_entry("2019-03-01T12:00:00")
+
+    output = run("-j", "2", "recompress", "--older_than", "1m")
+    assert "of 3 entries" in output
+    assert (entry_path / ".index" / "recompressed").is_file()
+
+    read_output = run("read", "--since", "2019-01-01", "--until", "2020-12-31")
+    assert read_output.split("\n")[:3] == [
+        texts["2019-03-01T12:00:00"],
+        texts["2020-03-01T12:00:00"],
+        texts["2020-03-02T12:00:00"],
+    ]
+
+    # Continues after the entries recompressed before
+    assert "of 0 entries" in run("recompress", "--older_than", "1m")
@@ -0,0 +1,65 @@
+import subprocess
+from pathlib import Path
+from .helper import diaria, key_path
+
+
+def test_repack(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+
+    def run(*args: str | Path) -> str:
+        return subprocess.run(
+            [*diaria_cmd_base, *args],
+            check=True,
+            stdout=subprocess.PIPE,
+            encoding="utf-8",
+        ).stdout
+
+    for day in range(1, 6):
+        entry_file = tmp_path / f"plaintext_entry_{day}"
+        with open(entry_file, "w", encoding="utf-8") as f:
+            f.write(f"--{day}--")
+        run(
+            "add",
+            "--input",
+            entry_file,
+            "--output",
+            entry_path / f"2024-01-0{day}T12:00:00.diaria",
+        )
+    entry_file = tmp_path / "plaintext_entry_new"
+    with open(entry_file, "w", encoding="utf-8") as f:
+        f.write("--new--")
+    run("add", "--input", entry_file)
+    assert "2024" in run("stats")
+    packed_copy = (entry_path / "2024-01-02T12:00:00.diaria").read_bytes()
+
+    # Packs smaller than an entry take one entry each
+    assert "Packed 5 entries into 5 packs" in run(
+        "repack", "--older_than", "1m", "--pack_size", "2"
+    )
+    assert len(list((entry_path / "packs").iterdir())) == 5
+    assert len(list(entry_path.glob("*.diaria"))) == 1
+    assert "Packed 0 entries" in run("repack", "--older_than", "1m")
+
+    read_output = run("read", "--since", "2024-01-04T00:00:00")
+    assert read_output.split() == ["--4--", "--5--", "--new--"]
+
+    # Left behind by a repack interrupted before removing the packed files
+    (entry_path / "2024-01-02T12:00:00.diaria").write_bytes(packed_copy)
+
+    dump_path = tmp_path / "dump"
+    run("dump", dump_path)
+    assert len(list(dump_path.iterdir())) == 6
+    assert (dump_path / "2024-01-02T12:00:00.txt").read_text(
+        encoding="utf-8"
+    ) == "--2--"
+    stats_output = run("stats")
+    assert "2024" in stats_output
@@ -0,0 +1,94 @@
+import subprocess
+from pathlib import Path
+from .helper import diaria, key_path
+import datetime
+import fcntl
+import time
+
+
+def test_repo_index(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+
+    def add_entry(i: int, output: list[Path | str]):
+        entry_file = tmp_path / f"plaintext_entry_{i}"
+        with open(entry_file, "w", encoding="utf-8") as f:
+            f.write(f"--{i}--")
+        subprocess.run(
+            [*diaria_cmd_base, "add", "--input", entry_file, *output],
+            check=True,
+        )
+
+    def stats() -> str:
+        return subprocess.run(
+            [*diaria_cmd_base, "stats"],
+            check=True,
+            stdout=subprocess.PIPE,
+            encoding="utf-8",
+        ).stdout
+
+    old_entry = entry_path / f"{datetime.datetime(1931, 5, 2).isoformat()}.diaria"
+    add_entry(0, ["--output", old_entry])
+    add_entry(
+        1, ["--output", entry_path / f"{datetime.datetime(2020, 8, 7).isoformat()}.diaria"]
+    )
+
+    stats_output = stats()
+    assert "1931" in stats_output
+    assert "2020" in stats_output
+    index_file = entry_path / ".index" / "entries.sym"
+    assert index_file.is_file()
+
+    # Added to the existing index
+    add_entry(2, [])
+    assert str(datetime.date.today().year) in stats()
+
+    # Rebuilt once the repository changes behind its back
+    old_entry.unlink()
+    assert "1931" not in stats()
+
+    # Rebuilt if it cannot be read
+    index_file.write_bytes(b"not an index")
+    stats_output = stats()
+    assert "2020" in stats_output
+    assert "1931" not in stats_output
+
+
+def test_repo_index_lock(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+    entry_file = tmp_path / "plaintext_entry"
+    entry_file.write_text("--0--", encoding="utf-8")
+    subprocess.run([*diaria_cmd_base, "add", "--input", entry_file], check=True)
+    subprocess.run([*diaria_cmd_base, "stats"], check=True)
+
+    # Writers wait for the one holding the index lock
+    with open(entry_path / ".index" / "lock", "w") as lock:
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        writer = subprocess.Popen(
+            [*diaria_cmd_base, "add", "--input", entry_file],
+            stderr=subprocess.PIPE,
+            encoding="utf-8",
+        )
+        time.sleep(1)
+        assert writer.poll() is None
+        fcntl.flock(lock, fcntl.LOCK_UN)
+    _, errors = writer.communicate(timeout=60)
+    assert writer.returncode == 0
+    assert "Waiting" in errors
@@ -0,0 +1,125 @@
+import subprocess
+from pathlib import Path
+from .helper import diaria, key_path
+from .test_git_sync import repo_init_1, repo_init_2, repo_init_bare
+import datetime
+
+
+def test_sharded_repo(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+
+    def add_entry(i: int, output: list[Path | str]):
+        entry_file = tmp_path / f"plaintext_entry_{i}"
+        with open(entry_file, "w", encoding="utf-8") as f:
+            f.write(f"--{i}--")
+        subprocess.run(
+            [*diaria_cmd_base, "add", "--input", entry_file, *output],
+            check=True,
+        )
+
+    def run(*args: str | Path) -> str:
+        return subprocess.run(
+            [*diaria_cmd_base, *args],
+            check=True,
+            stdout=subprocess.PIPE,
+            encoding="utf-8",
+        ).stdout
+
+    old_name = f"{datetime.datetime(1931, 5, 2).isoformat()}.diaria"
+    newer_name = f"{datetime.datetime(2020, 8, 7).isoformat()}.diaria"
+    add_entry(0, ["--output", entry_path / old_name])
+    add_entry(1, ["--output", entry_path / newer_name])
+    assert "1931" in run("stats")
+
+    # Partially migrated repositories list entries from both places
+    assert "1 left to move" in run("migrate", "--limit", "1")
+    assert (entry_path / "1931" / "05" / old_name).is_file()
+    assert (entry_path / newer_name).is_file()
+    stats_output = run("stats")
+    assert "1931" in stats_output
+    assert "2020" in stats_output
+
+    assert "0 left to move" in run("migrate")
+    assert (entry_path / "2020" / "08" / newer_name).is_file()
+    assert not list(entry_path.glob("*.diaria"))
+
+    # New entries go into their shard
+    add_entry(2, [])
+    today = datetime.date.today()
+    shard = entry_path / f"{today.year:04}" / f"{today.month:02}"
+    assert len(list(shard.glob("*.diaria"))) == 1
+    assert str(today.year) in run("stats")
+
+    stats_output = run("stats", "--year", "2020")
+    assert "2020" in stats_output
+    assert "1931" not in stats_output
+
+    dump_path = tmp_path / "dump"
+    run("dump", dump_path)
+    assert len(list(dump_path.iterdir())) == 3
+    run("dump", dump_path / "ranged", "--since", "2020-01-01", "--until", "2020-12-31")
+    assert [x.name for x in (dump_path / "ranged").iterdir()] == [
+        newer_name.replace(".diaria", ".txt")
+    ]
+
+    # Entries not named by their timestamp are dumped from the shards as well,
+    # files in hidden directories are not
+    add_entry(3, ["--output", entry_path / "2020" / "08" / "notes.diaria"])
+    (entry_path / ".hidden").mkdir()
+    (entry_path / ".hidden" / "garbage.diaria").write_bytes(b"not an entry")
+    run("dump", dump_path / "all")
+    assert (dump_path / "all" / "notes.txt").read_text(encoding="utf-8") == "--3--"
+    assert len(list((dump_path / "all").iterdir())) == 4
+
+
+def test_sharded_repo_sync(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_1_path = tmp_path / "entries1"
+    entry_2_path = tmp_path / "entries2"
+    entry_bare_path = tmp_path / "entries_bare"
+    for p in [entry_1_path, entry_2_path, entry_bare_path]:
+        p.mkdir()
+    repo_init_bare(entry_bare_path)
+    repo_init_1(entry_1_path, entry_bare_path)
+    repo_init_2(entry_2_path, entry_bare_path)
+
+    def run(entry_path: Path, *args: str | Path):
+        subprocess.run(
+            [
+                diaria,
+                "--keys",
+                key_path,
+                "--entries",
+                entry_path.absolute(),
+                "--password",
+                "abc",
+                *args,
+            ],
+            check=True,
+        )
+
+    entry_file = tmp_path / "plaintext_entry"
+    with open(entry_file, "w", encoding="utf-8") as f:
+        f.write("--0--")
+    old_name = f"{datetime.datetime(1931, 5, 2).isoformat()}.diaria"
+    run(entry_1_path, "add", "--input", entry_file, "--output", entry_1_path / old_name)
+    run(entry_1_path, "migrate")
+    run(entry_1_path, "sync")
+    run(entry_2_path, "sync")
+
+    # The other clone stores its new entries in shards as well
+    assert (entry_2_path / "1931" / "05" / old_name).is_file()
+    assert (entry_2_path / ".sharded").is_file()
+    run(entry_2_path, "add", "--input", entry_file)
+    assert not list(entry_2_path.glob("*.diaria"))
+    today = datetime.date.today()
+    shard = entry_2_path / f"{today.year:04}" / f"{today.month:02}"
+    assert len(list(shard.glob("*.diaria"))) == 1
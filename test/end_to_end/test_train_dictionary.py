@@ -0,0 +1,56 @@
+import subprocess
+from pathlib import Path
+from .helper import diaria, key_path
+import datetime
+
+
+def test_train_dictionary(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_path = tmp_path / "entries"
+    dump_path = tmp_path / "dump"
+    diaria_cmd_base: list[Path | str] = [
+        diaria,
+        "--keys",
+        key_path,
+        "--entries",
+        entry_path,
+        "--password",
+        "abc",
+    ]
+
+    def add_entry(i: int, text: str):
+        timestamp = (
+            (datetime.datetime(2024, 1, 1) + datetime.timedelta(days=i))
+            .replace(microsecond=0)
+            .isoformat()
+        )
+        entry_file = tmp_path / f"plaintext_entry_{i}"
+        with open(entry_file, "w", encoding="utf-8") as f:
+            f.write(text)
+        subprocess.run(
+            [
+                *diaria_cmd_base,
+                "add",
+                "--input",
+                entry_file,
+                "--output",
+                entry_path / f"{timestamp}.diaria",
+            ],
+            check=True,
+        )
+
+    texts = [f"Dear diary,\nToday was day {i}.\nMood: fine\n" for i in range(10)]
+    for i, text in enumerate(texts[:5]):
+        add_entry(i, text)
+
+    subprocess.run([*diaria_cmd_base, "train"], check=True)
+    assert (key_path / "dict.sym").is_file()
+    assert len(list((key_path / "dictionaries").iterdir())) == 1
+
+    for i, text in enumerate(texts[5:], start=5):
+        add_entry(i, text)
+
+    subprocess.run([*diaria_cmd_base, "dump", dump_path], check=True)
+    dumped = sorted(dump_path.iterdir())
+    assert len(dumped) == len(texts)
+    for dumped_entry, text in zip(dumped, texts):
+        assert dumped_entry.read_text(encoding="utf-8") == text
@@ -71,6 +71,83 @@ def test_write_read_interactive_unsandboxed(
     diaria_check_entry(diaria_cmd_base, diary_file.absolute(), entry_text)
 
 
+def test_write_read_cipher(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_text = str(uuid.uuid4())
+    entry_file = tmp_path / "plaintext_entry"
+    with open(entry_file, "w", encoding="utf-8") as f:
+        f.write(entry_text)
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base = generate_cmd_base(diaria, key_path, entry_path)
+
+    # Picks whatever this machine supports, so it can always be read back here
+    subprocess.run(
+        [
+            *diaria_cmd_base,
+            "--cipher",
+            "auto",
+            "add",
+            "--input",
+            entry_file,
+        ],
+        check=True,
+    )
+    [diary_file] = list(entry_path.iterdir())
+    diaria_check_entry(diaria_cmd_base, diary_file.absolute(), entry_text)
+
+
+def test_write_read_verified(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_text = str(uuid.uuid4())
+    entry_file = tmp_path / "plaintext_entry"
+    with open(entry_file, "w", encoding="utf-8") as f:
+        f.write(entry_text)
+    entry_path = tmp_path / "entries"
+    diaria_cmd_base = generate_cmd_base(diaria, key_path, entry_path)
+
+    subprocess.run(
+        [
+            *diaria_cmd_base,
+            "add",
+            "--verify",
+            "--input",
+            entry_file,
+        ],
+        check=True,
+    )
+    [diary_file] = list(entry_path.iterdir())
+    diaria_check_entry(diaria_cmd_base, diary_file.absolute(), entry_text)
+
+
+def test_write_read_threaded(diaria: Path, key_path: Path, tmp_path: Path):
+    entry_text = "\n".join(str(uuid.uuid4()) for _ in range(20000))
+    entry_file = tmp_path / "plaintext_entry"
+    with open(entry_file, "w", encoding="utf-8") as f:
+        f.write(entry_text)
+    entry_path = tmp_path / "entries"
+    # Entries above the threshold are compressed and decompressed in blocks
+    diaria_cmd_base = [
+        *generate_cmd_base(diaria, key_path, entry_path),
+        "--threaded_compression_above",
+        "1024",
+        "--compression_threads",
+        "2",
+        "--compression_block_size",
+        "65536",
+    ]
+
+    subprocess.run(
+        [
+            *diaria_cmd_base,
+            "add",
+            "--input",
+            entry_file,
+        ],
+        check=True,
+    )
+    [diary_file] = list(entry_path.iterdir())
+    assert diary_file.stat().st_size > 1024
+    diaria_check_entry(diaria_cmd_base, diary_file.absolute(), entry_text)
+
+
 def diaria_check_entry(cmd_base: list[Path | str], entry_file: Path, entry_text: str):
     read_output = subprocess.run(
         [
@@ -0,0 +1,48 @@
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include <sodium/randombytes.h>
+
+#include "crypto/entry.hpp"
+#include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
+
+// Benchmarks are hidden, run them with `unit_tests "[!benchmark]"`
+
+TEST_CASE("Stream cipher throughput per entry", "[!benchmark]")
+{
+  const auto entry_size = GENERATE(std::size_t {1'000},
+                                   std::size_t {100'000},
+                                   std::size_t {10'000'000});
+  const auto cipher = GENERATE(stream_cipher::xchacha20poly1305,
+                               stream_cipher::aes256gcm);
+  if (cipher == stream_cipher::aes256gcm && !aes256gcm_available()) {
+    SKIP("CPU has no AES instructions");
+  }
+  const std::string name =
+      cipher == stream_cipher::aes256gcm ? "aes256gcm" : "xchacha20";
+
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+  // Random data does not compress, so the ciphers dominate
+  std::vector<unsigned char> entry(entry_size);
+  randombytes_buf(entry.data(), entry.size());
+  compression_context context {{.codec = compression_codec::none}};
+  const auto encrypted = encrypt(
+      symkey_span_t {symkey}, public_key_span_t {pk}, context, entry, cipher);
+
+  BENCHMARK("encrypt, " + name + ", " + std::to_string(entry_size) + " bytes")
+  {
+    return encrypt(
+        symkey_span_t {symkey}, public_key_span_t {pk}, context, entry, cipher);
+  };
+  BENCHMARK("decrypt, " + name + ", " + std::to_string(entry_size) + " bytes")
+  {
+    return decrypt(
+        symkey_span_t {symkey}, private_key_span_t {sk}, context, encrypted);
+  };
+}
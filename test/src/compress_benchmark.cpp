@@ -0,0 +1,98 @@
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include "crypto/compress.hpp"
+
+// Benchmarks are hidden, run them with `unit_tests "[!benchmark]"`
+
+namespace
+{
+/**
+Text resembling a diary entry, so the compressor has something to work with
+*/
+auto make_entry_text(std::size_t size) -> std::vector<unsigned char>
+{
+  constexpr std::array<std::string_view, 8> words = {"today ",
+                                                     "we ",
+                                                     "walked ",
+                                                     "along ",
+                                                     "the ",
+                                                     "river ",
+                                                     "and ",
+                                                     "talked. "};
+  std::vector<unsigned char> text {};
+  text.reserve(size);
+  for (std::size_t index = 0; text.size() < size;
+       index = (index * 5 + 3) % words.size())
+  {
+    const auto word = words.at(index);
+    text.insert(text.end(), word.begin(), word.end());
+  }
+  text.resize(size);
+  return text;
+}
+}  // namespace
+
+TEST_CASE("Compression throughput per entry", "[!benchmark]")
+{
+  const auto entry_size =
+      GENERATE(std::size_t {1'000}, std::size_t {10'000}, std::size_t {100'000});
+  const auto entry = make_entry_text(entry_size);
+  const auto compressed = compress(entry);
+
+  compression_context context {};
+  BENCHMARK("compress, fresh stream, " + std::to_string(entry_size) + " bytes")
+  {
+    return compress(entry);
+  };
+  BENCHMARK("compress, reused context, " + std::to_string(entry_size)
+            + " bytes")
+  {
+    return context.compress(entry);
+  };
+  BENCHMARK("decompress, fresh stream, " + std::to_string(entry_size)
+            + " bytes")
+  {
+    return decompress(compressed);
+  };
+  BENCHMARK("decompress, reused context, " + std::to_string(entry_size)
+            + " bytes")
+  {
+    return context.decompress(compressed);
+  };
+}
+
+TEST_CASE("Compression throughput of large entries", "[!benchmark]")
+{
+  constexpr std::size_t entry_size = 32UL * 1024 * 1024;
+  const auto entry = make_entry_text(entry_size);
+
+  compression_context single {{.threaded_threshold = 0}};
+  compression_context threaded {{.threaded_threshold = 1}};
+  const auto single_compressed = single.compress(entry);
+  const auto threaded_compressed = threaded.compress(entry);
+
+  BENCHMARK("compress, single thread")
+  {
+    return single.compress(entry);
+  };
+  BENCHMARK("compress, threaded")
+  {
+    return threaded.compress(entry);
+  };
+  BENCHMARK("decompress, single block")
+  {
+    return threaded.decompress(single_compressed);
+  };
+  BENCHMARK("decompress, threaded blocks")
+  {
+    return threaded.decompress(threaded_compressed);
+  };
+}
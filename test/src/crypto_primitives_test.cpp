@@ -1,15 +1,18 @@
 #include <algorithm>
 #include <iterator>
 #include <numeric>
+#include <string_view>
 #include <vector>
 
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 #include <catch2/matchers/catch_matchers.hpp>
 #include <catch2/matchers/catch_matchers_vector.hpp>
 
 #include "crypto/compress.hpp"
 #include "crypto/entry.hpp"
 #include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
 #include "util/char.hpp"
 using namespace std::literals;
 
@@ -24,6 +27,10 @@ TEST_CASE("Symmetric key encryption and decryption")
   auto enc = symenc(symkey_span_t {symkey}, important_data_span);
   auto dec = symdec(symkey_span_t {symkey}, enc);
   REQUIRE_THAT(dec, equals_range(important_data_span));
+
+  // Truncated files, like an index cut short by a crash
+  REQUIRE_THROWS(symdec(symkey_span_t {symkey}, std::span(enc).first(12)));
+  REQUIRE_THROWS(symdec(symkey_span_t {symkey}, {}));
 }
 
 TEST_CASE("Small compression and decompression")
@@ -54,6 +61,73 @@ TEST_CASE("Large compression and decompression")
   REQUIRE_THAT(decompressed, equals_range(input));
 }
 
+TEST_CASE("Compression with configured encoder settings")
+{
+  std::vector<unsigned char> input;
+  constexpr int input_size = 100'000;
+  input.resize(input_size);
+  std::ranges::iota(input, 0);
+
+  auto options = GENERATE(
+      compression_options {},
+      compression_options {.preset = 0},
+      compression_options {.preset = 9, .adaptive = false},
+      compression_options {.extreme_threshold = 1},
+      compression_options {.preset = 3, .extreme_threshold = 1'000'000},
+      compression_options {
+          .threaded_threshold = 1, .threads = 2, .block_size = 16'384});
+  compression_context context {options};
+
+  auto compressed = context.compress(input);
+  auto decompressed = decompress(compressed);
+  REQUIRE_THAT(decompressed, equals_range(input));
+}
+
+TEST_CASE("Threaded compression and decompression")
+{
+  std::vector<unsigned char> input;
+  constexpr int input_size = 300'000;
+  input.resize(input_size);
+  std::ranges::iota(input, 0);
+
+  compression_context threaded {
+      {.threaded_threshold = 1, .threads = 4, .block_size = 65'536}};
+  auto compressed = threaded.compress(input);
+  // Several blocks make this a standard .xz stream still readable as usual
+  REQUIRE(xz_uncompressed_size(compressed) == input_size);
+  REQUIRE_THAT(decompress(compressed), equals_range(input));
+  REQUIRE_THAT(threaded.decompress(compressed), equals_range(input));
+
+  safe_vector<unsigned char> streamed {};
+  container_sink sink {streamed};
+  const auto decompression = threaded.make_decompress_sink(
+      sink, compression_codec::xz, std::nullopt, compressed.size());
+  decompression->write(compressed);
+  decompression->finish();
+  REQUIRE_THAT(streamed, equals_range(input));
+}
+
+TEST_CASE("Compression with every codec")
+{
+  std::vector<unsigned char> input;
+  constexpr int input_size = 200'000;
+  input.resize(input_size);
+  std::ranges::iota(input, 0);
+
+  auto codec = GENERATE(compression_codec::none,
+                        compression_codec::xz,
+                        compression_codec::zstd,
+                        compression_codec::lz4);
+  if (!codec_available(codec)) {
+    SKIP("Codec not enabled in this build");
+  }
+  compression_context context {{.codec = codec}};
+
+  auto compressed = context.compress(input);
+  auto decompressed = context.decompress(compressed, codec);
+  REQUIRE_THAT(decompressed, equals_range(input));
+}
+
 TEST_CASE("Asymmetric key encryption and decryption")
 {
   auto [pk, sk] = generate_keypair();
@@ -66,6 +140,53 @@ TEST_CASE("Asymmetric key encryption and decryption")
   REQUIRE_THAT(dec, equals_range(important_data_span));
 }
 
+TEST_CASE("Symmetric and asymmetric decryption in place")
+{
+  auto symkey = generate_symkey();
+  auto [pk, sk] = generate_keypair();
+  const private_key_opener opener {private_key_span_t {sk}};
+
+  auto important_data = "This is a secret message"sv;
+  auto important_data_span = std::span<const unsigned char>(
+      make_unsigned_char(important_data.data()), important_data.size());
+  auto enc = symenc(symkey_span_t {symkey},
+                    asymenc(public_key_span_t {pk}, important_data_span));
+  const auto dec =
+      opener.open_in_place(symdec_in_place(symkey_span_t {symkey}, enc));
+  REQUIRE_THAT(dec, equals_range(important_data_span));
+
+  auto tampered = symenc(symkey_span_t {symkey}, important_data_span);
+  tampered.back() ^= 1U;
+  REQUIRE_THROWS(symdec_in_place(symkey_span_t {symkey}, tampered));
+}
+
+TEST_CASE("Size of xz streams is read from their index")
+{
+  std::vector<unsigned char> input(100'000);
+  std::iota(input.begin(), input.end(), 0);
+  auto compressed = compress(input);
+  REQUIRE(xz_uncompressed_size(compressed) == input.size());
+  REQUIRE_THAT(decompress(compressed), equals_range(input));
+
+  compressed.push_back(0);
+  REQUIRE_FALSE(xz_uncompressed_size(compressed).has_value());
+}
+
+TEST_CASE("Private key opener")
+{
+  auto [pk, sk] = generate_keypair();
+  const private_key_opener opener {private_key_span_t {sk}};
+  REQUIRE_THAT(opener.get_public_key(), equals_range(pk));
+
+  auto important_data = "This is a secret message"sv;
+  auto important_data_span = std::span<const unsigned char>(
+      make_unsigned_char(important_data.data()), important_data.size());
+  for (int box = 0; box < 3; ++box) {
+    auto enc = asymenc(public_key_span_t {pk}, important_data_span);
+    REQUIRE_THAT(opener.open(enc), equals_range(important_data_span));
+  }
+}
+
 TEST_CASE("Entry encryption and decryption")
 {
   auto [pk, sk] = generate_keypair();
@@ -79,3 +200,26 @@ TEST_CASE("Entry encryption and decryption")
   auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
   REQUIRE_THAT(dec, equals_range(important_data_span));
 }
+
+TEST_CASE("Dictionaries prefer lines shared between entries")
+{
+  auto to_sample = [](std::string_view text)
+  {
+    return safe_vector<unsigned char>(make_unsigned_char(text.data()),
+                                      make_unsigned_char(text.data())
+                                          + text.size());
+  };
+  const std::vector samples = {to_sample("Dear diary,\nfirst entry\n"),
+                               to_sample("Dear diary,\nsecond entry\n"),
+                               to_sample("Dear diary,\nthird entry\n")};
+
+  constexpr std::size_t max_size = 24;
+  auto dictionary = train_dictionary(samples, max_size);
+  REQUIRE(dictionary.size() <= max_size);
+  const std::string_view dictionary_text {make_signed_char(dictionary.data()),
+                                          dictionary.size()};
+  REQUIRE(dictionary_text.ends_with("Dear diary,\n"));
+  // Text of a single entry is never copied into the dictionary
+  REQUIRE_FALSE(dictionary_text.contains("entry"));
+  REQUIRE(train_dictionary(std::span(samples).first(2), max_size).empty());
+}
@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <span>
+#include <utility>
+#include <vector>
+
 #include "crypto/entry.hpp"
 
 #include <catch2/catch_test_macros.hpp>
+#include <sodium/randombytes.h>
 
+#include "crypto/compress.hpp"
 #include "crypto/secret_key.hpp"
+#include "crypto/stream.hpp"
 #include "util.hpp"
 #include "util/char.hpp"
 
@@ -19,4 +27,206 @@ TEST_CASE("Check that entry gets recorded and can be decrypted")
       symkey_span_t {symkey}, public_key_span_t {pk}, important_data_span);
   auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
   REQUIRE_THAT(dec, equals_range(important_data_span));
-}
\ No newline at end of file
+}
+
+TEST_CASE("Entries spanning several stream chunks")
+{
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+
+  std::vector<unsigned char> important_data(3 * stream_chunk_size + 17);
+  randombytes_buf(important_data.data(), important_data.size());
+
+  auto enc =
+      encrypt(symkey_span_t {symkey}, public_key_span_t {pk}, important_data);
+  REQUIRE(enc[magictag.size()] == current_diaria_version);
+
+  SECTION("decrypting at once")
+  {
+    auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
+    REQUIRE_THAT(dec, equals_range(important_data));
+  }
+  SECTION("decrypting in odd pieces")
+  {
+    safe_vector<unsigned char> dec {};
+    container_sink sink {dec};
+    compression_context context {};
+    const private_key_opener opener {private_key_span_t {sk}};
+    entry_decrypt_sink decryption {
+        symkey_span_t {symkey}, opener, context, sink};
+    constexpr std::size_t piece_size = 1000;
+    for (auto left = std::span<const unsigned char>(enc); !left.empty();) {
+      const auto piece = left.first(std::min(piece_size, left.size()));
+      decryption.write(piece);
+      left = left.subspan(piece.size());
+    }
+    decryption.finish();
+    REQUIRE_THAT(dec, equals_range(important_data));
+  }
+  SECTION("truncated entries are rejected")
+  {
+    enc.resize(enc.size() - 1);
+    REQUIRE_THROWS(
+        decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc));
+  }
+}
+
+TEST_CASE("Entries of version 0 can still be decrypted")
+{
+  using namespace std::literals;
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+
+  auto important_data = "This is a secret message"sv;
+  auto important_data_span = std::span<const unsigned char>(
+      make_unsigned_char(important_data.data()), important_data.size());
+
+  auto enc =
+      symenc(symkey_span_t {symkey},
+             asymenc(public_key_span_t {pk}, compress(important_data_span)));
+  enc.insert(enc.begin(), 0);
+  enc.insert(enc.begin(), magictag.begin(), magictag.end());
+
+  auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
+  REQUIRE_THAT(dec, equals_range(important_data_span));
+
+  // The output is sized from the index of the .xz stream
+  struct reserving_sink final : byte_sink
+  {
+    safe_vector<unsigned char> data;
+    std::size_t reserved {};
+    void write(std::span<const unsigned char> written) override
+    {
+      data.insert(data.end(), written.begin(), written.end());
+    }
+    void finish() override {}
+    void reserve(std::size_t size) override { reserved += size; }
+  };
+  reserving_sink sink {};
+  compression_context context {};
+  const private_key_opener opener {private_key_span_t {sk}};
+  entry_decrypt_sink decryption {
+      symkey_span_t {symkey}, opener, context, sink, enc.size()};
+  decryption.write(enc);
+  decryption.finish();
+  REQUIRE(sink.reserved == important_data.size());
+  REQUIRE_THAT(sink.data, equals_range(important_data_span));
+}
+
+TEST_CASE("Entries compressed with a dictionary")
+{
+  using namespace std::literals;
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+
+  auto dictionary_text = "Dear diary,\nToday I went for a walk.\n"sv;
+  compression_dictionary dictionary {};
+  randombytes_buf(dictionary.id.data(), dictionary.id.size());
+  dictionary.content.assign(
+      make_unsigned_char(dictionary_text.data()),
+      make_unsigned_char(dictionary_text.data()) + dictionary_text.size());
+
+  auto important_data = "Dear diary,\nToday I went for a run.\n"sv;
+  auto important_data_span = std::span<const unsigned char>(
+      make_unsigned_char(important_data.data()), important_data.size());
+
+  compression_context encryption_context {};
+  encryption_context.add_dictionary(
+      {.id = dictionary.id, .content = dictionary.content});
+  encryption_context.use_dictionary(dictionary.id);
+  auto enc = encrypt(symkey_span_t {symkey},
+                     public_key_span_t {pk},
+                     encryption_context,
+                     important_data_span);
+  REQUIRE(std::ranges::equal(
+      std::span(enc).subspan(entry_dictionary_offset, dictionary.id.size()),
+      dictionary.id));
+
+  SECTION("decrypting with the dictionary")
+  {
+    compression_context context {};
+    context.add_dictionary(std::move(dictionary));
+    auto dec = decrypt(
+        symkey_span_t {symkey}, private_key_span_t {sk}, context, enc);
+    REQUIRE_THAT(dec, equals_range(important_data_span));
+  }
+  SECTION("decrypting without the dictionary")
+  {
+    REQUIRE_THROWS(
+        decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc));
+  }
+  SECTION("the dictionary id is authenticated")
+  {
+    // Pointing the header to another known dictionary must not go unnoticed
+    auto other_id = dictionary.id;
+    other_id[0] ^= 1U;
+    compression_context context {};
+    context.add_dictionary({.id = other_id, .content = dictionary.content});
+    std::ranges::copy(other_id, enc.begin() + entry_dictionary_offset);
+    REQUIRE_THROWS(decrypt(
+        symkey_span_t {symkey}, private_key_span_t {sk}, context, enc));
+  }
+}
+
+TEST_CASE("Entries record their compression codec")
+{
+  using namespace std::literals;
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+
+  auto important_data = "This is a secret message"sv;
+  auto important_data_span = std::span<const unsigned char>(
+      make_unsigned_char(important_data.data()), important_data.size());
+
+  compression_context encryption_context {{.codec = compression_codec::none}};
+  auto enc = encrypt(symkey_span_t {symkey},
+                     public_key_span_t {pk},
+                     encryption_context,
+                     important_data_span);
+  REQUIRE(enc[entry_codec_offset]
+          == static_cast<unsigned char>(compression_codec::none));
+
+  // The codec is taken from the header, not from the decrypting context
+  auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
+  REQUIRE_THAT(dec, equals_range(important_data_span));
+}
+
+TEST_CASE("Entries encrypted with AES-256-GCM")
+{
+  if (!aes256gcm_available()) {
+    SKIP("CPU has no AES instructions");
+  }
+  auto [pk, sk] = generate_keypair();
+  auto symkey = generate_symkey();
+
+  std::vector<unsigned char> important_data(2 * stream_chunk_size + 5);
+  randombytes_buf(important_data.data(), important_data.size());
+
+  compression_context context {};
+  auto enc = encrypt(symkey_span_t {symkey},
+                     public_key_span_t {pk},
+                     context,
+                     important_data,
+                     stream_cipher::aes256gcm);
+  REQUIRE(enc[entry_cipher_offset]
+          == static_cast<unsigned char>(stream_cipher::aes256gcm));
+
+  SECTION("decrypting")
+  {
+    auto dec = decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc);
+    REQUIRE_THAT(dec, equals_range(important_data));
+  }
+  SECTION("truncated entries are rejected")
+  {
+    enc.resize(enc.size() - 1);
+    REQUIRE_THROWS(
+        decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc));
+  }
+  SECTION("the cipher is authenticated")
+  {
+    enc[entry_cipher_offset] =
+        static_cast<unsigned char>(stream_cipher::xchacha20poly1305);
+    REQUIRE_THROWS(
+        decrypt(symkey_span_t {symkey}, private_key_span_t {sk}, enc));
+  }
+}
@@ -0,0 +1,75 @@
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "crypto/secure_arena.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include "crypto/safe_buffer.hpp"
+#include "crypto/secure_memory.hpp"
+
+TEST_CASE("Secure arena reuses freed chunks")
+{
+  constexpr std::size_t budget = 1UL << 20U;
+  secure_arena arena {budget};
+
+  void* const first = arena.allocate(10);
+  void* const second = arena.allocate(10);
+  REQUIRE(first != nullptr);
+  REQUIRE(second != nullptr);
+  REQUIRE(first != second);
+  std::memset(first, 0xaa, 10);
+  REQUIRE(arena.deallocate(first));
+  REQUIRE(arena.allocate(64) == first);
+
+  int outside {};
+  REQUIRE_FALSE(arena.deallocate(&outside));
+  REQUIRE(arena.allocate(secure_arena::largest_chunk + 1) == nullptr);
+  REQUIRE(arena.deallocate(first));
+  REQUIRE(arena.deallocate(second));
+}
+
+TEST_CASE("Secure arena stays within its budget")
+{
+  constexpr std::size_t budget = 1UL << 20U;
+  secure_arena arena {budget};
+  std::vector<void*> chunks {};
+  while (void* const chunk = arena.allocate(secure_arena::largest_chunk)) {
+    chunks.push_back(chunk);
+  }
+  REQUIRE(arena.locked_size() <= budget);
+  REQUIRE_FALSE(chunks.empty());
+  for (void* const chunk : chunks) {
+    REQUIRE(arena.deallocate(chunk));
+  }
+}
+
+TEST_CASE("Secure buffers larger than the arena chunks")
+{
+  safe_vector<unsigned char> large(secure_arena::largest_chunk * 3, 1);
+  safe_vector<unsigned char> small(100, 2);
+  REQUIRE(large.back() == 1);
+  REQUIRE(small.back() == 2);
+}
+
+TEST_CASE("Secure memory backends")
+{
+  const auto kind = GENERATE(secure_memory_kind::sodium,
+                             secure_memory_kind::mlock,
+                             secure_memory_kind::memfd_secret);
+  secure_memory_backend* backend = nullptr;
+  try {
+    backend = &get_secure_memory_backend(kind);
+  } catch (const std::runtime_error&) {
+    SKIP("Backend not supported by this system");
+  }
+  constexpr std::size_t size = 3 * secure_arena::largest_chunk + 5;
+  auto* const buffer = static_cast<unsigned char*>(backend->allocate(size));
+  REQUIRE(buffer != nullptr);
+  std::memset(buffer, 0xaa, size);
+  REQUIRE(buffer[size - 1] == 0xaa);
+  backend->deallocate(buffer, size);
+}
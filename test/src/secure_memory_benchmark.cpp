@@ -0,0 +1,49 @@
+#include <cstddef>
+#include <string>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include "crypto/secure_arena.hpp"
+#include "crypto/secure_memory.hpp"
+
+// Benchmarks are hidden, run them with `unit_tests "[!benchmark]"`
+
+TEST_CASE("Secure allocation cost by size", "[!benchmark]")
+{
+  const auto size = GENERATE(std::size_t {1'000},
+                             std::size_t {100'000},
+                             std::size_t {1'000'000},
+                             std::size_t {10'000'000});
+
+  // What small buffers cost when served by the arena instead
+  if (size <= secure_arena::largest_chunk) {
+    auto& arena = secure_arena::instance();
+    BENCHMARK("arena, " + std::to_string(size) + " bytes")
+    {
+      void* const buffer = arena.allocate(size);
+      arena.deallocate(buffer);
+      return buffer;
+    };
+  }
+
+  const auto kind = GENERATE(secure_memory_kind::sodium,
+                             secure_memory_kind::mlock,
+                             secure_memory_kind::memfd_secret);
+  secure_memory_backend* backend = nullptr;
+  try {
+    backend = &get_secure_memory_backend(kind);
+  } catch (const std::runtime_error&) {
+    SKIP("Backend not supported by this system");
+  }
+  BENCHMARK(std::string(backend->name()) + ", " + std::to_string(size)
+            + " bytes")
+  {
+    void* const buffer = backend->allocate(size);
+    // Touching the buffer includes the cost of faulting in its pages
+    static_cast<unsigned char*>(buffer)[size - 1] = 1;
+    backend->deallocate(buffer, size);
+    return buffer;
+  };
+}
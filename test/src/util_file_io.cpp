@@ -0,0 +1,150 @@
+#include <array>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crypto/stream.hpp"
+#include "util.hpp"
+#include "util/durable_write.hpp"
+#include "util/file_io.hpp"
+
+namespace
+{
+auto patterned_bytes(std::size_t size) -> std::vector<unsigned char>
+{
+  std::vector<unsigned char> bytes(size);
+  for (std::size_t index = 0; index < size; ++index) {
+    bytes[index] = static_cast<unsigned char>(index * 7 + index / 251);
+  }
+  return bytes;
+}
+
+auto temporary_file_path() -> std::filesystem::path
+{
+  return std::filesystem::temp_directory_path()
+      / ("diaria_file_io_test_" + std::to_string(getpid()));
+}
+}  // namespace
+
+TEST_CASE("Reading whole files")
+{
+  const auto size = GENERATE(std::size_t {0},
+                             std::size_t {1},
+                             unsized_read_step,
+                             3 * pump_map_threshold + 5);
+  const auto data = patterned_bytes(size);
+  const auto path = temporary_file_path();
+  write_file(path, data);
+
+  SECTION("into a buffer of their size")
+  {
+    REQUIRE_THAT(read_file(path), equals_range(data));
+  }
+  SECTION("through a sink")
+  {
+    const smart_fd input_fd {open_sequential(path)};
+    std::vector<unsigned char> pumped {};
+    container_sink sink {pumped};
+    pump_fd(input_fd.fd, sink);
+    REQUIRE_THAT(pumped, equals_range(data));
+  }
+  SECTION("through a sink from the middle")
+  {
+    const smart_fd input_fd {open_sequential(path)};
+    const auto skipped = static_cast<off_t>(size / 2);
+    REQUIRE(lseek(input_fd.fd, skipped, SEEK_SET) == skipped);
+    std::vector<unsigned char> pumped {};
+    container_sink sink {pumped};
+    pump_fd(input_fd.fd, sink);
+    REQUIRE_THAT(pumped,
+                 equals_range(std::vector<unsigned char>(
+                     data.begin() + skipped, data.end())));
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Reading pipes without knowing their size")
+{
+  const auto data = patterned_bytes(5 * unsized_read_step / 2);
+  std::array<int, 2> pipe_fds {};
+  REQUIRE(pipe(pipe_fds.data()) == 0);
+  const smart_fd read_end {pipe_fds[0]};
+  std::thread writer(
+      [&data, write_fd = pipe_fds[1]]
+      {
+        const smart_fd write_end {write_fd};
+        write_fully(write_end.fd, data);
+      });
+  const auto contents = read_fd(read_end.fd);
+  writer.join();
+  REQUIRE_THAT(contents, equals_range(data));
+}
+
+TEST_CASE("Buffered fd sink")
+{
+  const auto path = temporary_file_path();
+  std::vector<unsigned char> written {};
+  {
+    const smart_fd output_fd {
+        open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)};
+    REQUIRE(output_fd.fd != -1);
+    fd_sink sink {output_fd.fd};
+    const std::array<unsigned char, 3> small {'a', 'b', '\n'};
+    sink.write(small);
+    written.insert(written.end(), small.begin(), small.end());
+    REQUIRE(std::filesystem::file_size(path) == 0);
+
+    const auto large = patterned_bytes(stream_chunk_size / 2 * 3);
+    sink.write(large);
+    written.insert(written.end(), large.begin(), large.end());
+    sink.write(small);
+    written.insert(written.end(), small.begin(), small.end());
+    sink.finish();
+  }
+  REQUIRE_THAT(read_file(path), equals_range(written));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Durable file batches")
+{
+  const auto directory = temporary_file_path();
+  std::filesystem::create_directories(directory);
+  const auto data = patterned_bytes(1000);
+
+  SECTION("files appear once committed")
+  {
+    durable_file_batch batch {};
+    for (std::size_t index = 0; index < 3; ++index) {
+      batch.add(directory / std::to_string(index), data);
+    }
+    REQUIRE(std::filesystem::is_empty(directory));
+    batch.commit();
+    for (std::size_t index = 0; index < 3; ++index) {
+      REQUIRE_THAT(read_file(directory / std::to_string(index)),
+                   equals_range(data));
+    }
+  }
+  SECTION("existing files are replaced")
+  {
+    write_file(directory / "replaced", patterned_bytes(10));
+    write_file_durably(directory / "replaced", data);
+    REQUIRE_THAT(read_file(directory / "replaced"), equals_range(data));
+  }
+  SECTION("uncommitted files are discarded")
+  {
+    {
+      durable_file_batch batch {};
+      batch.add(directory / "discarded", data);
+    }
+    REQUIRE(std::filesystem::is_empty(directory));
+  }
+  std::filesystem::remove_all(directory);
+}
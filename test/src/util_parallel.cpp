@@ -0,0 +1,72 @@
+#include <cstddef>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include "util/parallel.hpp"
+
+TEST_CASE("Ordered parallel processing")
+{
+  const auto jobs = GENERATE(std::size_t {1}, std::size_t {4});
+  std::vector<int> items(100);
+  std::iota(items.begin(), items.end(), 0);
+
+  SECTION("results arrive in order")
+  {
+    std::vector<int> results {};
+    ordered_parallel_for_each(
+        items,
+        jobs,
+        // Assertions are not thread safe, so a bad worker index is reported
+        // through the result
+        [jobs](std::size_t worker, int item)
+        { return worker < jobs ? item * 2 : -1; },
+        [&results](int result)
+        {
+          results.push_back(result);
+          return true;
+        });
+    REQUIRE(results.size() == items.size());
+    for (std::size_t index = 0; index < results.size(); ++index) {
+      REQUIRE(results[index] == static_cast<int>(index) * 2);
+    }
+  }
+  SECTION("consuming can stop early")
+  {
+    std::size_t consumed = 0;
+    ordered_parallel_for_each(
+        items,
+        jobs,
+        [](std::size_t, int item) { return item; },
+        [&consumed](int result)
+        {
+          ++consumed;
+          return result < 9;
+        });
+    REQUIRE(consumed == 10);
+  }
+  SECTION("errors are rethrown in order")
+  {
+    std::vector<int> results {};
+    REQUIRE_THROWS_AS(ordered_parallel_for_each(
+                          items,
+                          jobs,
+                          [](std::size_t, int item)
+                          {
+                            if (item == 42) {
+                              throw std::runtime_error("failed item");
+                            }
+                            return item;
+                          },
+                          [&results](int result)
+                          {
+                            results.push_back(result);
+                            return true;
+                          }),
+                      std::runtime_error);
+    REQUIRE(results.size() == 42);
+  }
+}
@@ -1,4 +1,7 @@
 #include <chrono>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <catch2/catch_test_macros.hpp>
 
@@ -32,3 +35,70 @@ TEST_CASE("Time utilities")
     REQUIRE(to_ymd(known_date) == std::chrono::January / 13 / 2025);
   }
 }
+
+TEST_CASE("Time range queries")
+{
+  using std::chrono::utc_clock;
+  const auto day = [](int count)
+  { return utc_clock::time_point {std::chrono::days {count}}; };
+  const std::vector<utc_clock::time_point> times = {
+      day(1), day(2), day(2), day(5), day(8), day(9), day(12)};
+  const auto query = [&times](std::vector<time_range> ranges)
+  {
+    std::vector<utc_clock::time_point> found;
+    for (const auto& slice : slices_within(times, std::move(ranges), {})) {
+      found.insert(found.end(), slice.begin(), slice.end());
+    }
+    return found;
+  };
+
+  SECTION("bounds are inclusive")
+  {
+    REQUIRE(query({{day(2), day(5)}})
+            == std::vector {day(2), day(2), day(5)});
+  }
+  SECTION("overlapping and unsorted ranges return every time once")
+  {
+    REQUIRE(query({{day(8), day(20)}, {day(0), day(1)}, {day(7), day(9)}})
+            == std::vector {day(1), day(8), day(9), day(12)});
+  }
+  SECTION("ranges without times")
+  {
+    REQUIRE(query({{day(3), day(4)}, {day(10), day(11)}}).empty());
+    REQUIRE(query({{day(5), day(2)}}).empty());
+  }
+  SECTION("unbounded range")
+  {
+    REQUIRE(query({time_range {}}) == times);
+  }
+}
+
+TEST_CASE("Duration parsing")
+{
+  REQUIRE(parse_duration("12h") == std::chrono::hours {12});
+  REQUIRE(parse_duration("3d") == std::chrono::days {3});
+  REQUIRE(parse_duration("1y") == std::chrono::years {1});
+  REQUIRE_THROWS_AS(parse_duration("d"), std::invalid_argument);
+  REQUIRE_THROWS_AS(parse_duration("3"), std::invalid_argument);
+  REQUIRE_THROWS_AS(parse_duration("3x"), std::invalid_argument);
+}
+
+TEST_CASE("ISO timestamp parsing")
+{
+  using namespace std::chrono_literals;
+  const auto expected = std::chrono::sys_days {std::chrono::January / 13 / 2025}
+      + 15h + 35min + 35s;
+  REQUIRE(parse_iso_timestamp("2025-01-13T15:35:35") == expected);
+  REQUIRE(parse_iso_timestamp("2025-01-13T15:35:35.diaria") == expected);
+  REQUIRE(parse_iso_timestamp("2024-02-29T00:00:00")
+          == std::chrono::sys_days {std::chrono::February / 29 / 2024});
+
+  REQUIRE_FALSE(parse_iso_timestamp("2025-01-13T15:35").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2025-01-13 15:35:35").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2025-1-13T15:35:35.").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2025-13-01T15:35:35").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2023-02-29T15:35:35").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2025-01-13T24:00:00").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("2025-01-13T15:60:00").has_value());
+  REQUIRE_FALSE(parse_iso_timestamp("dump.diaria.backup").has_value());
+}